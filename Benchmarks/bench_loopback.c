@@ -0,0 +1,491 @@
+/*
+* In-memory loopback transport and broker stand-in, see Benchmarks/bench_loopback.h. Supplies the
+*   functions the MQTT core needs from the application. Everything the client writes is decoded by
+*   the broker stand-in right away and its answers are queued for the client to read, so a blocking
+*   mqtt_Connect or a publish followed by mqtt_pollInput completes without another thread
+*
+*/
+#include <string.h>
+
+#include "Benchmarks/bench_loopback.h"
+#include "MQTT/mqtt_rlength.h"
+
+// Where the broker stand-in is in the packet the client is writing
+#define BROKER_TYPE      0
+#define BROKER_LENGTH    1
+#define BROKER_BODY      2
+
+uint32_t bench_loopbackTime;
+
+static void brokerInput( struct bench_loopback* lb, const uint8_t* data, int32_t len );
+static int32_t brokerWant( struct bench_loopback* lb );
+static void brokerPacket( struct bench_loopback* lb );
+static void brokerPublish( struct bench_loopback* lb, int32_t topicLength, int32_t offset );
+static void brokerAnswer( struct bench_loopback* lb, const uint8_t* data, int32_t len );
+static int32_t brokerFilters( struct bench_loopback* lb, uint8_t* pCodes, int32_t maxCodes, int hasOptions );
+
+void bench_loopbackInit( struct bench_loopback* lb, const char* clientId, uint8_t script )
+{
+	memset( lb, 0, sizeof( *lb ) );
+	strncpy( ( char* )lb->mqtt.clientId, clientId, sizeof( lb->mqtt.clientId ) - 1 );
+	lb->mqtt.network_tag = lb;
+	lb->mqtt.keepaliveTimeout = 60;
+	lb->script = script;
+}
+
+int bench_loopbackInject( struct bench_loopback* lb, const uint8_t* data, int32_t len )
+{
+	if ( lb->head + len > BENCH_LOOPBACK_SIZE )
+	{
+		memmove( lb->toClient, &lb->toClient[ lb->tail ], lb->head - lb->tail );
+		lb->head -= lb->tail;
+		lb->tail = 0;
+		if ( lb->head + len > BENCH_LOOPBACK_SIZE )
+		{
+			return MQTT_ERROR;
+		}
+	}
+	memcpy( &lb->toClient[ lb->head ], data, len );
+	lb->head += len;
+	return MQTT_SUCCESS;
+}
+
+int32_t bench_loopbackPending( struct bench_loopback* lb )
+{
+	return lb->head - lb->tail;
+}
+
+int32_t bench_encodePublish( uint8_t* pDestination, const char* topic, uint16_t topicLength, const uint8_t* pData, int32_t len, uint8_t qos, uint16_t packetId )
+{
+	int32_t remainingLength = 2 + topicLength + ( ( qos > 0 ) ? 2 : 0 ) + ( MQTT_VERSION_5 ? 1 : 0 ) + len;
+	uint8_t* pCursor = pDestination;
+
+	*( pCursor++ ) = MQTT_PACKET_TYPE_PUBLISH | ( qos << 1 );
+	pCursor = mqtt_encodeRemainingLength( pCursor, remainingLength );
+	*( pCursor++ ) = 0xFF & ( topicLength >> 8 );
+	*( pCursor++ ) = 0xFF & topicLength;
+	memcpy( pCursor, topic, topicLength );
+	pCursor += topicLength;
+	if ( qos > 0 )
+	{
+		*( pCursor++ ) = 0xFF & ( packetId >> 8 );
+		*( pCursor++ ) = 0xFF & packetId;
+	}
+#if MQTT_VERSION_5
+	// No properties
+	*( pCursor++ ) = 0;
+#endif
+	memcpy( pCursor, pData, len );
+	return ( int32_t )( pCursor - pDestination ) + len;
+}
+
+// Functions the core needs from the application
+
+int mqtt_writev( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count )
+{
+	struct bench_loopback* lb = ( struct bench_loopback* )tag;
+	int total = 0;
+
+	lb->writes++;
+	for ( int i = 0; i < count; i++ )
+	{
+		brokerInput( lb, iov[ i ].base, iov[ i ].len );
+		total += iov[ i ].len;
+	}
+	lb->bytesWritten += total;
+	return total;
+}
+
+int mqtt_read( struct mqtt_context* tag, uint8_t* ptr, int32_t len )
+{
+	struct bench_loopback* lb = ( struct bench_loopback* )tag;
+	int32_t count = lb->head - lb->tail;
+
+	if ( count > len )
+	{
+		count = len;
+	}
+	memcpy( ptr, &lb->toClient[ lb->tail ], count );
+	lb->tail += count;
+	lb->bytesRead += count;
+	if ( lb->tail == lb->head )
+	{
+		lb->head = 0;
+		lb->tail = 0;
+	}
+	return count;
+}
+
+#if MQTT_ZERO_COPY_RECEIVE
+int32_t mqtt_readView( struct mqtt_context* tag, uint8_t** pptr, int32_t len )
+{
+	struct bench_loopback* lb = ( struct bench_loopback* )tag;
+
+	// Nothing arrives later, what is not there yet would time out
+	if ( lb->head - lb->tail < len )
+	{
+		return 0;
+	}
+	*pptr = &lb->toClient[ lb->tail ];
+	return len;
+}
+
+void mqtt_releaseView( struct mqtt_context* tag, int32_t len )
+{
+	struct bench_loopback* lb = ( struct bench_loopback* )tag;
+
+	lb->tail += len;
+	lb->bytesRead += len;
+	if ( lb->tail == lb->head )
+	{
+		lb->head = 0;
+		lb->tail = 0;
+	}
+}
+#endif
+
+#if MQTT_TX_PRIORITY
+int32_t mqtt_txQueued( struct mqtt_context* tag )
+{
+	// The broker stand-in takes every write whole
+	( void )tag;
+	return 0;
+}
+#endif
+
+uint32_t mqtt_getTime( struct mqtt_context* tag )
+{
+	( void )tag;
+	return bench_loopbackTime;
+}
+
+int mqtt_processPacket( struct mqtt_context* tag, struct mqtt_header* header )
+{
+	uint8_t buffer[ 256 ];
+	int32_t remaining = header->remainingLength, chunk;
+
+	// Nothing the core passes up is of interest here, read it and carry on
+	while ( remaining > 0 )
+	{
+		chunk = ( remaining < ( int32_t )sizeof( buffer ) ) ? remaining : ( int32_t )sizeof( buffer );
+		if ( mqtt_receive( tag, buffer, chunk ) != chunk )
+		{
+			return MQTT_ERROR;
+		}
+		remaining -= chunk;
+	}
+	return MQTT_SUCCESS;
+}
+
+int mqtt_processPublish( struct mqtt_context* tag, struct mqtt_message* msg )
+{
+	struct bench_loopback* lb = ( struct bench_loopback* )tag;
+
+	if ( lb->refuse > 0 )
+	{
+		lb->refuse--;
+		return MQTT_ERROR;
+	}
+	lb->delivered++;
+	lb->deliveredBytes += msg->len;
+	if ( lb->onDeliver != NULL )
+	{
+		lb->onDeliver( lb, msg );
+	}
+	return MQTT_SUCCESS;
+}
+
+// Broker stand-in
+
+// Decode what the client wrote, packets may be split over any number of calls
+static void brokerInput( struct bench_loopback* lb, const uint8_t* data, int32_t len )
+{
+	int32_t chunk;
+	int complete;
+
+	while ( len > 0 )
+	{
+		switch ( lb->state )
+		{
+		case BROKER_TYPE:
+			lb->type = *( data++ );
+			len--;
+			lb->length = 0;
+			lb->shift = 0;
+			lb->count = 0;
+			lb->state = BROKER_LENGTH;
+			break;
+
+		case BROKER_LENGTH:
+			complete = mqtt_decodeRemainingLengthByte( &lb->length, &lb->shift, *( data++ ) );
+			len--;
+			if ( complete < 0 )
+			{
+				lb->errors++;
+				lb->state = BROKER_TYPE;
+			}
+			else if ( complete > 0 )
+			{
+				lb->packetsWritten++;
+				lb->want = brokerWant( lb );
+				lb->state = BROKER_BODY;
+				if ( lb->length == 0 )
+				{
+					brokerPacket( lb );
+					lb->state = BROKER_TYPE;
+				}
+			}
+			break;
+
+		default:
+			chunk = lb->length - lb->count;
+			if ( chunk > len )
+			{
+				chunk = len;
+			}
+			// Keep what needs to be looked at, only count the rest
+			if ( lb->count < lb->want )
+			{
+				if ( chunk > lb->want - lb->count )
+				{
+					chunk = lb->want - lb->count;
+				}
+				memcpy( &lb->scratch[ lb->count ], data, chunk );
+			}
+			data += chunk;
+			len -= chunk;
+			lb->count += chunk;
+
+			if ( lb->count == lb->want )
+			{
+				lb->want = brokerWant( lb );
+			}
+			if ( lb->count == lb->length )
+			{
+				brokerPacket( lb );
+				lb->state = BROKER_TYPE;
+			}
+			break;
+		}
+	}
+}
+
+// Body bytes the current packet needs kept in scratch, as far as can be told from what is there
+static int32_t brokerWant( struct bench_loopback* lb )
+{
+	int32_t want = 0;
+
+	switch ( lb->type & 0xF0 )
+	{
+	case MQTT_PACKET_TYPE_PUBLISH:
+		// Topic length first, then up to the Packet Identifier of a QoS 1 or 2 message. All of it if it
+		//   is passed on
+		if ( lb->onPublish != NULL )
+		{
+			want = lb->length;
+		}
+		else if ( lb->type & 0x06 )
+		{
+			want = ( lb->count < 2 ) ? 2 : 2 + ( ( lb->scratch[ 0 ] << 8 ) | lb->scratch[ 1 ] ) + 2;
+		}
+		break;
+
+	case MQTT_PACKET_TYPE_SUBSCRIBE & 0xF0:
+	case MQTT_PACKET_TYPE_UNSUBSCRIBE & 0xF0:
+	case 0x60:	// PUBREL
+		want = lb->length;
+		break;
+	}
+
+	if ( want > lb->length )
+	{
+		want = lb->length;
+	}
+	return ( want < BENCH_BROKER_SCRATCH ) ? want : BENCH_BROKER_SCRATCH;
+}
+
+// Act on a packet the client completed, answers go out as the script says
+static void brokerPacket( struct bench_loopback* lb )
+{
+	uint8_t answer[ 8 + BENCH_BROKER_SCRATCH ];
+	uint8_t* pCursor;
+	int32_t codes, topicLength, offset;
+
+	switch ( lb->type & 0xF0 )
+	{
+	case MQTT_PACKET_TYPE_CONNECT:
+	{
+#if MQTT_VERSION_5
+		static const uint8_t connAck[] = { MQTT_PACKET_TYPE_CONNACK, 3, 0, 0, 0 };
+		static const uint8_t connAckAlias[] = { MQTT_PACKET_TYPE_CONNACK, 6, 0, 0, 3, 0x22, 0, MQTT_MAX_TOPIC_ALIASES };
+
+		if ( lb->script & BENCH_BROKER_ALIAS )
+		{
+			brokerAnswer( lb, connAckAlias, sizeof( connAckAlias ) );
+			break;
+		}
+#else
+		static const uint8_t connAck[] = { MQTT_PACKET_TYPE_CONNACK, 2, 0, 0 };
+#endif
+		brokerAnswer( lb, connAck, sizeof( connAck ) );
+		break;
+	}
+
+	case MQTT_PACKET_TYPE_PUBLISH:
+		// Nothing was kept of a QoS 0 message nobody takes
+		if ( lb->want == 0 )
+		{
+			break;
+		}
+		topicLength = ( lb->want >= 2 ) ? ( lb->scratch[ 0 ] << 8 ) | lb->scratch[ 1 ] : lb->length;
+		offset = 2 + topicLength + ( ( lb->type & 0x06 ) ? 2 : 0 );
+		if ( offset > lb->want )
+		{
+			lb->errors++;
+			break;
+		}
+		if ( lb->onPublish != NULL )
+		{
+			brokerPublish( lb, topicLength, offset );
+		}
+		if ( lb->type & 0x06 )
+		{
+			answer[ 0 ] = ( lb->type & 0x04 ) ? 0x50 : 0x40;	// PUBREC for QoS 2, PUBACK for QoS 1
+			answer[ 1 ] = 2;
+			answer[ 2 ] = lb->scratch[ offset - 2 ];
+			answer[ 3 ] = lb->scratch[ offset - 1 ];
+			brokerAnswer( lb, answer, 4 );
+		}
+		break;
+
+	case 0x60:	// PUBREL
+		if ( lb->want < 2 )
+		{
+			lb->errors++;
+			break;
+		}
+		answer[ 0 ] = 0x70;		// PUBCOMP
+		answer[ 1 ] = 2;
+		answer[ 2 ] = lb->scratch[ 0 ];
+		answer[ 3 ] = lb->scratch[ 1 ];
+		brokerAnswer( lb, answer, 4 );
+		break;
+
+	case MQTT_PACKET_TYPE_SUBSCRIBE & 0xF0:
+	case MQTT_PACKET_TYPE_UNSUBSCRIBE & 0xF0:
+	{
+		int subscribe = ( ( lb->type & 0xF0 ) == ( MQTT_PACKET_TYPE_SUBSCRIBE & 0xF0 ) );
+		uint8_t codeList[ BENCH_BROKER_SCRATCH / 3 ];
+
+		codes = ( lb->want == lb->length ) ? brokerFilters( lb, codeList, sizeof( codeList ), subscribe ) : -1;
+		if ( codes < 0 )
+		{
+			lb->errors++;
+			break;
+		}
+		// MQTT 3.1.1 UNSUBACK has no Reason Codes
+		if ( !subscribe && !MQTT_VERSION_5 )
+		{
+			codes = 0;
+		}
+		answer[ 0 ] = subscribe ? MQTT_PACKET_TYPE_SUBACK : MQTT_PACKET_TYPE_UNSUBACK;
+		pCursor = mqtt_encodeRemainingLength( &answer[ 1 ], 2 + ( MQTT_VERSION_5 ? 1 : 0 ) + codes );
+		*( pCursor++ ) = lb->scratch[ 0 ];
+		*( pCursor++ ) = lb->scratch[ 1 ];
+#if MQTT_VERSION_5
+		*( pCursor++ ) = 0;
+#endif
+		memcpy( pCursor, codeList, codes );
+		brokerAnswer( lb, answer, ( int32_t )( pCursor - answer ) + codes );
+		break;
+	}
+
+	case MQTT_PACKET_TYPE_PINGREQ:
+	{
+		static const uint8_t pingResp[] = { MQTT_PACKET_TYPE_PINGRESP, 0 };
+
+		brokerAnswer( lb, pingResp, sizeof( pingResp ) );
+		break;
+	}
+	}
+}
+
+// Hand a publish kept whole in scratch to onPublish. offset is where its properties or payload start
+static void brokerPublish( struct bench_loopback* lb, int32_t topicLength, int32_t offset )
+{
+#if MQTT_VERSION_5
+	int32_t propertiesLength, used;
+#endif
+
+	if ( lb->want != lb->length )
+	{
+		lb->errors++;
+		return;
+	}
+#if MQTT_VERSION_5
+	used = mqtt_decodeRemainingLength( &lb->scratch[ offset ], lb->length - offset, &propertiesLength );
+	if ( ( used <= 0 ) || ( offset + used + propertiesLength > lb->length ) )
+	{
+		lb->errors++;
+		return;
+	}
+	offset += used + propertiesLength;
+#endif
+	lb->onPublish( lb, ( const char* )&lb->scratch[ 2 ], ( uint16_t )topicLength, &lb->scratch[ offset ], lb->length - offset );
+}
+
+static void brokerAnswer( struct bench_loopback* lb, const uint8_t* data, int32_t len )
+{
+	if ( !( lb->script & BENCH_BROKER_ACK ) )
+	{
+		return;
+	}
+	if ( bench_loopbackInject( lb, data, len ) != MQTT_SUCCESS )
+	{
+		lb->errors++;
+	}
+}
+
+// Walk the Topic Filters of a SUBSCRIBE or UNSUBSCRIBE in scratch. Every filter is granted the QoS it
+//   asked for, UNSUBSCRIBE gets success. Returns the number of filters or -1 if the body is malformed
+static int32_t brokerFilters( struct bench_loopback* lb, uint8_t* pCodes, int32_t maxCodes, int hasOptions )
+{
+	int32_t offset = 2, codes = 0, filterLength;
+
+#if MQTT_VERSION_5
+	int32_t propertiesLength, used = mqtt_decodeRemainingLength( &lb->scratch[ 2 ], lb->length - 2, &propertiesLength );
+
+	if ( used <= 0 )
+	{
+		return -1;
+	}
+	offset += used + propertiesLength;
+#endif
+
+	while ( offset < lb->length )
+	{
+		if ( ( offset + 2 > lb->length ) || ( codes == maxCodes ) )
+		{
+			return -1;
+		}
+		filterLength = ( lb->scratch[ offset ] << 8 ) | lb->scratch[ offset + 1 ];
+		offset += 2 + filterLength;
+		if ( hasOptions )
+		{
+			if ( offset >= lb->length )
+			{
+				return -1;
+			}
+			if ( lb->onSubscribe != NULL )
+			{
+				lb->onSubscribe( lb, ( const char* )&lb->scratch[ offset - filterLength ], ( uint16_t )filterLength );
+			}
+			pCodes[ codes++ ] = lb->scratch[ offset++ ] & 0x03;
+		}
+		else
+		{
+			pCodes[ codes++ ] = 0;
+		}
+	}
+	return ( offset == lb->length ) ? codes : -1;
+}
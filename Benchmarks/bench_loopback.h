@@ -0,0 +1,81 @@
+/*
+* This file contains an in-memory loopback transport for the MQTT core with a scripted broker stand-in
+*   on the other end, so the core can be measured on a host without a network or a real broker.
+*   Host build only, see Benchmarks/ReadMe.txt
+*
+*/
+#ifndef BENCH_LOOPBACK_H
+#define BENCH_LOOPBACK_H
+
+#include <stdint.h>
+
+#include "MQTT/mqtt.h"
+
+// Bytes the broker stand-in can have waiting for the client. Packets that do not fit are lost and
+//   counted in errors
+#ifndef BENCH_LOOPBACK_SIZE
+#define BENCH_LOOPBACK_SIZE 65536
+#endif
+
+// Bytes of a packet body the broker stand-in looks at. The rest, the payload of a publish mostly, is
+//   only counted. SUBSCRIBE and UNSUBSCRIBE must fit whole, a PUBLISH up to its Packet Identifier, or
+//   whole as well when it is passed to onPublish
+#ifndef BENCH_BROKER_SCRATCH
+#define BENCH_BROKER_SCRATCH 1024
+#endif
+
+// What the broker stand-in does with the packets it gets from the client
+#define BENCH_BROKER_ACK    0x01	// Answer CONNECT, SUBSCRIBE, UNSUBSCRIBE, PINGREQ and QoS 1 and 2 publishes
+#define BENCH_BROKER_ALIAS  0x02	// Allow the client Topic Aliases in the CONNACK, MQTT 5 only
+
+// One connection. The context comes first, so the pointer the core passes to the hooks is the loopback
+struct bench_loopback {
+	struct mqtt_context mqtt;
+	uint8_t  script;					// BENCH_BROKER_ flags
+	// Optional hooks, set after bench_loopbackInit. The broker stand-in calls onSubscribe for every
+	//   Topic Filter the client subscribes to and onPublish for every publish it gets, onDeliver is
+	//   called for every message the core passes up to the client
+	void ( *onSubscribe )( struct bench_loopback* lb, const char* filter, uint16_t filterLength );
+	void ( *onPublish )( struct bench_loopback* lb, const char* topic, uint16_t topicLength, const uint8_t* pData, int32_t len );
+	void ( *onDeliver )( struct bench_loopback* lb, struct mqtt_message* msg );
+	void*    user;						// For the hooks
+	uint32_t refuse;					// Calls of mqtt_processPublish to fail before it takes messages again
+	// Server to client bytes not read yet, from tail up to head. Moved to the front when room runs out
+	uint8_t  toClient[ BENCH_LOOPBACK_SIZE ];
+	int32_t  head;
+	int32_t  tail;
+	// Broker stand-in decoder, where it is in the packet the client is writing
+	uint8_t  state;
+	uint8_t  type;
+	uint8_t  shift;
+	int32_t  length;					// Remaining Length
+	int32_t  count;						// Body bytes seen so far
+	int32_t  want;						// Body bytes to keep in scratch
+	uint8_t  scratch[ BENCH_BROKER_SCRATCH ];
+	// Counters, cleared by bench_loopbackInit only (output)
+	uint32_t writes;					// mqtt_writev calls
+	uint64_t bytesWritten;
+	uint32_t packetsWritten;
+	uint64_t bytesRead;					// Taken by the client, with mqtt_read or a view
+	uint32_t delivered;					// mqtt_processPublish calls that took the message
+	uint64_t deliveredBytes;
+	uint32_t errors;					// Malformed packets and answers that did not fit
+};
+
+// Free running millisecond clock returned by mqtt_getTime for every connection. Only moves when the
+//   benchmark moves it
+extern uint32_t bench_loopbackTime;
+
+void bench_loopbackInit( struct bench_loopback* lb, const char* clientId, uint8_t script );
+
+// Queue bytes for the client as if the server sent them. Returns MQTT_ERROR if they do not fit
+int  bench_loopbackInject( struct bench_loopback* lb, const uint8_t* data, int32_t len );
+
+// Bytes queued for the client that it did not read yet
+int32_t bench_loopbackPending( struct bench_loopback* lb );
+
+// Build the PUBLISH a server would send, into pDestination. Returns its length. The packet takes at
+//   most 5 + 2 + topicLength + 2 + 1 + len bytes
+int32_t bench_encodePublish( uint8_t* pDestination, const char* topic, uint16_t topicLength, const uint8_t* pData, int32_t len, uint8_t qos, uint16_t packetId );
+
+#endif /* BENCH_LOOPBACK_H */
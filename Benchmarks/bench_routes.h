@@ -0,0 +1,76 @@
+/*
+* Generated by Tools/mqtt_phashgen.c, do not edit
+*
+*/
+#include "MQTT/mqtt_phash.h"
+
+void benchHandler( struct mqtt_message* msg );
+
+static const struct mqtt_phashEntry bench_staticRoutes_slots[ 64 ] = {
+	{ "sensors/pressure", 16, benchHandler },
+	{ "sensors/noise", 13, benchHandler },
+	{ "config/time", 11, benchHandler },
+	{ "cmd/ping", 8, benchHandler },
+	{ NULL, 0, NULL },
+	{ "actuators/fan", 13, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "sensors/humidity", 16, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "cmd/identify", 12, benchHandler },
+	{ "sensors/light", 13, benchHandler },
+	{ "config/log", 10, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "status/battery", 14, benchHandler },
+	{ NULL, 0, NULL },
+	{ "sensors/co2", 11, benchHandler },
+	{ "alarm/clear", 11, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "cmd/reset", 9, benchHandler },
+	{ NULL, 0, NULL },
+	{ "ota/abort", 9, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "actuators/led", 13, benchHandler },
+	{ NULL, 0, NULL },
+	{ "sensors/temperature", 19, benchHandler },
+	{ NULL, 0, NULL },
+	{ "alarm/intrusion", 15, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "status/uptime", 13, benchHandler },
+	{ "status/rssi", 11, benchHandler },
+	{ NULL, 0, NULL },
+	{ "config/mqtt", 11, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "alarm/water", 11, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "ota/chunk", 9, benchHandler },
+	{ "config/network", 14, benchHandler },
+	{ NULL, 0, NULL },
+	{ "ota/begin", 9, benchHandler },
+	{ "actuators/heater", 16, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "actuators/valve1", 16, benchHandler },
+	{ "cmd/reboot", 10, benchHandler },
+	{ "ota/end", 7, benchHandler },
+	{ NULL, 0, NULL },
+	{ "status/heap", 11, benchHandler },
+	{ "actuators/pump", 14, benchHandler },
+	{ "alarm/fire", 10, benchHandler },
+	{ NULL, 0, NULL },
+	{ NULL, 0, NULL },
+	{ "actuators/valve2", 16, benchHandler },
+};
+
+static const struct mqtt_phashTable bench_staticRoutes = { 4468UL, 63UL, bench_staticRoutes_slots };
@@ -0,0 +1,349 @@
+/*
+* Benchmark suite for the MQTT core over the in-memory loopback transport in Benchmarks/bench_loopback.c.
+*   Measures CONNECT, publishing at various topic and payload sizes and QoS levels, subscribing to
+*   several filters at once and the dispatch of inbound publishes. Prints one JSON object per line,
+*   the first describes the build, every other one a case, so results can be kept and compared
+*   across releases. Linux host build only, see Benchmarks/ReadMe.txt
+*
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "Benchmarks/bench_loopback.h"
+
+// Operations per case unless given on the command line. A tenth as many are run first to warm up
+#define DEFAULT_OPS 200000
+
+// Inbound publishes are injected in batches of about this many bytes, and fed in pieces of a TCP segment
+#define DISPATCH_BATCH_BYTES 16384
+#define FEED_SEGMENT 1460
+
+static struct bench_loopback lb;
+static uint8_t payload[ 4096 ];
+static uint8_t batch[ DISPATCH_BATCH_BYTES + sizeof( payload ) + 128 ];
+static long allocations;
+
+#if defined( __GLIBC__ )
+// Count every heap allocation made while a case runs. The core is meant not to make any
+extern void* __libc_malloc( size_t size );
+extern void* __libc_calloc( size_t count, size_t size );
+extern void* __libc_realloc( void* ptr, size_t size );
+
+void* malloc( size_t size )
+{
+	allocations++;
+	return __libc_malloc( size );
+}
+
+void* calloc( size_t count, size_t size )
+{
+	allocations++;
+	return __libc_calloc( count, size );
+}
+
+void* realloc( void* ptr, size_t size )
+{
+	allocations++;
+	return __libc_realloc( ptr, size );
+}
+#define ALLOCATIONS_COUNTED 1
+#else
+#define ALLOCATIONS_COUNTED 0
+#endif
+
+struct measurement {
+	uint64_t start;
+	long     allocations;
+	uint64_t bytes;						// Written and read by the client
+};
+
+static uint64_t now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fail( const char* what )
+{
+	fprintf( stderr, "%s failed\n", what );
+	exit( 1 );
+}
+
+static void begin( struct measurement* m )
+{
+	m->allocations = allocations;
+	m->bytes = lb.bytesWritten + lb.bytesRead;
+	m->start = now();
+}
+
+// One line per case. params is the rest of the JSON object that tells the case apart
+static void end( struct measurement* m, const char* bench, const char* params, long ops )
+{
+	uint64_t ns = now() - m->start;
+
+	if ( lb.errors > 0 )
+	{
+		fail( bench );
+	}
+	printf( "{\"bench\":\"%s\",%s,\"ops\":%ld,\"ns_per_op\":%.1f,\"msgs_per_s\":%.0f,",
+		bench, params, ops, ( double )ns / ops, ( ns > 0 ) ? ops * 1e9 / ns : 0.0 );
+	if ( ALLOCATIONS_COUNTED )
+	{
+		printf( "\"allocs_per_op\":%.3f,", ( double )( allocations - m->allocations ) / ops );
+	}
+	else
+	{
+		printf( "\"allocs_per_op\":null," );
+	}
+	printf( "\"wire_bytes_per_op\":%.1f}\n", ( double )( lb.bytesWritten + lb.bytesRead - m->bytes ) / ops );
+	fflush( stdout );
+}
+
+static void startConnection( uint8_t script )
+{
+	bench_loopbackInit( &lb, "bench", script );
+	if ( mqtt_Connect( &lb.mqtt ) != MQTT_CONNECT_ACCEPTED )
+	{
+		fail( "connect" );
+	}
+}
+
+// Take in everything the broker stand-in answered
+static void drain( void )
+{
+	while ( bench_loopbackPending( &lb ) > 0 )
+	{
+		if ( mqtt_pollInput( &lb.mqtt ) != MQTT_SUCCESS )
+		{
+			fail( "poll" );
+		}
+	}
+}
+
+// A topic of length characters, "bench/" padded with letters
+static void makeTopic( char* topic, int length )
+{
+	memcpy( topic, "bench/", 6 );
+	for ( int i = 6; i < length; i++ )
+	{
+		topic[ i ] = 'a' + i % 26;
+	}
+	topic[ length ] = '\0';
+}
+
+// CONNECT, CONNACK and DISCONNECT, the connection set up again every time
+static void benchConnect( long ops )
+{
+	struct measurement m;
+	long i;
+
+	startConnection( BENCH_BROKER_ACK );
+	for ( i = 0; i < ops / 10; i++ )
+	{
+		mqtt_Connect( &lb.mqtt );
+		mqtt_Disconnect( &lb.mqtt );
+	}
+
+	begin( &m );
+	for ( i = 0; i < ops; i++ )
+	{
+		if ( mqtt_Connect( &lb.mqtt ) != MQTT_CONNECT_ACCEPTED )
+		{
+			fail( "connect" );
+		}
+		mqtt_Disconnect( &lb.mqtt );
+	}
+	end( &m, "connect", "\"clean\":1", ops );
+}
+
+// One publish after the other. QoS 1 and 2 wait for their acknowledgements before the next one, so
+//   the time includes taking those in
+static void benchPublish( uint8_t qos, int topicLength, int32_t len, long ops )
+{
+	char topic[ 128 ], params[ 96 ];
+	struct measurement m;
+	long i, round;
+
+	makeTopic( topic, topicLength );
+	startConnection( BENCH_BROKER_ACK | BENCH_BROKER_ALIAS );
+
+	for ( round = 0; round < 2; round++ )
+	{
+		long count = ( round == 0 ) ? ops / 10 : ops;
+
+		begin( &m );
+		for ( i = 0; i < count; i++ )
+		{
+			if ( mqtt_publish( &lb.mqtt, topic, payload, len, qos ) != MQTT_SUCCESS )
+			{
+				fail( "publish" );
+			}
+			if ( qos > 0 )
+			{
+				mqtt_flush( &lb.mqtt );
+				drain();
+			}
+		}
+		mqtt_flush( &lb.mqtt );
+	}
+
+	snprintf( params, sizeof( params ), "\"qos\":%u,\"topic\":%d,\"payload\":%ld", qos, topicLength, ( long )len );
+	end( &m, "publish", params, ops );
+}
+
+// SUBSCRIBE for count filters in one packet and its SUBACK
+static void benchSubscribe( int count, long ops )
+{
+	static char filters[ MQTT_MAX_FILTERS_PER_PACKET ][ 32 ];
+	struct mqtt_subscription subscriptions[ MQTT_MAX_FILTERS_PER_PACKET ];
+	char params[ 32 ];
+	struct measurement m;
+	long i, round;
+
+	for ( i = 0; i < count; i++ )
+	{
+		snprintf( filters[ i ], sizeof( filters[ i ] ), "bench/sensor/%ld/+", i );
+		subscriptions[ i ].topicFilter = filters[ i ];
+		subscriptions[ i ].qos = i % 3;
+	}
+	startConnection( BENCH_BROKER_ACK );
+
+	for ( round = 0; round < 2; round++ )
+	{
+		long rounds = ( round == 0 ) ? ops / 10 : ops;
+
+		begin( &m );
+		for ( i = 0; i < rounds; i++ )
+		{
+			if ( mqtt_subscribe_many( &lb.mqtt, subscriptions, ( uint16_t )count ) != MQTT_SUCCESS )
+			{
+				fail( "subscribe" );
+			}
+			drain();
+			if ( subscriptions[ count - 1 ].returnCode != subscriptions[ count - 1 ].qos )
+			{
+				fail( "suback" );
+			}
+		}
+	}
+
+	snprintf( params, sizeof( params ), "\"filters\":%d", count );
+	end( &m, "subscribe", params, ops );
+}
+
+// Inbound QoS 0 publishes handed to mqtt_processPublish, taken in with mqtt_pollInput or mqtt_feed.
+//   Payloads larger than the input buffer are passed up in pieces
+static void benchDispatch( int feed, int topicLength, int32_t len, long ops )
+{
+	char topic[ 128 ], params[ 96 ];
+	struct measurement m;
+	int32_t batchLength = 0, offset, segment;
+	long perBatch = 0, done, round, i;
+
+	makeTopic( topic, topicLength );
+	while ( ( perBatch == 0 ) || ( batchLength + len + topicLength + 16 <= DISPATCH_BATCH_BYTES ) )
+	{
+		batchLength += bench_encodePublish( &batch[ batchLength ], topic, ( uint16_t )topicLength, payload, len, 0, 0 );
+		perBatch++;
+	}
+	startConnection( BENCH_BROKER_ACK );
+
+	for ( round = 0; round < 2; round++ )
+	{
+		long count = ( round == 0 ) ? ops / 10 : ops;
+
+		lb.deliveredBytes = 0;
+		begin( &m );
+		for ( done = 0; done < count; done += perBatch )
+		{
+			if ( feed )
+			{
+				for ( offset = 0; offset < batchLength; offset += segment )
+				{
+					segment = ( batchLength - offset < FEED_SEGMENT ) ? batchLength - offset : FEED_SEGMENT;
+					if ( mqtt_feed( &lb.mqtt, &batch[ offset ], segment ) != MQTT_SUCCESS )
+					{
+						fail( "feed" );
+					}
+				}
+				lb.bytesRead += batchLength;
+			}
+			else
+			{
+				if ( bench_loopbackInject( &lb, batch, batchLength ) != MQTT_SUCCESS )
+				{
+					fail( "inject" );
+				}
+				for ( i = 0; i < perBatch; i++ )
+				{
+					if ( mqtt_pollInput( &lb.mqtt ) != MQTT_SUCCESS )
+					{
+						fail( "poll" );
+					}
+				}
+			}
+		}
+		if ( lb.deliveredBytes != ( uint64_t )done * len )
+		{
+			fail( "dispatch" );
+		}
+	}
+
+	snprintf( params, sizeof( params ), "\"path\":\"%s\",\"topic\":%d,\"payload\":%ld", feed ? "feed" : "poll", topicLength, ( long )len );
+	end( &m, "dispatch", params, done );
+}
+
+int main( int argc, char** argv )
+{
+	static const int topics[] = { 8, 64 };
+	static const int32_t payloads[] = { 16, 256, 4096 };
+	static const int filterCounts[] = { 1, 8, MQTT_MAX_FILTERS_PER_PACKET };
+	long ops = ( argc > 1 ) ? atol( argv[ 1 ] ) : DEFAULT_OPS;
+	int qos, t, p, f;
+
+	if ( ops < 100 )
+	{
+		fprintf( stderr, "usage: %s [operations per case, at least 100]\n", argv[ 0 ] );
+		return 1;
+	}
+	for ( p = 0; p < ( int )sizeof( payload ); p++ )
+	{
+		payload[ p ] = ( uint8_t )p;
+	}
+
+	printf( "{\"suite\":\"mqtt_bench\",\"format\":1,\"mqtt_version\":\"%s\",\"input_buffer\":%d,\"tx_buffer\":%d,"
+		"\"zero_copy_receive\":%d,\"stats\":%d,\"max_inflight\":%d}\n",
+		MQTT_VERSION_5 ? "5" : "3.1.1", MQTT_INPUT_BUFFER_SIZE, MQTT_TX_BUFFER_SIZE,
+		MQTT_ZERO_COPY_RECEIVE, MQTT_STATS, MQTT_MAX_INFLIGHT );
+
+	benchConnect( ops );
+	for ( qos = 0; qos <= 2; qos++ )
+	{
+		for ( t = 0; t < ( int )( sizeof( topics ) / sizeof( topics[ 0 ] ) ); t++ )
+		{
+			for ( p = 0; p < ( int )( sizeof( payloads ) / sizeof( payloads[ 0 ] ) ); p++ )
+			{
+				benchPublish( ( uint8_t )qos, topics[ t ], payloads[ p ], ops );
+			}
+		}
+	}
+	for ( f = 0; f < ( int )( sizeof( filterCounts ) / sizeof( filterCounts[ 0 ] ) ); f++ )
+	{
+		benchSubscribe( filterCounts[ f ], ops / 10 );
+	}
+	for ( int feed = 0; feed <= 1; feed++ )
+	{
+		for ( t = 0; t < ( int )( sizeof( topics ) / sizeof( topics[ 0 ] ) ); t++ )
+		{
+			for ( p = 0; p < ( int )( sizeof( payloads ) / sizeof( payloads[ 0 ] ) ); p++ )
+			{
+				benchDispatch( feed, topics[ t ], payloads[ p ], ops );
+			}
+		}
+	}
+	return 0;
+}
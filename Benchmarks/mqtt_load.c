@@ -0,0 +1,445 @@
+/*
+* Load generator for the MQTT core. Runs many client contexts in one process against a minimal broker
+*   stand-in that passes every publish on to the clients subscribed to its topic, all over the
+*   in-memory loopback transport in Benchmarks/bench_loopback.c, so encoding, decoding and dispatch
+*   are those of MQTT/mqtt.c. The clients are served in turn by one thread, like the connections of a
+*   gateway task. Reports throughput, end to end latency percentiles and CPU time per message as JSON
+*   lines. Linux host build only, see Benchmarks/ReadMe.txt
+*
+*/
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "Benchmarks/bench_loopback.h"
+
+// Latency histogram. Values below 2^(SUB_BITS + 1) ns have a bucket each, above that every power of
+//   two is split into 2^SUB_BITS buckets, which keeps the error of a percentile under 1/2^SUB_BITS
+#define SUB_BITS 4
+#define HISTOGRAM_BUCKETS ( 64 << SUB_BITS )
+
+// A client and when it publishes next. The loopback comes first, so the hooks can find the client
+struct loadClient {
+	struct bench_loopback lb;
+	uint64_t nextPublish;				// ns, CLOCK_MONOTONIC
+	char     topic[ 16 ];
+};
+
+// Clients subscribed to one topic, found by the broker stand-in through an open addressed table
+struct topicEntry {
+	char     topic[ 16 ];				// Empty for a free entry
+	uint16_t topicLength;
+	int      count;
+	int      capacity;
+	struct loadClient** subscribers;
+};
+
+static struct {
+	int      clients;
+	int      topics;
+	int      fanout;					// Topics each client subscribes to
+	double   rate;						// Publishes per second and client, 0 for as fast as possible
+	uint8_t  qos;
+	int32_t  payload;
+	double   duration;					// Seconds
+} config = { 100, 0, 1, 10.0, 0, 64, 10.0 };
+
+static struct loadClient* clients;
+static struct topicEntry* table;
+static uint32_t tableMask;
+
+static uint64_t published, busy, forwarded, delivered, dropped, unsupportedFilters;
+static uint64_t histogram[ HISTOGRAM_BUCKETS ];
+static uint64_t latencyMax;
+
+static uint64_t now( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ( uint64_t )ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpuTime( void )
+{
+	struct rusage usage;
+
+	getrusage( RUSAGE_SELF, &usage );
+	return ( ( uint64_t )usage.ru_utime.tv_sec + usage.ru_stime.tv_sec ) * 1000000000ULL +
+		( ( uint64_t )usage.ru_utime.tv_usec + usage.ru_stime.tv_usec ) * 1000ULL;
+}
+
+static void fail( const char* what )
+{
+	fprintf( stderr, "%s failed\n", what );
+	exit( 1 );
+}
+
+// Latency histogram
+
+static void recordLatency( uint64_t ns )
+{
+	int bits = 64 - __builtin_clzll( ns | 1 );
+	int shift = ( bits > SUB_BITS + 1 ) ? bits - SUB_BITS - 1 : 0;
+
+	histogram[ ( shift << SUB_BITS ) + ( ns >> shift ) ]++;
+	if ( ns > latencyMax )
+	{
+		latencyMax = ns;
+	}
+}
+
+// Upper end of the bucket the given fraction of all latencies falls into, at most the largest one
+static uint64_t percentile( double fraction )
+{
+	uint64_t total = 0, seen = 0, target, upper;
+	int index, shift;
+
+	for ( index = 0; index < HISTOGRAM_BUCKETS; index++ )
+	{
+		total += histogram[ index ];
+	}
+	target = ( uint64_t )( fraction * total );
+	for ( index = 0; index < HISTOGRAM_BUCKETS; index++ )
+	{
+		seen += histogram[ index ];
+		if ( ( seen > target ) || ( seen == total ) )
+		{
+			break;
+		}
+	}
+	if ( index < ( 2 << SUB_BITS ) )
+	{
+		return index;
+	}
+	shift = ( index >> SUB_BITS ) - 1;
+	upper = ( ( uint64_t )( index - ( shift << SUB_BITS ) + 1 ) << shift ) - 1;
+	return ( upper < latencyMax ) ? upper : latencyMax;
+}
+
+// Broker stand-in
+
+static uint32_t hashTopic( const char* topic, uint16_t topicLength )
+{
+	uint32_t hash = 2166136261UL;
+
+	for ( uint16_t i = 0; i < topicLength; i++ )
+	{
+		hash = ( hash ^ ( uint8_t )topic[ i ] ) * 16777619UL;
+	}
+	return hash;
+}
+
+static struct topicEntry* findTopic( const char* topic, uint16_t topicLength, int create )
+{
+	uint32_t index = hashTopic( topic, topicLength ) & tableMask;
+	struct topicEntry* entry;
+
+	for ( ;; )
+	{
+		entry = &table[ index ];
+		if ( entry->topicLength == 0 )
+		{
+			if ( !create || ( topicLength >= sizeof( entry->topic ) ) )
+			{
+				return NULL;
+			}
+			memcpy( entry->topic, topic, topicLength );
+			entry->topicLength = topicLength;
+			return entry;
+		}
+		if ( ( entry->topicLength == topicLength ) && ( memcmp( entry->topic, topic, topicLength ) == 0 ) )
+		{
+			return entry;
+		}
+		index = ( index + 1 ) & tableMask;
+	}
+}
+
+// Only exact topics are routed, wildcard filters are granted but never match
+static void brokerSubscribe( struct bench_loopback* lb, const char* filter, uint16_t filterLength )
+{
+	struct topicEntry* entry;
+
+	if ( memchr( filter, '+', filterLength ) || memchr( filter, '#', filterLength ) ||
+		 ( ( entry = findTopic( filter, filterLength, 1 ) ) == NULL ) )
+	{
+		unsupportedFilters++;
+		return;
+	}
+	if ( entry->count == entry->capacity )
+	{
+		entry->capacity = entry->capacity ? entry->capacity * 2 : 4;
+		entry->subscribers = realloc( entry->subscribers, entry->capacity * sizeof( entry->subscribers[ 0 ] ) );
+		if ( entry->subscribers == NULL )
+		{
+			fail( "realloc" );
+		}
+	}
+	entry->subscribers[ entry->count++ ] = ( struct loadClient* )lb;
+}
+
+// Pass a publish on at QoS 0. It is encoded once and queued for every subscriber
+static void brokerPublish( struct bench_loopback* lb, const char* topic, uint16_t topicLength, const uint8_t* pData, int32_t len )
+{
+	static uint8_t packet[ BENCH_BROKER_SCRATCH + 16 ];
+	struct topicEntry* entry = findTopic( topic, topicLength, 0 );
+	int32_t packetLength;
+
+	( void )lb;
+	if ( entry == NULL )
+	{
+		return;
+	}
+	packetLength = bench_encodePublish( packet, topic, topicLength, pData, len, 0, 0 );
+	forwarded += entry->count;
+	for ( int i = 0; i < entry->count; i++ )
+	{
+		if ( bench_loopbackInject( &entry->subscribers[ i ]->lb, packet, packetLength ) != MQTT_SUCCESS )
+		{
+			dropped++;
+		}
+	}
+}
+
+// Every payload starts with the time it was published
+static void clientDeliver( struct bench_loopback* lb, struct mqtt_message* msg )
+{
+	uint64_t sent;
+
+	( void )lb;
+	if ( ( msg->offset == 0 ) && ( msg->len >= ( int32_t )sizeof( sent ) ) )
+	{
+		memcpy( &sent, msg->pData, sizeof( sent ) );
+		recordLatency( now() - sent );
+		delivered++;
+	}
+}
+
+// Load
+
+static void pollClient( struct loadClient* client )
+{
+	while ( bench_loopbackPending( &client->lb ) > 0 )
+	{
+		if ( mqtt_pollInput( &client->lb.mqtt ) != MQTT_SUCCESS )
+		{
+			fail( "poll" );
+		}
+	}
+}
+
+static void setUp( void )
+{
+	static char filters[ MQTT_MAX_FILTERS_PER_PACKET ][ 24 ];
+	struct mqtt_subscription subscriptions[ MQTT_MAX_FILTERS_PER_PACKET ];
+	char clientId[ 24 ];
+	int i, j, count;
+
+	for ( tableMask = 1; tableMask < ( uint32_t )config.topics * 2; tableMask <<= 1 )
+	{
+	}
+	table = calloc( tableMask, sizeof( table[ 0 ] ) );
+	tableMask--;
+	clients = calloc( config.clients, sizeof( clients[ 0 ] ) );
+	if ( ( table == NULL ) || ( clients == NULL ) )
+	{
+		fail( "calloc" );
+	}
+
+	for ( i = 0; i < config.clients; i++ )
+	{
+		struct loadClient* client = &clients[ i ];
+
+		snprintf( clientId, sizeof( clientId ), "load%d", i );
+		bench_loopbackInit( &client->lb, clientId, BENCH_BROKER_ACK );
+		client->lb.onSubscribe = brokerSubscribe;
+		client->lb.onPublish = brokerPublish;
+		client->lb.onDeliver = clientDeliver;
+		snprintf( client->topic, sizeof( client->topic ), "load/%d", i % config.topics );
+		if ( mqtt_Connect( &client->lb.mqtt ) != MQTT_CONNECT_ACCEPTED )
+		{
+			fail( "connect" );
+		}
+
+		// The topics of the next clients round, so every topic has fanout subscribers
+		for ( j = 0; j < config.fanout; j += count )
+		{
+			count = ( config.fanout - j < MQTT_MAX_FILTERS_PER_PACKET ) ? config.fanout - j : MQTT_MAX_FILTERS_PER_PACKET;
+			for ( int k = 0; k < count; k++ )
+			{
+				snprintf( filters[ k ], sizeof( filters[ k ] ), "load/%d", ( i + 1 + j + k ) % config.topics );
+				subscriptions[ k ].topicFilter = filters[ k ];
+				subscriptions[ k ].qos = 0;
+			}
+			if ( mqtt_subscribe_many( &client->lb.mqtt, subscriptions, ( uint16_t )count ) != MQTT_SUCCESS )
+			{
+				fail( "subscribe" );
+			}
+			pollClient( client );
+		}
+	}
+}
+
+static void run( void )
+{
+	static uint8_t payload[ BENCH_BROKER_SCRATCH ];
+	uint64_t start = now(), t = start, end = start + ( uint64_t )( config.duration * 1e9 ), nextKeepalive = start;
+	uint64_t interval = ( config.rate > 0 ) ? ( uint64_t )( 1e9 / config.rate ) : 0;
+	uint64_t cpuStart = cpuTime(), cpu, wall, stamp, due;
+	struct timespec wake;
+	int i, status;
+
+	// Spread the first publishes over one interval
+	for ( i = 0; i < config.clients; i++ )
+	{
+		clients[ i ].nextPublish = start + interval * i / config.clients;
+	}
+
+	while ( t < end )
+	{
+		due = end;
+		for ( i = 0; i < config.clients; i++ )
+		{
+			struct loadClient* client = &clients[ i ];
+
+			if ( client->nextPublish <= t )
+			{
+				stamp = now();
+				memcpy( payload, &stamp, sizeof( stamp ) );
+				status = mqtt_publish( &client->lb.mqtt, client->topic, payload, config.payload, config.qos );
+				if ( status == MQTT_SUCCESS )
+				{
+					published++;
+					client->nextPublish += interval;
+				}
+				else if ( status == MQTT_BUSY )
+				{
+					busy++;
+				}
+				else
+				{
+					fail( "publish" );
+				}
+			}
+			if ( client->nextPublish < due )
+			{
+				due = client->nextPublish;
+			}
+#if MQTT_TX_BUFFER_SIZE > 0
+			mqtt_flush( &client->lb.mqtt );
+#endif
+		}
+
+		// Acknowledgements and the messages passed on in this round
+		for ( i = 0; i < config.clients; i++ )
+		{
+			pollClient( &clients[ i ] );
+		}
+
+		t = now();
+		bench_loopbackTime = ( uint32_t )( t / 1000000 );
+		if ( t >= nextKeepalive )
+		{
+			for ( i = 0; i < config.clients; i++ )
+			{
+				mqtt_keepalive( &clients[ i ].lb.mqtt, NULL );
+				pollClient( &clients[ i ] );
+			}
+			nextKeepalive = t + 1000000000ULL;
+		}
+
+		// Sleep while no client is due, so the CPU time is that of the messages
+		if ( due > nextKeepalive )
+		{
+			due = nextKeepalive;
+		}
+		if ( due > t )
+		{
+			wake.tv_sec = ( time_t )( due / 1000000000ULL );
+			wake.tv_nsec = ( long )( due % 1000000000ULL );
+			clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL );
+			t = now();
+			bench_loopbackTime = ( uint32_t )( t / 1000000 );
+		}
+	}
+
+	// Take in what is still on its way
+	for ( i = 0; i < config.clients; i++ )
+	{
+		pollClient( &clients[ i ] );
+		if ( clients[ i ].lb.errors > 0 )
+		{
+			fail( "broker" );
+		}
+	}
+	cpu = cpuTime() - cpuStart;
+	wall = now() - start;
+
+	printf( "{\"bench\":\"load\",\"clients\":%d,\"topics\":%d,\"fanout\":%d,\"rate\":%.1f,\"qos\":%u,\"payload\":%ld,"
+		"\"duration_s\":%.3f,\"published\":%llu,\"forwarded\":%llu,\"delivered\":%llu,\"dropped\":%llu,\"busy\":%llu,",
+		config.clients, config.topics, config.fanout, config.rate, config.qos, ( long )config.payload,
+		wall / 1e9, ( unsigned long long )published, ( unsigned long long )forwarded, ( unsigned long long )delivered,
+		( unsigned long long )dropped, ( unsigned long long )busy );
+	printf( "\"publish_per_s\":%.0f,\"deliver_per_s\":%.0f,"
+		"\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},"
+		"\"cpu_util\":%.3f,\"cpu_ns_per_msg\":%.1f}\n",
+		published * 1e9 / wall, delivered * 1e9 / wall,
+		percentile( 0.5 ) / 1e3, percentile( 0.9 ) / 1e3, percentile( 0.99 ) / 1e3, percentile( 0.999 ) / 1e3, latencyMax / 1e3,
+		( double )cpu / wall, ( published + delivered ) ? ( double )cpu / ( published + delivered ) : 0.0 );
+}
+
+static void usage( const char* name )
+{
+	fprintf( stderr,
+		"usage: %s [-c clients] [-t topics] [-s subscriptions per client] [-r publishes/s per client, 0 = flat out]\n"
+		"          [-q qos] [-l payload bytes] [-d seconds]\n", name );
+	exit( 1 );
+}
+
+int main( int argc, char** argv )
+{
+	int option;
+
+	while ( ( option = getopt( argc, argv, "c:t:s:r:q:l:d:" ) ) != -1 )
+	{
+		switch ( option )
+		{
+		case 'c': config.clients = atoi( optarg ); break;
+		case 't': config.topics = atoi( optarg ); break;
+		case 's': config.fanout = atoi( optarg ); break;
+		case 'r': config.rate = atof( optarg ); break;
+		case 'q': config.qos = ( uint8_t )atoi( optarg ); break;
+		case 'l': config.payload = atoi( optarg ); break;
+		case 'd': config.duration = atof( optarg ); break;
+		default: usage( argv[ 0 ] );
+		}
+	}
+	if ( config.topics == 0 )
+	{
+		config.topics = config.clients;
+	}
+	// The broker stand-in keeps each publish whole in its scratch buffer
+	if ( ( config.clients < 1 ) || ( config.topics < 1 ) || ( config.fanout < 0 ) || ( config.fanout > config.topics ) ||
+		 ( config.rate < 0 ) || ( config.qos > 2 ) || ( config.payload < 8 ) || ( config.duration <= 0 ) ||
+		 ( config.payload + 32 > BENCH_BROKER_SCRATCH ) )
+	{
+		usage( argv[ 0 ] );
+	}
+
+	printf( "{\"suite\":\"mqtt_load\",\"format\":1,\"mqtt_version\":\"%s\",\"input_buffer\":%d,\"tx_buffer\":%d,"
+		"\"zero_copy_receive\":%d,\"loopback_size\":%d}\n",
+		MQTT_VERSION_5 ? "5" : "3.1.1", MQTT_INPUT_BUFFER_SIZE, MQTT_TX_BUFFER_SIZE, MQTT_ZERO_COPY_RECEIVE, BENCH_LOOPBACK_SIZE );
+	fflush( stdout );
+
+	setUp();
+	run();
+	if ( unsupportedFilters > 0 )
+	{
+		fprintf( stderr, "%llu filters not routed\n", ( unsigned long long )unsupportedFilters );
+	}
+	return 0;
+}
@@ -0,0 +1,495 @@
+/*
+* Host tests for the MQTT core over the in-memory loopback transport in Benchmarks/bench_loopback.c,
+*   with the test playing the server. Covers what the benchmarks take for granted: QoS 2 duplicates,
+*   the acknowledgement of a message the application did not take, mqtt_feed with the stream
+*   split anywhere, the order the offline queue is sent in and the replay of a session store after
+*   a pipelined connect. Prints one line per case and exits with 1 at the first check that fails.
+*   Host build only, see Benchmarks/ReadMe.txt
+*
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Benchmarks/bench_loopback.h"
+
+// Payload of the messages passed up in pieces, too large for the input buffer
+#define LARGE_PAYLOAD ( MQTT_INPUT_BUFFER_SIZE + 100 )
+
+#define CHECK( condition ) check( ( condition ), #condition, __LINE__ )
+
+static struct bench_loopback lb;
+static uint8_t payload[ LARGE_PAYLOAD ];
+static uint8_t packet[ LARGE_PAYLOAD + 64 ];
+static uint8_t stream[ LARGE_PAYLOAD + 256 ];
+
+static void check( int ok, const char* what, int line )
+{
+	if ( !ok )
+	{
+		fprintf( stderr, "mqtt_test.c:%d: %s failed\n", line, what );
+		exit( 1 );
+	}
+}
+
+// Connect and take over the server side. With script 0 the broker stand-in only decodes what the
+//   client writes, its last packet type and body are left in lb.type and lb.scratch
+static void startConnection( uint8_t script )
+{
+	bench_loopbackInit( &lb, "test", BENCH_BROKER_ACK );
+	CHECK( mqtt_Connect( &lb.mqtt ) == MQTT_CONNECT_ACCEPTED );
+	lb.script = script;
+}
+
+// Take in everything queued for the client. Returns MQTT_ERROR if any packet was not processed
+static int poll( void )
+{
+	int status = MQTT_SUCCESS;
+
+	while ( bench_loopbackPending( &lb ) > 0 )
+	{
+		if ( mqtt_pollInput( &lb.mqtt ) != MQTT_SUCCESS )
+		{
+			status = MQTT_ERROR;
+		}
+	}
+	return status;
+}
+
+// Hand bytes to the client, through mqtt_feed or queued for mqtt_pollInput
+static int receive( const uint8_t* data, int32_t len, int feed )
+{
+	if ( feed )
+	{
+		return mqtt_feed( &lb.mqtt, data, len );
+	}
+	CHECK( bench_loopbackInject( &lb, data, len ) == MQTT_SUCCESS );
+	return poll();
+}
+
+static int32_t encodeAck( uint8_t* pDestination, uint8_t type, uint16_t packetId )
+{
+	pDestination[ 0 ] = type;
+	pDestination[ 1 ] = 2;
+	pDestination[ 2 ] = 0xFF & ( packetId >> 8 );
+	pDestination[ 3 ] = 0xFF & packetId;
+	return 4;
+}
+
+// A QoS 2 message is passed up once however often the server sends it, until PUBREL releases its
+//   Packet Identifier. Every copy is answered with PUBREC
+static void testDuplicateQos2( int32_t len, int feed )
+{
+	uint8_t pubrel[ 4 ];
+	uint32_t written;
+	int32_t n;
+
+	startConnection( 0 );
+	n = bench_encodePublish( packet, "t/dup", 5, payload, len, 2, 7 );
+
+	written = lb.packetsWritten;
+	CHECK( receive( packet, n, feed ) == MQTT_SUCCESS );
+	CHECK( lb.deliveredBytes == ( uint64_t )len );
+	CHECK( ( lb.packetsWritten == written + 1 ) && ( lb.type == MQTT_PACKET_TYPE_PUBREC ) );
+
+	// The server did not see the PUBREC and sends the message again
+	packet[ 0 ] |= 0x08;
+	CHECK( receive( packet, n, feed ) == MQTT_SUCCESS );
+	CHECK( lb.deliveredBytes == ( uint64_t )len );
+	CHECK( ( lb.packetsWritten == written + 2 ) && ( lb.type == MQTT_PACKET_TYPE_PUBREC ) );
+
+	CHECK( receive( pubrel, encodeAck( pubrel, MQTT_PACKET_TYPE_PUBREL, 7 ), feed ) == MQTT_SUCCESS );
+	CHECK( ( lb.packetsWritten == written + 3 ) && ( lb.type == MQTT_PACKET_TYPE_PUBCOMP ) );
+
+	// Released, so the same Packet Identifier now stands for a new message
+	packet[ 0 ] &= ~0x08;
+	CHECK( receive( packet, n, feed ) == MQTT_SUCCESS );
+	CHECK( lb.deliveredBytes == 2 * ( uint64_t )len );
+	CHECK( lb.errors == 0 );
+}
+
+// A message the application did not take is not acknowledged, and the copy the server sends again
+//   is passed up, QoS 2 included
+static void testRefusedDelivery( uint8_t qos, int32_t len, int feed )
+{
+	uint32_t written;
+	int32_t n;
+
+	startConnection( 0 );
+	n = bench_encodePublish( packet, "t/refused", 9, payload, len, qos, 9 );
+
+	written = lb.packetsWritten;
+	lb.refuse = 1;
+	CHECK( receive( packet, n, feed ) == MQTT_ERROR );
+	CHECK( lb.deliveredBytes == 0 );
+	CHECK( lb.packetsWritten == written );
+	CHECK( bench_loopbackPending( &lb ) == 0 );
+
+	packet[ 0 ] |= 0x08;
+	CHECK( receive( packet, n, feed ) == MQTT_SUCCESS );
+	CHECK( lb.deliveredBytes == ( uint64_t )len );
+	CHECK( ( lb.packetsWritten == written + 1 ) &&
+		   ( lb.type == ( ( qos == 1 ) ? MQTT_PACKET_TYPE_PUBACK : MQTT_PACKET_TYPE_PUBREC ) ) );
+	CHECK( lb.errors == 0 );
+}
+
+// Packet Identifier of the last PUBLISH the client wrote, from what the broker stand-in kept of it.
+//   With MQTT_TX_BUFFER_SIZE the publish is still in the transmit buffer until the flush
+static uint16_t lastPublishId( void )
+{
+	int32_t offset;
+
+	CHECK( mqtt_flush( &lb.mqtt ) == MQTT_SUCCESS );
+	offset = 2 + ( ( lb.scratch[ 0 ] << 8 ) | lb.scratch[ 1 ] );
+
+	return ( uint16_t )( ( lb.scratch[ offset ] << 8 ) | lb.scratch[ offset + 1 ] );
+}
+
+static struct mqtt_subscription feedSubscription = { ( char* )"in/#", 0, 0 };
+
+// Leave something outstanding for every packet type a server sends and return the stream that
+//   answers all of it, followed by inbound publishes at every QoS, one of them passed up in pieces
+static int32_t prepareFeed( void )
+{
+	uint16_t publish1, publish2, subscribe, unsubscribe;
+	uint8_t* pCursor = stream;
+
+	startConnection( 0 );
+	CHECK( mqtt_publish( &lb.mqtt, ( char* )"out/1", payload, 4, 1 ) == MQTT_SUCCESS );
+	publish1 = lastPublishId();
+	CHECK( mqtt_publish( &lb.mqtt, ( char* )"out/2", payload, 4, 2 ) == MQTT_SUCCESS );
+	publish2 = lastPublishId();
+	CHECK( mqtt_subscribe_many( &lb.mqtt, &feedSubscription, 1 ) == MQTT_SUCCESS );
+	subscribe = ( uint16_t )( ( lb.scratch[ 0 ] << 8 ) | lb.scratch[ 1 ] );
+	CHECK( mqtt_unSubscribe( &lb.mqtt, ( char* )"in/#" ) == MQTT_SUCCESS );
+	unsubscribe = ( uint16_t )( ( lb.scratch[ 0 ] << 8 ) | lb.scratch[ 1 ] );
+	CHECK( mqtt_PingReq( &lb.mqtt ) == MQTT_SUCCESS );
+
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_PUBACK, publish1 );
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_PUBREC, publish2 );
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_PUBCOMP, publish2 );
+#if MQTT_VERSION_5
+	// No properties, then the Reason Code of the one filter
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_SUBACK, subscribe );
+	pCursor[ -3 ] = 4;
+	*( pCursor++ ) = 0;
+	*( pCursor++ ) = 1;
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_UNSUBACK, unsubscribe );
+	pCursor[ -3 ] = 4;
+	*( pCursor++ ) = 0;
+	*( pCursor++ ) = 0;
+#else
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_SUBACK, subscribe );
+	pCursor[ -3 ] = 3;
+	*( pCursor++ ) = 1;
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_UNSUBACK, unsubscribe );
+#endif
+	*( pCursor++ ) = MQTT_PACKET_TYPE_PINGRESP;
+	*( pCursor++ ) = 0;
+	pCursor += bench_encodePublish( pCursor, "in/0", 4, payload, 10, 0, 0 );
+	pCursor += bench_encodePublish( pCursor, "in/1", 4, payload, 11, 1, 100 );
+	pCursor += bench_encodePublish( pCursor, "in/2", 4, payload, 12, 2, 101 );
+	pCursor += encodeAck( pCursor, MQTT_PACKET_TYPE_PUBREL, 101 );
+	pCursor += bench_encodePublish( pCursor, "in/large", 8, payload, LARGE_PAYLOAD, 1, 102 );
+
+	return ( int32_t )( pCursor - stream );
+}
+
+// Everything the stream answers is settled, and the client wrote PUBREL for its QoS 2 publish and
+//   PUBACK, PUBREC, PUBCOMP and PUBACK for the inbound ones
+static void checkFeed( uint32_t written )
+{
+	CHECK( mqtt_inflightCount( &lb.mqtt ) == 0 );
+	CHECK( feedSubscription.returnCode == 1 );
+	CHECK( !lb.mqtt.pingOutstanding );
+	CHECK( lb.deliveredBytes == 10 + 11 + 12 + LARGE_PAYLOAD );
+	CHECK( ( lb.packetsWritten == written + 5 ) && ( lb.type == MQTT_PACKET_TYPE_PUBACK ) );
+	CHECK( lb.errors == 0 );
+}
+
+// mqtt_feed must not care where TCP splits the stream, so split it at every byte in turn
+static void testFeedSplit( void )
+{
+	int32_t n = prepareFeed(), split;
+	uint32_t written;
+
+	for ( split = 0; split <= n; split++ )
+	{
+		CHECK( prepareFeed() == n );
+		written = lb.packetsWritten;
+		CHECK( mqtt_feed( &lb.mqtt, stream, split ) == MQTT_SUCCESS );
+		CHECK( mqtt_feed( &lb.mqtt, &stream[ split ], n - split ) == MQTT_SUCCESS );
+		checkFeed( written );
+	}
+
+	// And one byte at a time
+	prepareFeed();
+	written = lb.packetsWritten;
+	for ( split = 0; split < n; split++ )
+	{
+		CHECK( mqtt_feed( &lb.mqtt, &stream[ split ], 1 ) == MQTT_SUCCESS );
+	}
+	checkFeed( written );
+}
+
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+static char order[ 2 * MQTT_MAX_INFLIGHT ][ 8 ];
+static int orderCount;
+
+static void recordPublish( struct bench_loopback* lb, const char* topic, uint16_t topicLength, const uint8_t* pData, int32_t len )
+{
+	( void )lb;
+	( void )pData;
+	( void )len;
+	CHECK( ( orderCount < 2 * MQTT_MAX_INFLIGHT ) && ( topicLength < sizeof( order[ 0 ] ) ) );
+	memcpy( order[ orderCount ], topic, topicLength );
+	order[ orderCount++ ][ topicLength ] = '\0';
+}
+
+// Messages published while the connection is down go out after the next CONNACK in the order they
+//   were published, more QoS 1 messages than there are in-flight slots included, and a message
+//   published after the reconnect waits behind them
+static void testQueueOrder( void )
+{
+	char topic[ 8 ];
+	uint32_t nextCheck;
+	int i, count = 2 * MQTT_MAX_INFLIGHT - 1;
+
+	startConnection( BENCH_BROKER_ACK );
+	lb.onPublish = recordPublish;
+	orderCount = 0;
+	CHECK( mqtt_Disconnect( &lb.mqtt ) == MQTT_SUCCESS );
+
+	for ( i = 0; i < count; i++ )
+	{
+		snprintf( topic, sizeof( topic ), "q/%d", i );
+		CHECK( mqtt_publish( &lb.mqtt, topic, payload, 8, ( i % 3 == 2 ) ? 0 : 1 ) == MQTT_SUCCESS );
+	}
+	CHECK( orderCount == 0 );
+
+	CHECK( mqtt_Connect( &lb.mqtt ) == MQTT_CONNECT_ACCEPTED );
+	CHECK( mqtt_publish( &lb.mqtt, ( char* )"q/new", payload, 8, 0 ) == MQTT_SUCCESS );
+	CHECK( lb.mqtt.queueCount > 0 );
+
+	// Take in the PUBACKs so the rest of the queue finds in-flight slots
+	for ( i = 0; ( i < 10 ) && ( ( lb.mqtt.queueCount > 0 ) || ( bench_loopbackPending( &lb ) > 0 ) ); i++ )
+	{
+		CHECK( poll() == MQTT_SUCCESS );
+		CHECK( mqtt_keepalive( &lb.mqtt, &nextCheck ) == MQTT_SUCCESS );
+	}
+
+	CHECK( orderCount == count + 1 );
+	for ( i = 0; i < count; i++ )
+	{
+		snprintf( topic, sizeof( topic ), "q/%d", i );
+		CHECK( strcmp( order[ i ], topic ) == 0 );
+	}
+	CHECK( strcmp( order[ count ], "q/new" ) == 0 );
+	CHECK( lb.errors == 0 );
+}
+#endif
+
+// Session store that keeps its messages in memory, in the order they were first saved
+struct testStore {
+	struct mqtt_sessionStore base;
+	int count;
+	struct {
+		uint16_t packetId;
+		uint8_t  ack;
+		int32_t  len;
+		uint8_t  packet[ 64 ];
+	} messages[ MQTT_MAX_INFLIGHT ];
+};
+
+static struct testStore store;
+
+static int storeFind( uint16_t packetId )
+{
+	int i;
+
+	for ( i = 0; ( i < store.count ) && ( store.messages[ i ].packetId != packetId ); i++ )
+	{
+	}
+	return i;
+}
+
+static int storeSave( struct mqtt_sessionStore* pStore, uint16_t packetId, uint8_t ack, const struct mqtt_iovec* iov, int count )
+{
+	int i = storeFind( packetId ), j;
+
+	( void )pStore;
+	if ( i == MQTT_MAX_INFLIGHT )
+	{
+		return MQTT_ERROR;
+	}
+	if ( i == store.count )
+	{
+		store.count++;
+	}
+	store.messages[ i ].packetId = packetId;
+	store.messages[ i ].ack = ack;
+	store.messages[ i ].len = 0;
+	for ( j = 0; j < count; j++ )
+	{
+		CHECK( store.messages[ i ].len + iov[ j ].len <= ( int32_t )sizeof( store.messages[ i ].packet ) );
+		memcpy( &store.messages[ i ].packet[ store.messages[ i ].len ], iov[ j ].base, iov[ j ].len );
+		store.messages[ i ].len += iov[ j ].len;
+	}
+	return MQTT_SUCCESS;
+}
+
+static void storeRelease( struct mqtt_sessionStore* pStore, uint16_t packetId )
+{
+	int i = storeFind( packetId );
+
+	( void )pStore;
+	if ( i < store.count )
+	{
+		memmove( &store.messages[ i ], &store.messages[ i + 1 ], ( store.count - i - 1 ) * sizeof( store.messages[ 0 ] ) );
+		store.count--;
+	}
+}
+
+static void storeClear( struct mqtt_sessionStore* pStore )
+{
+	( void )pStore;
+	store.count = 0;
+}
+
+static int storeReplay( struct mqtt_sessionStore* pStore, mqtt_replayFn_t fn, struct mqtt_context* tag )
+{
+	uint16_t ids[ MQTT_MAX_INFLIGHT ];
+	int i, n = store.count, status;
+
+	( void )pStore;
+	for ( i = 0; i < n; i++ )
+	{
+		ids[ i ] = store.messages[ i ].packetId;
+	}
+	// fn may release the message it is called for
+	for ( i = 0; i < n; i++ )
+	{
+		int j = storeFind( ids[ i ] );
+
+		if ( j == store.count )
+		{
+			continue;
+		}
+		status = fn( tag, ids[ i ], store.messages[ j ].ack, store.messages[ j ].packet, store.messages[ j ].len );
+		if ( status != MQTT_SUCCESS )
+		{
+			return status;
+		}
+	}
+	return MQTT_SUCCESS;
+}
+
+// Start as a restarted client would, with count QoS 1 messages left in the store from before. Their
+//   Packet Identifiers 1, 2 and so on are what a new connection hands out first
+static void restartWithStore( int count )
+{
+	struct mqtt_iovec iov;
+	uint16_t i;
+
+	bench_loopbackInit( &lb, "test", 0 );
+	store.base.save = storeSave;
+	store.base.release = storeRelease;
+	store.base.clear = storeClear;
+	store.base.replay = storeReplay;
+	store.count = 0;
+	for ( i = 1; i <= count; i++ )
+	{
+		iov.base = packet;
+		iov.len = bench_encodePublish( packet, "t/stored", 8, payload, 4, 1, i );
+		CHECK( storeSave( &store.base, i, MQTT_PACKET_TYPE_PUBACK, &iov, 1 ) == MQTT_SUCCESS );
+	}
+	lb.mqtt.sessionStore = &store.base;
+	lb.mqtt.dontRequestCleanSession = 1;
+}
+
+// The SUBSCRIBE sent along with a pipelined CONNECT must leave the in-flight slots of the stored
+//   messages alone, or their replay after the CONNACK fails and they are never sent again
+static void testPipelinedReplay( void )
+{
+#if MQTT_VERSION_5
+	static const uint8_t connAck[] = { MQTT_PACKET_TYPE_CONNACK, 3, 1, 0, 0 };
+	uint8_t subAck[] = { MQTT_PACKET_TYPE_SUBACK, 4, 0, 0, 0, 1 };
+#else
+	static const uint8_t connAck[] = { MQTT_PACKET_TYPE_CONNACK, 2, 1, 0 };
+	uint8_t subAck[] = { MQTT_PACKET_TYPE_SUBACK, 3, 0, 0, 1 };
+#endif
+	struct mqtt_subscription subscription = { ( char* )"in/#", 1, 0 };
+	uint8_t ack[ 4 ];
+	uint16_t subscribe, i;
+
+	restartWithStore( 2 );
+	CHECK( mqtt_connect_pipelined( &lb.mqtt, &subscription, 1 ) == MQTT_SUCCESS );
+	CHECK( mqtt_flush( &lb.mqtt ) == MQTT_SUCCESS );
+	CHECK( ( lb.packetsWritten == 2 ) && ( ( lb.type & 0xF0 ) == ( MQTT_PACKET_TYPE_SUBSCRIBE & 0xF0 ) ) );
+	subscribe = ( uint16_t )( ( lb.scratch[ 0 ] << 8 ) | lb.scratch[ 1 ] );
+	CHECK( ( ( subscribe - 1 ) & ( MQTT_MAX_INFLIGHT - 1 ) ) >= 2 );
+
+	// The server kept the session, both stored messages go out again as duplicates
+	CHECK( receive( connAck, sizeof( connAck ), 0 ) == MQTT_SUCCESS );
+	CHECK( lb.mqtt.connected );
+	CHECK( lastPublishId() == 2 );
+	CHECK( ( lb.packetsWritten == 4 ) && ( lb.type & 0x08 ) );
+	CHECK( mqtt_inflightCount( &lb.mqtt ) == 3 );
+
+	for ( i = 1; i <= 2; i++ )
+	{
+		CHECK( receive( ack, encodeAck( ack, MQTT_PACKET_TYPE_PUBACK, i ), 0 ) == MQTT_SUCCESS );
+	}
+	subAck[ 2 ] = 0xFF & ( subscribe >> 8 );
+	subAck[ 3 ] = 0xFF & subscribe;
+	CHECK( receive( subAck, sizeof( subAck ), 0 ) == MQTT_SUCCESS );
+	CHECK( store.count == 0 );
+	CHECK( mqtt_inflightCount( &lb.mqtt ) == 0 );
+	CHECK( subscription.returnCode == 1 );
+	CHECK( lb.errors == 0 );
+
+	// With every slot needed for the replay there is no room for the SUBSCRIBE, nothing is written
+	restartWithStore( MQTT_MAX_INFLIGHT );
+	CHECK( mqtt_connect_pipelined( &lb.mqtt, &subscription, 1 ) == MQTT_BUSY );
+	CHECK( lb.packetsWritten == 0 );
+}
+
+int main( void )
+{
+	int feed, qos;
+
+	for ( int32_t i = 0; i < LARGE_PAYLOAD; i++ )
+	{
+		payload[ i ] = ( uint8_t )i;
+	}
+
+	for ( feed = 0; feed <= 1; feed++ )
+	{
+		testDuplicateQos2( 8, feed );
+		testDuplicateQos2( LARGE_PAYLOAD, feed );
+	}
+	printf( "duplicate QoS 2 ok\n" );
+
+	for ( feed = 0; feed <= 1; feed++ )
+	{
+		for ( qos = 1; qos <= 2; qos++ )
+		{
+			testRefusedDelivery( ( uint8_t )qos, 8, feed );
+			testRefusedDelivery( ( uint8_t )qos, LARGE_PAYLOAD, feed );
+		}
+	}
+	printf( "refused delivery ok\n" );
+
+	testFeedSplit();
+	printf( "split feed ok\n" );
+
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+	testQueueOrder();
+	printf( "queue order ok\n" );
+#else
+	printf( "queue order skipped, build with MQTT_OFFLINE_QUEUE_SIZE\n" );
+#endif
+
+	testPipelinedReplay();
+	printf( "pipelined replay ok\n" );
+	return 0;
+}
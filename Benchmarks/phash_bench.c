@@ -0,0 +1,102 @@
+/*
+* Microbenchmark comparing the linear topic table, as originally used in mqtt_port.c, with the
+*   generated perfect hash table from MQTT/mqtt_phash.h. Host build only, see Benchmarks/ReadMe.txt
+*
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "Benchmarks/bench_routes.h"
+
+#define ITERATIONS 2000000
+
+static volatile uint32_t handled;
+
+void benchHandler( struct mqtt_message* msg )
+{
+	handled += msg->topicLength;
+}
+
+// The linear table is built from the same entries, in topic file order
+static struct {
+	char topicName[ 32 ];
+	mqtt_routeFn_t fn;
+} linearTable[ sizeof( bench_staticRoutes_slots ) / sizeof( bench_staticRoutes_slots[ 0 ] ) ];
+static int linearCount;
+
+static int linearDispatch( struct mqtt_message* msg )
+{
+	int status = MQTT_ERROR;
+
+	for ( int i = 0; i < linearCount; i++ )
+	{
+		if ( ( msg->topicLength < sizeof( linearTable[ i ].topicName ) ) &&
+			 ( strncmp( msg->topic, linearTable[ i ].topicName, msg->topicLength ) == 0 ) &&
+			 ( linearTable[ i ].topicName[ msg->topicLength ] == '\0' ) )
+		{
+			status = MQTT_SUCCESS;
+			linearTable[ i ].fn( msg );
+		}
+	}
+
+	return status;
+}
+
+static int phashDispatch( struct mqtt_message* msg )
+{
+	return mqtt_phashDispatch( &bench_staticRoutes, msg );
+}
+
+static double run( const char* name, int ( *dispatch )( struct mqtt_message* ), struct mqtt_message* msgs, int count )
+{
+	clock_t start = clock();
+	int matched = 0;
+	double ns;
+
+	for ( long i = 0; i < ITERATIONS; i++ )
+	{
+		matched += dispatch( &msgs[ i % count ] );
+	}
+
+	ns = ( double )( clock() - start ) * 1e9 / CLOCKS_PER_SEC / ITERATIONS;
+	printf( "%-8s %8.1f ns/dispatch  (%d matched)\n", name, ns, matched );
+	return ns;
+}
+
+int main( void )
+{
+	static char missTopics[ 64 ][ 40 ];
+	struct mqtt_message msgs[ 128 ];
+	int count = 0, slots = ( int )( sizeof( bench_staticRoutes_slots ) / sizeof( bench_staticRoutes_slots[ 0 ] ) );
+
+	for ( int i = 0; i < slots; i++ )
+	{
+		const struct mqtt_phashEntry* entry = &bench_staticRoutes_slots[ i ];
+		if ( entry->topic != NULL )
+		{
+			strcpy( linearTable[ linearCount ].topicName, entry->topic );
+			linearTable[ linearCount++ ].fn = entry->fn;
+		}
+	}
+
+	// Every routed topic once, plus the same number of topics that are not in the table
+	for ( int i = 0; i < linearCount; i++ )
+	{
+		memset( &msgs[ count ], 0, sizeof( msgs[ count ] ) );
+		msgs[ count ].topic = linearTable[ i ].topicName;
+		msgs[ count ].topicLength = ( uint16_t )strlen( linearTable[ i ].topicName );
+		count++;
+
+		snprintf( missTopics[ i ], sizeof( missTopics[ i ] ), "%s/x", linearTable[ i ].topicName );
+		memset( &msgs[ count ], 0, sizeof( msgs[ count ] ) );
+		msgs[ count ].topic = missTopics[ i ];
+		msgs[ count ].topicLength = ( uint16_t )strlen( missTopics[ i ] );
+		count++;
+	}
+
+	printf( "%d topics, %d slots, %d iterations, half of the lookups miss\n", linearCount, slots, ITERATIONS );
+	run( "linear", linearDispatch, msgs, count );
+	run( "phash", phashDispatch, msgs, count );
+
+	return 0;
+}
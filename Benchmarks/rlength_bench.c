@@ -0,0 +1,217 @@
+/*
+* Exhaustive check and microbenchmark of the Remaining Length codec in MQTT/mqtt_rlength.h, against
+*   the division loop the core used before. Host build only, see Benchmarks/ReadMe.txt
+*
+*/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "MQTT/mqtt_rlength.h"
+
+#if defined( _MSC_VER ) && ( defined( _M_X64 ) || defined( _M_IX86 ) )
+#include <intrin.h>
+#define HAVE_TSC 1
+#elif defined( __x86_64__ ) || defined( __i386__ )
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#define ITERATIONS 20000000
+#define SAMPLES    4096
+
+static volatile int32_t sink;
+
+// The original encoder and decoder, a division and a multiplication per byte
+static uint8_t* referenceEncode( uint8_t* pDestination, int32_t length )
+{
+	uint8_t lengthByte;
+
+	do
+	{
+		lengthByte = length % 128;
+		length = length / 128;
+		*( pDestination++ ) = ( length > 0 ) ? lengthByte | 0x80 : lengthByte;
+	} while ( length > 0 );
+
+	return pDestination;
+}
+
+static int32_t referenceDecode( const uint8_t* pData, int32_t available, int32_t* pValue )
+{
+	int32_t used = 0, multiplier = 1;
+
+	*pValue = 0;
+	do {
+		if ( ( used == 4 ) || ( used >= available ) )
+		{
+			return -1;
+		}
+		*pValue += ( pData[ used ] & 0x7F ) * multiplier;
+		multiplier *= 128;
+	} while ( pData[ used++ ] & 0x80 );
+
+	return used;
+}
+
+// Every valid length must encode to the same bytes as before and decode back to itself, whole and
+//   a byte at a time. Returns the number of failures
+static long checkAll( void )
+{
+	uint8_t encoded[ 4 ], reference[ 4 ];
+	long failures = 0;
+	int32_t length, value, used, i;
+	uint8_t shift;
+	int complete;
+
+	for ( length = 0; length <= MQTT_MAX_REMAINING_LENGTH; length++ )
+	{
+		used = ( int32_t )( mqtt_encodeRemainingLength( encoded, length ) - encoded );
+		if ( ( used != referenceEncode( reference, length ) - reference ) || ( memcmp( encoded, reference, used ) != 0 ) )
+		{
+			if ( failures++ < 10 )
+			{
+				printf( "encode %ld differs\n", ( long )length );
+			}
+			continue;
+		}
+
+		if ( ( mqtt_decodeRemainingLength( encoded, used, &value ) != used ) || ( value != length ) ||
+			 ( mqtt_decodeRemainingLength( encoded, used - 1, &value ) != 0 ) )
+		{
+			if ( failures++ < 10 )
+			{
+				printf( "decode %ld failed\n", ( long )length );
+			}
+			continue;
+		}
+
+		value = 0;
+		shift = 0;
+		for ( i = 0; i < used; i++ )
+		{
+			complete = mqtt_decodeRemainingLengthByte( &value, &shift, encoded[ i ] );
+			if ( complete != ( ( i == used - 1 ) ? 1 : 0 ) )
+			{
+				break;
+			}
+		}
+		if ( ( i != used ) || ( value != length ) )
+		{
+			if ( failures++ < 10 )
+			{
+				printf( "incremental decode %ld failed\n", ( long )length );
+			}
+		}
+	}
+
+	// A fifth byte is never valid
+	{
+		static const uint8_t tooLong[ 5 ] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x7F };
+
+		value = 0;
+		shift = 0;
+		for ( i = 0; i < 3; i++ )
+		{
+			mqtt_decodeRemainingLengthByte( &value, &shift, tooLong[ i ] );
+		}
+		if ( ( mqtt_decodeRemainingLength( tooLong, 5, &value ) != -1 ) ||
+			 ( mqtt_decodeRemainingLengthByte( &value, &shift, tooLong[ 3 ] ) != -1 ) )
+		{
+			printf( "5 byte length accepted\n" );
+			failures++;
+		}
+	}
+
+	return failures;
+}
+
+static uint64_t now( void )
+{
+#if HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void report( const char* name, clock_t start, uint64_t cycles )
+{
+	double ns = ( double )( clock() - start ) * 1e9 / CLOCKS_PER_SEC / ITERATIONS;
+
+	if ( HAVE_TSC )
+	{
+		printf( "%-18s %6.2f ns/op %7.2f cycles/op\n", name, ns, ( double )cycles / ITERATIONS );
+	}
+	else
+	{
+		printf( "%-18s %6.2f ns/op\n", name, ns );
+	}
+}
+
+int main( void )
+{
+	static int32_t lengths[ SAMPLES ];
+	static uint8_t encoded[ SAMPLES ][ 4 ];
+	uint8_t buffer[ 5 ] = { 0 };
+	uint32_t seed = 12345;
+	int32_t value;
+	clock_t start;
+	uint64_t cycles;
+	long failures, i;
+
+	printf( "checking all %ld lengths...\n", ( long )MQTT_MAX_REMAINING_LENGTH + 1 );
+	failures = checkAll();
+	printf( "%ld failures\n", failures );
+
+	// Mostly small packets, as on a real connection, with every encoded size represented
+	for ( i = 0; i < SAMPLES; i++ )
+	{
+		seed = seed * 1103515245UL + 12345;
+		switch ( ( seed >> 16 ) % 8 )
+		{
+		case 0: lengths[ i ] = ( seed >> 8 ) % 268435456L; break;
+		case 1: lengths[ i ] = ( seed >> 8 ) % 2097152L; break;
+		case 2: lengths[ i ] = ( seed >> 8 ) % 16384L; break;
+		default: lengths[ i ] = ( seed >> 8 ) % 128L; break;
+		}
+		referenceEncode( encoded[ i ], lengths[ i ] );
+	}
+
+	printf( "%d iterations over %d lengths, 5/8 of them a single byte\n", ITERATIONS, SAMPLES );
+
+	start = clock();
+	cycles = now();
+	for ( i = 0; i < ITERATIONS; i++ )
+	{
+		sink += *referenceEncode( buffer, lengths[ i % SAMPLES ] ) + buffer[ 0 ];
+	}
+	report( "encode reference", start, now() - cycles );
+
+	start = clock();
+	cycles = now();
+	for ( i = 0; i < ITERATIONS; i++ )
+	{
+		sink += *mqtt_encodeRemainingLength( buffer, lengths[ i % SAMPLES ] ) + buffer[ 0 ];
+	}
+	report( "encode", start, now() - cycles );
+
+	start = clock();
+	cycles = now();
+	for ( i = 0; i < ITERATIONS; i++ )
+	{
+		sink += referenceDecode( encoded[ i % SAMPLES ], 4, &value ) + value;
+	}
+	report( "decode reference", start, now() - cycles );
+
+	start = clock();
+	cycles = now();
+	for ( i = 0; i < ITERATIONS; i++ )
+	{
+		sink += mqtt_decodeRemainingLength( encoded[ i % SAMPLES ], 4, &value ) + value;
+	}
+	report( "decode", start, now() - cycles );
+
+	return ( failures == 0 ) ? 0 : 1;
+}
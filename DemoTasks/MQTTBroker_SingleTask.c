@@ -0,0 +1,80 @@
+/*
+ * A single task that runs an MQTT broker on port 1883, see mqtt_brokerService(). Local devices
+ * connect to it and publish to each other. Every message is logged where a gateway would forward
+ * it upstream, and every ten seconds the broker publishes how many clients are connected.
+ */
+
+/* Standard includes. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* FreeRTOS includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* FreeRTOS+TCP includes. */
+#include "FreeRTOS_IP.h"
+#include "FreeRTOS_Sockets.h"
+
+#include "mqtt_port.h"
+#include "MQTT/mqtt_broker.h"
+#include "MQTTBroker_SingleTask.h"
+
+#define brokerPORT					1883
+#define brokerSTATUS_PERIOD_MS		10000
+
+/*-----------------------------------------------------------*/
+
+static struct mqtt_broker xBroker;
+
+/* Called for every PUBLISH a local device sends. A gateway would mqtt_publish() it to the upstream
+ * server from here, the topic and data are only valid until this returns.
+ */
+static void prvOnPublish( struct mqtt_broker* broker, struct mqtt_brokerClient* client, struct mqtt_message* msg )
+{
+	( void )broker;
+	FreeRTOS_debug_printf( ( "Broker : %s published %d bytes to %.*s\r\n", client->clientId, ( int )msg->len, ( int )msg->topicLength, msg->topic ) );
+}
+
+static void prvBrokerTask( void* pvParameters )
+{
+	TickType_t xLastStatus;
+	char cStatus[ 12 ];
+	int i, connected;
+
+	( void )pvParameters;
+
+	if ( mqtt_brokerListen( &xBroker, brokerPORT ) != MQTT_SUCCESS )
+	{
+		FreeRTOS_debug_printf( ( "Broker : cannot listen on port %d\r\n", brokerPORT ) );
+		vTaskDelete( NULL );
+	}
+	xBroker.onPublish = prvOnPublish;
+
+	/* One task, one stack, every client */
+	xLastStatus = xTaskGetTickCount();
+	for ( ; ; )
+	{
+		mqtt_brokerService( &xBroker, pdMS_TO_TICKS( brokerSTATUS_PERIOD_MS ) );
+
+		if ( ( xTaskGetTickCount() - xLastStatus ) >= pdMS_TO_TICKS( brokerSTATUS_PERIOD_MS ) )
+		{
+			xLastStatus = xTaskGetTickCount();
+			connected = 0;
+			for ( i = 0; i < MQTT_BROKER_MAX_CLIENTS; i++ )
+			{
+				connected += ( xBroker.clients[ i ].state == MQTT_BROKER_CONNECTED );
+			}
+			sprintf( cStatus, "%d", connected );
+			mqtt_brokerPublish( &xBroker, "$SYS/broker/clients/connected", ( const uint8_t* )cStatus, ( int32_t )strlen( cStatus ) );
+		}
+	}
+}
+
+void vStartMQTTBrokerTask( uint16_t usTaskStackSize, UBaseType_t uxTaskPriority )
+{
+	xTaskCreate( prvBrokerTask, "MQTTBroker", usTaskStackSize, NULL, uxTaskPriority, NULL );
+}
+/*-----------------------------------------------------------*/
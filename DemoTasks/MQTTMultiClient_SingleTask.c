@@ -0,0 +1,90 @@
+/*
+ * A single task that connects several MQTT clients to the server and services all of them from
+ * one FreeRTOS_select() loop, see mqtt_serviceConnections(). Each client subscribes to its own
+ * topic and publishes to the topic of the next one, so messages go round between them.
+ */
+
+/* Standard includes. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* FreeRTOS includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* FreeRTOS+TCP includes. */
+#include "FreeRTOS_IP.h"
+#include "FreeRTOS_Sockets.h"
+
+#include "mqtt_port.h"
+#include "MQTTMultiClient_SingleTask.h"
+
+#define multiCLIENTS		3
+
+/*-----------------------------------------------------------*/
+
+static Socket_t xSockets[ multiCLIENTS ];
+static struct mqtt_context xClients[ multiCLIENTS ] =
+{
+	{ &xSockets[ 0 ], {"MultiClient0"}, 60U },
+	{ &xSockets[ 1 ], {"MultiClient1"}, 60U },
+	{ &xSockets[ 2 ], {"MultiClient2"}, 60U }
+};
+
+static char* pcTopics[ multiCLIENTS ] = { "MultiClient/0", "MultiClient/1", "MultiClient/2" };
+
+static uint8_t testdata[10] = { '1','2','3','4','5','6','7','8','9' };
+
+/*-----------------------------------------------------------*/
+int   prvTcpConnect(Socket_t* pxSocket);
+void  prvTcpDisconnect(Socket_t* pxSocket);
+
+static void prvMultiClientTask(void* pvParameters)
+{
+	int i, connected;
+	TickType_t xStart;
+
+	(void)pvParameters;
+
+	for ( ; ; )
+	{
+		connected = 0;
+		for ( i = 0; i < multiCLIENTS; i++ )
+		{
+			if ( ( prvTcpConnect( &xSockets[ i ] ) == 1 ) &&
+				 ( mqtt_Connect( &xClients[ i ] ) == MQTT_CONNECT_ACCEPTED ) )
+			{
+				mqtt_subscribe( &xClients[ i ], pcTopics[ i ] );
+				mqtt_manageConnection( &xClients[ i ] );
+				connected++;
+			}
+		}
+		FreeRTOS_debug_printf( ( "%d of %d clients connected\r\n", connected, multiCLIENTS ) );
+
+		/* One task, one stack, all connections */
+		xStart = xTaskGetTickCount();
+		while ( ( xTaskGetTickCount() - xStart ) < pdMS_TO_TICKS( 10000 ) )
+		{
+			for ( i = 0; i < multiCLIENTS; i++ )
+			{
+				mqtt_publish( &xClients[ i ], pcTopics[ ( i + 1 ) % multiCLIENTS ], testdata, 9, 0 );
+			}
+			mqtt_serviceConnections( pdMS_TO_TICKS( 1000 ) );
+		}
+
+		for ( i = 0; i < multiCLIENTS; i++ )
+		{
+			mqtt_unmanageConnection( &xClients[ i ] );
+			mqtt_Disconnect( &xClients[ i ] );
+			prvTcpDisconnect( &xSockets[ i ] );
+		}
+		vTaskDelay( 7000 );
+	}
+}
+
+void vStartMQTTMultiClientTask( uint16_t usTaskStackSize, UBaseType_t uxTaskPriority )
+{
+	xTaskCreate( prvMultiClientTask, "MQTTMulti", usTaskStackSize, NULL, uxTaskPriority, NULL );
+}
+/*-----------------------------------------------------------*/
@@ -50,12 +50,17 @@
 #include "FreeRTOS_IP.h"
 #include "FreeRTOS_Sockets.h"
 
-#include "MQTT/mqtt.h"
+#include "stream_buffer.h"
+
+#include "mqtt_port.h"
 
 /* The size of the buffers is a multiple of the MSS - the length of the data
 sent is a pseudo random size between 20 and echoBUFFER_SIZES. */
 #define echoBUFFER_SIZES			( ipconfigTCP_MSS * 3 )
 
+/* Room for the PUBLISH messages waiting to be processed by the task. */
+#define mqttMESSAGE_BUFFER_SIZE		( ipconfigTCP_MSS * 4 )
+
 /*-----------------------------------------------------------*/
 
 /* Rx and Tx time outs are used to ensure the sockets do not wait too long for
@@ -71,7 +76,7 @@ struct mqtt_context  mqtt1 =
 {
 	&xSocket,			// Void Pointer to network context
     {"ClientID"},			// MQTT Client ID
-	65535U				// Requested Keepalive timeout
+	60U					// Requested Keepalive timeout, in seconds
 };
 
 static uint8_t testdata[10] = { '1','2','3','4','5','6','7','8','9' };
@@ -84,6 +89,12 @@ static void prvEchoClientTask(void* pvParameters)
 {
 	(pvParameters);
 	char testBuffer[ echoBUFFER_SIZES ];
+	static uint8_t messageBuffer[ echoBUFFER_SIZES ];
+	struct mqtt_message message;
+
+	/* PUBLISH messages decoded by the IP task are passed to this task through a stream buffer */
+	StreamBufferHandle_t xMessages = xStreamBufferCreate( mqttMESSAGE_BUFFER_SIZE, 1 );
+	configASSERT( xMessages != NULL );
 
 	for ( ; ; )
 	{
@@ -92,27 +103,36 @@ static void prvEchoClientTask(void* pvParameters)
 
 		if ( prvTcpConnect( &xSocket ) == 1)  /* Connect to the echo server. */
 		{
-			FreeRTOS_debug_printf(("Sending MQTT Connect... \r\n"));
-			eMqttConnectResult_t result = mqtt_Connect( &mqtt1 );
-
-			configASSERT(result == MQTT_CONNECT_ACCEPTED);
-
-			mqtt_PingReq(&mqtt1);
-			mqtt_pollInput(&mqtt1);                   /* Receive incoming MQTT PINGRES packet */
-
-			mqtt_subscribe(&mqtt1, "MyTopic");
-			mqtt_pollInput(&mqtt1);                   /* Receive incoming MQTT SUBACK packet */
-
-			mqtt_subscribe(&mqtt1, "OtherTopic");
-			mqtt_pollInput(&mqtt1);                   /* Receive incoming MQTT SUBACK packet */
-
-			result = mqtt_publish(&mqtt1, "MyTopic", testdata, 9);
-			result = mqtt_publish(&mqtt1, "OtherTopic", testdata, 9);
-
-			vTaskDelay(500);
-
-			mqtt_pollInput(&mqtt1);                  /* Receive incoming MQTT Publish packet */
-			mqtt_pollInput(&mqtt1);                  /* Receive incoming MQTT Publish packet */
+			/* From here on the IP task decodes everything the server sends, the CONNACK included */
+			mqtt_bindIPTask(&mqtt1, xMessages);
+
+			/* The IP task works on the same context, keep it out while we make our requests */
+			vTaskSuspendAll();
+			{
+				/* CONNECT, the SUBSCRIBE for both topics and the first publishes go out back to back,
+				 * without waiting for the CONNACK. The SUBACK fills in the return codes */
+				static struct mqtt_subscription subscriptions[2] = { { "MyTopic", 1 }, { "OtherTopic", 0 } };
+				FreeRTOS_debug_printf(("Sending MQTT Connect... \r\n"));
+				int result = mqtt_connect_pipelined(&mqtt1, subscriptions, 2);
+
+				configASSERT(result == MQTT_SUCCESS);
+
+				mqtt_publish(&mqtt1, "MyTopic", testdata, 9, 1);
+				mqtt_publish(&mqtt1, "OtherTopic", testdata, 9, 0);
+			}
+			xTaskResumeAll();
+
+			/* Pings only go out when the connection has been idle for a whole keepalive period */
+			mqtt_startKeepalive(&mqtt1);
+
+			/* Process incoming PUBLISH messages until the server goes quiet */
+			while (mqtt_receiveMessage(xMessages, messageBuffer, sizeof(messageBuffer), pdMS_TO_TICKS(2000), &message) == MQTT_SUCCESS)
+			{
+				mqtt_routeMessage(&message);
+			}
+
+			mqtt_stopKeepalive(&mqtt1);
+			mqtt_unbindIPTask(&mqtt1);
 
 			FreeRTOS_debug_printf(("Request Disconnect\r\n"));
 			mqtt_Disconnect(&mqtt1);
@@ -0,0 +1,10 @@
+#ifndef MQTT_BROKER_SINGLE_TASK_H
+#define MQTT_BROKER_SINGLE_TASK_H
+
+/*
+ * Create a single task that runs an MQTT broker for devices on the local network
+ * and services all of their connections with FreeRTOS_select().
+ */
+void vStartMQTTBrokerTask( uint16_t usTaskStackSize, UBaseType_t uxTaskPriority );
+
+#endif /* MQTT_BROKER_SINGLE_TASK_H */
@@ -0,0 +1,10 @@
+#ifndef MQTT_MULTI_CLIENT_SINGLE_TASK_H
+#define MQTT_MULTI_CLIENT_SINGLE_TASK_H
+
+/*
+ * Create a single task that keeps several MQTT connections open at the same time
+ * and services all of them with FreeRTOS_select().
+ */
+void vStartMQTTMultiClientTask( uint16_t usTaskStackSize, UBaseType_t uxTaskPriority );
+
+#endif /* MQTT_MULTI_CLIENT_SINGLE_TASK_H */
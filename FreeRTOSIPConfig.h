@@ -251,6 +251,11 @@ FreeRTOS_SendPingRequest() API function is available. */
 (and associated) API function is available. */
 #define ipconfigSUPPORT_SELECT_FUNCTION				1
 
+/* If ipconfigUSE_CALLBACKS is set to 1 then sockets can have handlers that the IP
+task calls for connection, reception and transmission events.  The MQTT port uses
+the reception handler to decode MQTT packets straight from the IP task. */
+#define ipconfigUSE_CALLBACKS						1
+
 /* If ipconfigFILTER_OUT_NON_ETHERNET_II_FRAMES is set to 1 then Ethernet frames
 that are not in Ethernet II format will be dropped.  This option is included for
 potential future IP stack developments. */
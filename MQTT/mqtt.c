@@ -4,31 +4,159 @@
 */
 #include <string.h>
 #include "mqtt.h"
+#include "mqtt_rlength.h"
+#if MQTT_STATS && defined( _MSC_VER )
+#include <intrin.h>
+#endif
 
 #define MQTT_VERSION_3_1_1    4U 
+#define MQTT_VERSION_5_0      5U
 
-// Applies to QOS1/2 packets only
-#define MQTT_PACKET_TYPE_PUBACK                                ( ( uint8_t ) 0x40U ) /**< @brief PUBACK (server-to-client). */
+#if MQTT_VERSION_5
+#define MQTT_PROTOCOL_LEVEL   MQTT_VERSION_5_0
 
-static uint8_t* encodeRemainingLength( uint8_t* pDestination, int32_t length );
-struct mqtt_header parseHeader( struct mqtt_context* tag );
+// The MQTT 5 properties we look at, all others are skipped
+#define MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM                      ( ( uint8_t ) 0x22U )
+#define MQTT_PROPERTY_TOPIC_ALIAS                              ( ( uint8_t ) 0x23U )
+#else
+#define MQTT_PROTOCOL_LEVEL   MQTT_VERSION_3_1_1
+#endif
 
+// One bit for every slot of the in-flight table
+#define INFLIGHT_SLOTS_MASK    ( 0xFFFFFFFFUL >> ( 32 - MQTT_MAX_INFLIGHT ) )
 
-int mqtt_Connect( struct mqtt_context* tag )
-{   
+// The received set is kept at most half full so probe sequences stay short
+#define RECEIVED_IDS_MASK      ( MQTT_MAX_RECEIVED_QOS2 * 2 - 1 )
+
+// States of the incremental decoder
+#define DECODE_TYPE            0
+#define DECODE_LENGTH          1
+#define DECODE_BODY            2
+#define DECODE_SKIP            3
+#define DECODE_HEADER          4	// Variable header of a PUBLISH that is passed up in pieces
+#define DECODE_CHUNKS          5	// Its payload
+
+// Fixed and variable header of CONNECT up to the ClientID
+#define CONNECT_HEADER_SIZE    19
+
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+// A publish in the offline queue, followed by its topic and data. Entries never wrap around the end
+//   of the ring, one that does not fit there starts over at 0 behind an entry with wrap set
+struct queuedPublish {
+	uint16_t topicLength;
+	uint8_t  qos;
+	uint8_t  wrap;
+	int32_t  len;
+};
+#define QUEUE_ENTRY_SIZE( topicLength, len )    ( ( ( int32_t )sizeof( struct queuedPublish ) + ( topicLength ) + ( len ) + 3 ) & ~3 )
+#endif
+
+static int sendPacket( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count );
+static int sendControl( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count );
+static int writePacket( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count, int32_t total );
+#if MQTT_TX_BUFFER_SIZE > 0
+static int queuePacket( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count );
+static int flushBuffer( struct mqtt_context* tag );
+#endif
+static int fillInput( struct mqtt_context* tag, int32_t count );
+static uint8_t* peekInput( struct mqtt_context* tag, int32_t count );
+static void consumeInput( struct mqtt_context* tag, int32_t count );
+static void skipInput( struct mqtt_context* tag, int32_t count );
+static int publishFits( size_t topicLength, int32_t len, uint8_t qos );
+static int subUnsub( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count, uint8_t packetType, int results, const struct mqtt_iovec* prefix, int prefixCount );
+static int processConnAck( struct mqtt_context* tag, struct mqtt_header* header );
+static int processPacket( struct mqtt_context* tag, struct mqtt_header* header );
+static int feedPacket( struct mqtt_context* tag, const uint8_t* pBody );
+static int processPublish( struct mqtt_context* tag, struct mqtt_header* header );
+static int processLargePublish( struct mqtt_context* tag, struct mqtt_header* header );
+static int32_t publishHeaderLength( uint8_t type, const uint8_t* pBody, int32_t available );
+static int32_t decodePublishHeader( struct mqtt_context* tag, struct mqtt_message* msg, uint8_t* pBody, int32_t length );
+static int beginChunks( struct mqtt_context* tag, uint8_t type, int32_t headerLength, int32_t remainingLength );
+static int deliverChunk( struct mqtt_context* tag, uint8_t* pData, int32_t len );
+static int processAck( struct mqtt_context* tag, struct mqtt_header* header );
+static int processSubAck( struct mqtt_context* tag, struct mqtt_header* header );
+static uint16_t allocPacketId( struct mqtt_context* tag, uint8_t ack );
+static int findInflight( struct mqtt_context* tag, uint16_t packetId, uint8_t ack );
+static void releasePacketId( struct mqtt_context* tag, uint16_t packetId, uint8_t ack );
+static int replayMessage( struct mqtt_context* tag, uint16_t packetId, uint8_t ack, const uint8_t* pPacket, int32_t len );
+static int reserveSlot( struct mqtt_context* tag, uint16_t packetId, uint8_t ack, const uint8_t* pPacket, int32_t len );
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+static int enqueuePublish( struct mqtt_context* tag, const char* topic, uint16_t topicLength, const uint8_t* pData, int32_t len, uint8_t qos );
+static int32_t queueEntryAt( struct mqtt_context* tag, int32_t offset, struct queuedPublish* pEntry );
+static void dropQueued( struct mqtt_context* tag );
+static int drainQueue( struct mqtt_context* tag );
+#endif
+static int sendAck( struct mqtt_context* tag, uint8_t packetType, uint16_t packetId );
+static int addReceivedId( struct mqtt_context* tag, uint16_t packetId );
+static void removeReceivedId( struct mqtt_context* tag, uint16_t packetId );
+int parseHeader( struct mqtt_context* tag, struct mqtt_header* header );
+#if MQTT_VERSION_5
+static int32_t decodeVarInt( const uint8_t* pData, int32_t available, int32_t* pValue );
+static int32_t propertySize( uint8_t id, const uint8_t* pData, int32_t available );
+static int32_t findProperty( const uint8_t* pData, int32_t length, uint8_t id, uint16_t* pValue );
+static int assignTopicAlias( struct mqtt_context* tag, const char* topic, uint16_t* pTopicLength );
+static int32_t resolveTopicAlias( struct mqtt_context* tag, struct mqtt_message* msg, const uint8_t* pBody, int32_t offset, int32_t length );
+#endif
+#if MQTT_STATS
+static void statsBegin( struct mqtt_context* tag );
+static void statsEnd( struct mqtt_context* tag );
+static void countIn( struct mqtt_context* tag, uint8_t type, int32_t remainingLength );
+static void countOut( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count );
+static void countEvent( struct mqtt_context* tag, uint32_t* pCounter, uint32_t n );
+static void recordTime( struct mqtt_context* tag, struct mqtt_histogram* pHistogram, uint32_t ms );
+#else
+// Without statistics these compile to nothing, their arguments are not evaluated
+#define countIn( tag, type, remainingLength )
+#define countOut( tag, iov, count )
+#define countEvent( tag, pCounter, n )
+#define recordTime( tag, pHistogram, ms )
+#endif
+
+
+// Start a new connection and fill in the CONNECT packet. Returns the number of iovecs, buffer must
+//   hold CONNECT_HEADER_SIZE bytes
+static int buildConnect( struct mqtt_context* tag, uint8_t* buffer, struct mqtt_iovec* iov )
+{
 	uint16_t len;
-	eMqttConnectResult_t  status;
+	uint8_t* pCursor = &buffer[ 12 ];
 
 	len = (uint16_t)strlen((char*)tag->clientId);
 
-	uint8_t buffer[ 15 ] = { MQTT_PACKET_TYPE_CONNECT,				// Packet Type
-							 0,										// Remaining Length placeholder
-							 0, 4, 'M', 'Q', 'T' , 'T',				// MQTT Protocol name
-							 MQTT_VERSION_3_1_1,					// Protocol level
-							 0b00000000 };							// Connect Flags 
+	// A new connection starts with an empty input buffer
+	tag->inputHead = 0;
+	tag->inputTail = 0;
+	tag->viewLength = 0;
+	tag->decodeState = DECODE_TYPE;
+
+	// Nothing sent on an earlier connection can be acknowledged on this one
+	tag->inflightUsed = 0;
+	tag->inflightReserved = 0;
+	tag->pingOutstanding = 0;
+	tag->connected = 0;
+	tag->streamOpen = 0;
+#if MQTT_TX_BUFFER_SIZE > 0
+	tag->txLength = 0;
+#endif
+
+	// A clean session forgets everything that was not acknowledged
+	if ( ( tag->sessionStore != NULL ) && !tag->dontRequestCleanSession )
+	{
+		tag->sessionStore->clear( tag->sessionStore );
+	}
 
+#if MQTT_VERSION_5
+	// Topic Aliases are not carried over from an earlier connection
+	memset( tag->outboundAliases, 0, sizeof( tag->outboundAliases ) );
+	memset( tag->inboundAliases, 0, sizeof( tag->inboundAliases ) );
+	tag->topicAliasMaximum = 0;
+#endif
 
-	buffer[ 1 ] = 12 + len;
+	buffer[ 0 ] = MQTT_PACKET_TYPE_CONNECT;				// Packet Type
+	buffer[ 2 ] = 0;									// MQTT Protocol name
+	buffer[ 3 ] = 4;
+	memcpy( &buffer[ 4 ], "MQTT", 4 );
+	buffer[ 8 ] = MQTT_PROTOCOL_LEVEL;					// Protocol level
+	buffer[ 9 ] = 0b00000000;							// Connect Flags 
 	
     // Do we get a clean session? Set the cleanSession flag
 	buffer[ 9 ] |= ( tag->dontRequestCleanSession > 0 ? 0 : 2 );
@@ -37,236 +165,2366 @@ int mqtt_Connect( struct mqtt_context* tag )
 	buffer[ 10 ] = 0xFF & ( tag->keepaliveTimeout >> 8 );   // MSB 
 	buffer[ 11 ] = 0xFF & tag->keepaliveTimeout;			// LSB 
 
+#if MQTT_VERSION_5
+	// Properties, only Topic Alias Maximum: how many aliases the server may use in its publishes
+	*( pCursor++ ) = 3;
+	*( pCursor++ ) = MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM;
+	*( pCursor++ ) = 0xFF & ( MQTT_MAX_INBOUND_TOPIC_ALIASES >> 8 );
+	*( pCursor++ ) = 0xFF & MQTT_MAX_INBOUND_TOPIC_ALIASES;
+#endif
+
 	// ClientID Length
-	buffer[ 12 ] = 0xFF & ( len >> 8 );
-	buffer[ 13 ] = 0xFF & len;
+	*( pCursor++ ) = 0xFF & ( len >> 8 );
+	*( pCursor++ ) = 0xFF & len;
+
+	buffer[ 1 ] = ( uint8_t )( pCursor - buffer - 2 + len );
+
+	// Fixed and variable length headers up to ClientID Length, followed by the actual ClientID
+	iov[ 0 ].base = buffer;
+	iov[ 0 ].len = ( int32_t )( pCursor - buffer );
+	iov[ 1 ].base = tag->clientId;
+	iov[ 1 ].len = len;
+	return 2;
+}
+
+int mqtt_Connect( struct mqtt_context* tag )
+{   
+	uint8_t buffer[ CONNECT_HEADER_SIZE ];
+	struct mqtt_iovec iov[ 2 ];
+	int count = buildConnect( tag, buffer, iov );
 
-	// Send fixed and variable length headers up to ClientID Length
-	if ( 14 != mqtt_write( tag, buffer, 14 ) )
+	if ( sendPacket( tag, iov, count ) != MQTT_SUCCESS )
 	{
 		return MQTT_ERROR;
 	}
 
-	// Send the actual ClientID
-	if ( len != mqtt_write( tag, tag->clientId, len ) )
+	struct mqtt_header header;
+
+	// Valid CONNACK is the only packet we may accept at this point
+	if ( ( parseHeader( tag, &header ) != MQTT_SUCCESS ) ||
+		 ( header.type != MQTT_PACKET_TYPE_CONNACK ) || ( processConnAck( tag, &header ) != MQTT_SUCCESS ) )
 	{
 		return MQTT_ERROR;
 	}
+	return tag->connectResult;
+}
+
+int mqtt_connect_pipelined( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count )
+{
+	uint8_t buffer[ CONNECT_HEADER_SIZE ];
+	struct mqtt_iovec iov[ 2 ];
+	int iovCount = buildConnect( tag, buffer, iov ), status;
 
-	struct mqtt_header header = parseHeader( tag );
+	// The packet ids start over, keep the SUBSCRIBE out of the slots the stored messages need
+	if ( tag->sessionStore != NULL )
+	{
+		tag->sessionStore->replay( tag->sessionStore, reserveSlot, tag );
+	}
 
-	// Valid CONNACK is the only packet we may accept at this point
-	if ( header.type == MQTT_PACKET_TYPE_CONNACK )
+	// CONNECT and SUBSCRIBE go out in one write
+	if ( count > 0 )
+	{
+		status = subUnsub( tag, subscriptions, count, MQTT_PACKET_TYPE_SUBSCRIBE, 1, iov, iovCount );
+	}
+	else
+	{
+		status = sendPacket( tag, iov, iovCount );
+	}
+	if ( status != MQTT_SUCCESS )
+	{
+		return status;
+	}
+	tag->connectPending = 1;
+
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+	// Queued publishes follow right away. Messages in a session store have to go first, the queue then
+	//   waits for the CONNACK
+	if ( tag->sessionStore == NULL )
+	{
+		drainQueue( tag );
+	}
+#endif
+	return MQTT_SUCCESS;
+}
+
+// Take in a CONNACK, in answer to either way of connecting. The connection is up once it is accepted,
+//   then the session store is replayed and the offline queue drained
+static int processConnAck( struct mqtt_context* tag, struct mqtt_header* header )
+{
+	uint8_t* pBody = ( header->remainingLength >= 2 ) ? peekInput( tag, 2 ) : NULL;
+
+	if ( pBody == NULL )
+	{
+		skipInput( tag, header->remainingLength );
+		return MQTT_ERROR;
+	}
+
+	tag->sessionPresent = pBody[ 0 ];
+	tag->connectResult = pBody[ 1 ];
+	tag->connectPending = 0;
+	tag->inflightReserved = 0;
+	consumeInput( tag, 2 );
+
+	// Without a session the server will not send PUBREL for anything we received before
+	if ( !tag->sessionPresent )
+	{
+		memset( tag->receivedIds, 0, sizeof( tag->receivedIds ) );
+		tag->receivedCount = 0;
+	}
+
+#if MQTT_VERSION_5
+	// The CONNACK properties tell how many Topic Aliases we may use
+	if ( header->remainingLength > 2 )
 	{
-		if ( mqtt_read( tag, buffer, 2 ) != 2 )
+		uint8_t* pProperties = peekInput( tag, header->remainingLength - 2 );
+		uint16_t aliasMaximum = 0;
+
+		if ( pProperties != NULL )
 		{
-			status = MQTT_ERROR;
+			findProperty( pProperties, header->remainingLength - 2, MQTT_PROPERTY_TOPIC_ALIAS_MAXIMUM, &aliasMaximum );
+			consumeInput( tag, header->remainingLength - 2 );
 		}
-		else 
+		else
 		{
-			tag->sessionPresent = buffer[ 0 ];
-			status = buffer[ 1 ];
+			skipInput( tag, header->remainingLength - 2 );
 		}
+		tag->topicAliasMaximum = ( aliasMaximum < MQTT_MAX_TOPIC_ALIASES ) ? aliasMaximum : MQTT_MAX_TOPIC_ALIASES;
 	}
-	else {
-		status = MQTT_ERROR;
+#else
+	skipInput( tag, header->remainingLength - 2 );
+#endif
+
+	tag->connected = ( tag->connectResult == MQTT_CONNECT_ACCEPTED );
+	if ( !tag->connected )
+	{
+		return MQTT_SUCCESS;
 	}
-	return status;
+
+	// Send again whatever the server did not acknowledge before. A failed write shows up on the next
+	//   call like on any other broken connection
+	if ( tag->sessionStore != NULL )
+	{
+		tag->sessionStore->replay( tag->sessionStore, replayMessage, tag );
+	}
+
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+	// Then what was published while we were away, newer messages queue up behind it
+	drainQueue( tag );
+#endif
+	return MQTT_SUCCESS;
 }
 
 int mqtt_Disconnect( struct mqtt_context* tag )
 {
 	uint8_t buffer[ 2 ] = { MQTT_PACKET_TYPE_DISCONNECT,  0 };						
+	struct mqtt_iovec iov = { buffer, 2 };
+	int status;
+
+	// Send packet
+	status = sendPacket( tag, &iov, 1 );
+	tag->connected = 0;
+	return status;
+}
 
+int mqtt_PingReq( struct mqtt_context* tag )
+{
+	uint8_t buffer[ 2 ] = { MQTT_PACKET_TYPE_PINGREQ, 0 };							
+	struct mqtt_iovec iov = { buffer, 2 };
+						
 	// Send packet
-	if ( 2 == mqtt_write( tag, buffer, 2 ) )
+	if ( sendControl( tag, &iov, 1 ) != MQTT_SUCCESS )
 	{
-		return MQTT_SUCCESS;
+		return MQTT_ERROR;
 	}
-	else 
+
+	// Only the first unanswered ping starts the clock
+	if ( !tag->pingOutstanding )
+	{
+		tag->pingOutstanding = 1;
+		tag->pingSendTime = tag->lastSendTime;
+	}
+	return MQTT_SUCCESS;
+}
+
+int mqtt_keepalive( struct mqtt_context* tag, uint32_t* pNextCheck )
+{
+	uint32_t interval = tag->keepaliveTimeout * 1000UL;
+	uint32_t now = mqtt_getTime( tag );
+	uint32_t idle, nextCheck = 0;
+	int status = MQTT_SUCCESS;
+
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+	// Queued messages that found no free in-flight slot before
+	if ( tag->connected && ( tag->queueCount > 0 ) )
+	{
+		drainQueue( tag );
+	}
+#endif
+
+#if MQTT_TX_BUFFER_SIZE > 0
+	uint32_t flushCheck = MQTT_TX_FLUSH_TIME;
+
+	// Buffered publishes go first, writing them may make the ping unnecessary
+	if ( ( tag->txLength > 0 ) && ( ( int32_t )( now - tag->txDeadline ) >= 0 ) && ( mqtt_flush( tag ) == MQTT_ERROR ) )
 	{
 		return MQTT_ERROR;
 	}
+	if ( ( tag->txLength > 0 ) && ( ( int32_t )( tag->txDeadline - now ) > 0 ) )
+	{
+		flushCheck = tag->txDeadline - now;
+	}
+#endif
+
+	if ( interval > 0 )
+	{
+		if ( tag->pingOutstanding && ( now - tag->pingSendTime >= interval ) )
+		{
+			return MQTT_ERROR;
+		}
+
+		// Any other packet resets the server's keepalive timer just as well as a ping
+		idle = now - tag->lastSendTime;
+		if ( idle >= interval )
+		{
+			if ( mqtt_PingReq( tag ) != MQTT_SUCCESS )
+			{
+				// Nothing went out, it is still due
+				status = MQTT_BUSY;
+				idle = interval - MQTT_KEEPALIVE_RETRY_TIME;
+			}
+			else
+			{
+				idle = 0;
+			}
+		}
+
+		nextCheck = interval - idle;
+		if ( tag->pingOutstanding && ( interval - ( now - tag->pingSendTime ) < nextCheck ) )
+		{
+			nextCheck = interval - ( now - tag->pingSendTime );
+		}
+	}
+
+#if MQTT_TX_BUFFER_SIZE > 0
+	if ( ( tag->txLength > 0 ) && ( ( nextCheck == 0 ) || ( flushCheck < nextCheck ) ) )
+	{
+		nextCheck = flushCheck;
+	}
+#endif
+
+	if ( pNextCheck != NULL )
+	{
+		*pNextCheck = nextCheck;
+	}
+	return status;
 }
 
-int mqtt_PingReq( struct mqtt_context* tag )
+// Write out the transmit buffer. MQTT_BUSY if the transport took nothing or, with MQTT_TX_PRIORITY,
+//   still holds too much, the publishes then stay buffered. Anything short of the whole buffer
+//   leaves the stream broken
+int mqtt_flush( struct mqtt_context* tag )
 {
-	uint8_t buffer[ 2 ] = { MQTT_PACKET_TYPE_PINGREQ, 0 };							
-						
-	// Send packet
-	if ( 2 == mqtt_write( tag, buffer, 2 ) )
+#if MQTT_TX_PRIORITY
+	// Bulk data waits until the transport has caught up, so control packets never queue behind much
+	if ( ( tag->txLength > 0 ) && ( mqtt_txQueued( tag ) >= MQTT_TX_HOL_LIMIT ) )
+	{
+		return MQTT_BUSY;
+	}
+#endif
+#if MQTT_TX_BUFFER_SIZE > 0
+	return flushBuffer( tag );
+#else
+	( void )tag;
+	return MQTT_SUCCESS;
+#endif
+}
+
+#if MQTT_TX_BUFFER_SIZE > 0
+// Write the transmit buffer, however backed up the transport is. Packets that must not overtake
+//   the publishes in it call this first
+static int flushBuffer( struct mqtt_context* tag )
+{
+	struct mqtt_iovec iov = { tag->txBuffer, tag->txLength };
+	int written;
+
+	if ( tag->txLength == 0 )
 	{
 		return MQTT_SUCCESS;
 	}
-	else 
+
+	// Not in the middle of a streamed publish
+	if ( tag->streamOpen )
 	{
+		return MQTT_BUSY;
+	}
+
+	written = mqtt_writev( tag, &iov, 1 );
+	if ( written == 0 )
+	{
+		return MQTT_BUSY;
+	}
+
+	tag->txLength = 0;
+	if ( written != iov.len )
+	{
+		tag->connected = 0;
 		return MQTT_ERROR;
 	}
+	tag->lastSendTime = mqtt_getTime( tag );
+	return MQTT_SUCCESS;
 }
+#endif
 
-int mqtt_publish( struct mqtt_context* tag, char* topic, uint8_t* pData, int32_t len )
+int mqtt_publish( struct mqtt_context* tag, char* topic, uint8_t* pData, int32_t len, uint8_t qos )
 {
-	int32_t status = 0;
 	uint8_t* pCursor;
-	uint16_t topiclen = (uint16_t)strlen( topic );
-	int32_t remainingLength = len + topiclen + 2;
+	size_t topicLength = strlen( topic );
+	uint16_t topiclen = ( uint16_t )topicLength;
+	uint16_t packetId = 0;
+	int32_t remainingLength;
 	uint8_t buffer[ 7 ] = { MQTT_PACKET_TYPE_PUBLISH };
-	
-	pCursor = encodeRemainingLength( &buffer[1], remainingLength );
-	*( pCursor++ ) = topiclen >> 8;
-	*( pCursor++ ) = topiclen & 0xFF;
+	uint8_t packetIdBytes[ 2 ];
+	uint8_t properties[ 4 ] = { 0 };
+	int32_t propertiesLength = 0;
+	uint8_t ack = 0;
+	int status;
+#if MQTT_VERSION_5
+	int alias;
+#endif
 
-	// Write the fixed header
-	status = mqtt_write( tag, buffer, pCursor - buffer );
-	if ( status != pCursor - buffer )
+	if ( !publishFits( topicLength, len, qos ) )
 	{
 		return MQTT_ERROR;
 	}
+	remainingLength = len + topiclen + 2;
 
-	status = mqtt_write( tag, ( uint8_t* )topic, topiclen );
-	if ( status != topiclen )
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+	// Messages must not overtake those queued before them
+	if ( tag->connected && ( tag->queueCount > 0 ) )
 	{
-		return MQTT_ERROR;
+		drainQueue( tag );
+	}
+	if ( !tag->connected || ( tag->queueCount > 0 ) )
+	{
+		return enqueuePublish( tag, topic, topiclen, pData, len, qos );
+	}
+#endif
+
+	// QoS 1 and 2 messages take an in-flight slot until their PUBACK or PUBREC arrives
+	if ( qos > 0 )
+	{
+		ack = ( qos == 1 ) ? MQTT_PACKET_TYPE_PUBACK : MQTT_PACKET_TYPE_PUBREC;
+		packetId = allocPacketId( tag, ack );
+		if ( packetId == 0 )
+		{
+			return MQTT_BUSY;
+		}
+		buffer[ 0 ] |= qos << 1;
+		remainingLength += 2;
+	}
+
+#if MQTT_VERSION_5
+	// Once a topic has an alias only the alias is sent, the topic itself is left out
+	remainingLength -= topiclen;
+	// A saved publish may be replayed on another connection, where the alias means nothing
+	alias = ( ( qos == 0 ) || ( tag->sessionStore == NULL ) ) ? assignTopicAlias( tag, topic, &topiclen ) : -1;
+	remainingLength += topiclen + 1;
+	propertiesLength = 1;
+	if ( alias >= 0 )
+	{
+		properties[ 0 ] = 3;
+		properties[ 1 ] = MQTT_PROPERTY_TOPIC_ALIAS;
+		properties[ 2 ] = 0xFF & ( ( alias + 1 ) >> 8 );
+		properties[ 3 ] = 0xFF & ( alias + 1 );
+		propertiesLength = 4;
+		remainingLength += 3;
 	}
+#endif
+
+	pCursor = mqtt_encodeRemainingLength( &buffer[1], remainingLength );
+	*( pCursor++ ) = topiclen >> 8;
+	*( pCursor++ ) = topiclen & 0xFF;
+
+	packetIdBytes[ 0 ] = packetId >> 8;
+	packetIdBytes[ 1 ] = packetId & 0xFF;
 
-	// Write the payload
-	status = mqtt_write( tag, pData, len );
-	if ( status != len )
+	// Fixed header, topic, Packet Identifier (if any), properties (MQTT 5 only) and payload go out as one write
+	struct mqtt_iovec iov[ 5 ] = {
+		{ buffer, ( int32_t )( pCursor - buffer ) },
+		{ ( uint8_t* )topic, topiclen },
+		{ packetIdBytes, ( qos > 0 ) ? 2 : 0 },
+		{ properties, propertiesLength },
+		{ pData, len }
+	};
+
+	if ( ( packetId != 0 ) && ( tag->sessionStore != NULL ) &&
+		 ( tag->sessionStore->save( tag->sessionStore, packetId, ack, iov, 5 ) != MQTT_SUCCESS ) )
 	{
+		releasePacketId( tag, packetId, ack );
 		return MQTT_ERROR;
 	}
-	else 
+
+#if MQTT_TX_BUFFER_SIZE > 0
+	status = queuePacket( tag, iov, 5 );
+#else
+	status = sendPacket( tag, iov, 5 );
+#endif
+	if ( status != MQTT_SUCCESS )
 	{
-		return MQTT_SUCCESS;
+		if ( packetId != 0 )
+		{
+			releasePacketId( tag, packetId, ack );
+		}
+#if MQTT_VERSION_5
+		// The server may not have seen the alias being set, send the topic in full next time
+		if ( alias >= 0 )
+		{
+			tag->outboundAliases[ alias ].topicLength = 0;
+		}
+#endif
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+		// The connection broke under this message, it goes out after the next CONNACK instead
+		if ( !tag->connected )
+		{
+			return enqueuePublish( tag, topic, ( uint16_t )strlen( topic ), pData, len, qos );
+		}
+#endif
 	}
+	return status;
 }
 
-int subUnsub(struct mqtt_context* tag, char* topicFilter, uint8_t packetType)
+int mqtt_publish_begin( struct mqtt_context* tag, char* topic, int32_t totalLen, uint8_t qos )
 {
-	int32_t status = 0;
 	uint8_t* pCursor;
-	uint16_t topicFilterlen = (uint16_t)strlen( topicFilter );
-	int32_t remainingLength =  topicFilterlen + 5;
-	uint8_t buffer[9] = { 0 };
+	size_t topicLength = strlen( topic );
+	uint16_t topiclen = ( uint16_t )topicLength;
+	uint16_t packetId = 0;
+	int32_t remainingLength;
+	uint8_t buffer[ 7 ] = { MQTT_PACKET_TYPE_PUBLISH };
+	uint8_t packetIdBytes[ 2 ];
+	static const uint8_t noProperties = 0;
+	uint8_t ack = 0;
 
-	buffer[0] = packetType;
+	if ( !publishFits( topicLength, totalLen, qos ) || tag->streamOpen )
+	{
+		return MQTT_ERROR;
+	}
+	remainingLength = totalLen + topiclen + 2 + ( MQTT_VERSION_5 ? 1 : 0 );
 
-	pCursor = encodeRemainingLength( &buffer[ 1 ], remainingLength );
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+	// Queued messages go first, this one cannot be queued
+	if ( tag->connected && ( tag->queueCount > 0 ) )
+	{
+		drainQueue( tag );
+	}
+	if ( tag->queueCount > 0 )
+	{
+		return MQTT_BUSY;
+	}
+#endif
 
-	static uint16_t packetId = 0;
-	*(pCursor++) = 0xFF & ( ++packetId ) >> 8;
-	*(pCursor++) = 0xFF & packetId;
+	if ( qos > 0 )
+	{
+		ack = ( qos == 1 ) ? MQTT_PACKET_TYPE_PUBACK : MQTT_PACKET_TYPE_PUBREC;
+		packetId = allocPacketId( tag, ack );
+		if ( packetId == 0 )
+		{
+			return MQTT_BUSY;
+		}
+		buffer[ 0 ] |= qos << 1;
+		remainingLength += 2;
+	}
+
+	pCursor = mqtt_encodeRemainingLength( &buffer[ 1 ], remainingLength );
+	*( pCursor++ ) = topiclen >> 8;
+	*( pCursor++ ) = topiclen & 0xFF;
 
-	*(pCursor++) = 0xFF & ( topicFilterlen >> 8 );
-	*(pCursor++) = 0xFF & topicFilterlen;
+	packetIdBytes[ 0 ] = packetId >> 8;
+	packetIdBytes[ 1 ] = packetId & 0xFF;
 
-	// Write the fixed header
-	status = mqtt_write( tag, buffer, pCursor - buffer );
-	if ( status != pCursor - buffer )
+	// Everything but the payload, no Topic Alias in MQTT 5
+	struct mqtt_iovec iov[ 4 ] = {
+		{ buffer, ( int32_t )( pCursor - buffer ) },
+		{ ( uint8_t* )topic, topiclen },
+		{ packetIdBytes, ( qos > 0 ) ? 2 : 0 },
+		{ &noProperties, MQTT_VERSION_5 ? 1 : 0 }
+	};
+
+	if ( sendPacket( tag, iov, 4 ) != MQTT_SUCCESS )
 	{
+		if ( packetId != 0 )
+		{
+			releasePacketId( tag, packetId, ack );
+		}
 		return MQTT_ERROR;
 	}
 
-	// Write the Topic Filter
-	status = mqtt_write( tag, (uint8_t*)topicFilter, topicFilterlen+1 );
-	if ( status != topicFilterlen )
+	tag->streamOpen = 1;
+	tag->streamRemaining = totalLen;
+	tag->streamDeferredLength = 0;
+	return MQTT_SUCCESS;
+}
+
+int mqtt_publish_append( struct mqtt_context* tag, const uint8_t* pChunk, int32_t len )
+{
+	struct mqtt_iovec iov = { pChunk, len };
+
+	if ( !tag->streamOpen || ( len < 0 ) || ( len > tag->streamRemaining ) )
 	{
 		return MQTT_ERROR;
 	}
-	else
+	if ( len == 0 )
 	{
 		return MQTT_SUCCESS;
 	}
-}
 
+	// Past sendPacket, which would hold it back
+	if ( mqtt_writev( tag, &iov, 1 ) != len )
+	{
+		tag->connected = 0;
+		return MQTT_ERROR;
+	}
+	tag->streamRemaining -= len;
+	tag->lastSendTime = mqtt_getTime( tag );
+	countEvent( tag, &tag->stats.bytesOut[ MQTT_PACKET_TYPE_PUBLISH >> 4 ], len );
+	return MQTT_SUCCESS;
+}
 
-int mqtt_subscribe(struct mqtt_context* tag, char* topicFilter)
+int mqtt_publish_end( struct mqtt_context* tag )
 {
-	return subUnsub(tag, topicFilter, MQTT_PACKET_TYPE_SUBSCRIBE);
+	struct mqtt_iovec iov = { tag->streamDeferred, tag->streamDeferredLength };
+
+	if ( !tag->streamOpen )
+	{
+		return MQTT_ERROR;
+	}
+	tag->streamOpen = 0;
+
+	// The server is still waiting for the rest of the payload, nothing sent from here on makes sense to it
+	if ( tag->streamRemaining > 0 )
+	{
+		tag->connected = 0;
+		return MQTT_ERROR;
+	}
+
+	if ( tag->streamDeferredLength > 0 )
+	{
+		tag->streamDeferredLength = 0;
+		return sendPacket( tag, &iov, 1 );
+	}
+	return MQTT_SUCCESS;
 }
 
-int mqtt_unSubscribe(struct mqtt_context* tag, char* topicFilter)
+// Check that a PUBLISH of a payload of len bytes to a topic of topicLength bytes can be encoded: the
+//   topic length takes 2 bytes and the Remaining Length at most MQTT_MAX_REMAINING_LENGTH. Counts the
+//   largest properties that may be added, a Topic Alias, so nothing has to be undone later
+static int publishFits( size_t topicLength, int32_t len, uint8_t qos )
 {
-	return subUnsub(tag, topicFilter, MQTT_PACKET_TYPE_UNSUBSCRIBE);
+	int32_t overhead = 2 + ( int32_t )topicLength + ( ( qos > 0 ) ? 2 : 0 ) + ( MQTT_VERSION_5 ? 4 : 0 );
+
+	return ( qos <= 2 ) && ( topicLength <= 0xFFFF ) && ( len >= 0 ) && ( len <= MQTT_MAX_REMAINING_LENGTH - overhead );
 }
 
-// Check the input buffer for the next MQTT packet and process it
-int mqtt_pollInput( struct mqtt_context* tag )
+// Send SUBSCRIBE or UNSUBSCRIBE for count filters. The fixed header and each filter's length, name
+//   and Requested QoS are gathered into one write. With results the acknowledgement is stored in
+//   the filters, otherwise it is left to the application. Up to 2 prefix iovecs are written just
+//   before the packet, in the same write
+static int subUnsub( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count, uint8_t packetType, int results, const struct mqtt_iovec* prefix, int prefixCount )
 {
-	int status = MQTT_SUCCESS;
-	uint8_t buffer[32];
-	struct mqtt_header header = parseHeader(tag);
+	uint8_t* pCursor;
+	uint8_t buffer[ 8 ] = { 0 };
+	uint8_t lengths[ MQTT_MAX_FILTERS_PER_PACKET ][ 2 ];
+	struct mqtt_iovec iov[ 2 + 1 + 3 * MQTT_MAX_FILTERS_PER_PACKET ];
+	int32_t remainingLength = ( MQTT_VERSION_5 ) ? 3 : 2;
+	int iovCount = prefixCount + 1, status, i;
+	uint8_t ack = ( packetType == MQTT_PACKET_TYPE_SUBSCRIBE ) ? MQTT_PACKET_TYPE_SUBACK : MQTT_PACKET_TYPE_UNSUBACK;
+	uint16_t packetId, topicFilterlen;
 
-	// Here we decide which packets to pass up for processing and which to just swallow 
-	if ( ( header.type == MQTT_PACKET_TYPE_UNSUBACK ) )
+	if ( ( count == 0 ) || ( count > MQTT_MAX_FILTERS_PER_PACKET ) )
+	{
+		return MQTT_ERROR;
+	}
+
+	for ( i = 0; i < count; i++ )
 	{
-		// Just swallow the packet
-		if ( mqtt_read( tag, buffer, header.remainingLength ) != header.remainingLength )
+		topicFilterlen = ( uint16_t )strlen( subscriptions[ i ].topicFilter );
+		lengths[ i ][ 0 ] = 0xFF & ( topicFilterlen >> 8 );
+		lengths[ i ][ 1 ] = 0xFF & topicFilterlen;
+		iov[ iovCount ].base = lengths[ i ];
+		iov[ iovCount++ ].len = 2;
+		iov[ iovCount ].base = ( uint8_t* )subscriptions[ i ].topicFilter;
+		iov[ iovCount++ ].len = topicFilterlen;
+		remainingLength += 2 + topicFilterlen;
+
+		// Only SUBSCRIBE carries a Requested QoS byte after each Topic Filter
+		if ( packetType == MQTT_PACKET_TYPE_SUBSCRIBE )
 		{
-			status = MQTT_ERROR;
+			if ( subscriptions[ i ].qos > 2 )
+			{
+				return MQTT_ERROR;
+			}
+			iov[ iovCount ].base = &subscriptions[ i ].qos;
+			iov[ iovCount++ ].len = 1;
+			remainingLength++;
 		}
 	}
-	else if ( (header.type == MQTT_PACKET_TYPE_PINGRESP) ||
-		      (header.type == MQTT_PACKET_TYPE_SUBACK) ||
-		      (header.type == MQTT_PACKET_TYPE_PUBLISH) )
+
+	packetId = allocPacketId( tag, ack );
+	if ( packetId == 0 )
 	{
-		status = mqtt_processPacket( tag, &header );
+		return MQTT_BUSY;
 	}
-	else 
+
+	if ( results )
 	{
-		status = MQTT_ERROR;
+		int slot = findInflight( tag, packetId, ack );
+
+		tag->inflight[ slot ].subscriptions = subscriptions;
+		tag->inflight[ slot ].subscriptionCount = count;
+		for ( i = 0; i < count; i++ )
+		{
+			subscriptions[ i ].returnCode = MQTT_SUBSCRIPTION_PENDING;
+		}
+	}
+
+	buffer[0] = packetType;
+
+	pCursor = mqtt_encodeRemainingLength( &buffer[ 1 ], remainingLength );
+
+	*(pCursor++) = 0xFF & ( packetId >> 8 );
+	*(pCursor++) = 0xFF & packetId;
+
+#if MQTT_VERSION_5
+	// No properties
+	*(pCursor++) = 0;
+#endif
+
+	for ( i = 0; i < prefixCount; i++ )
+	{
+		iov[ i ] = prefix[ i ];
+	}
+	iov[ prefixCount ].base = buffer;
+	iov[ prefixCount ].len = ( int32_t )( pCursor - buffer );
+
+	status = sendPacket( tag, iov, iovCount );
+	if ( status != MQTT_SUCCESS )
+	{
+		releasePacketId( tag, packetId, ack );
 	}
 	return status;
 }
 
-// Encode the length according to MQTT variable length spec and return the pointer after encoding
-static uint8_t* encodeRemainingLength( uint8_t* pDestination, int32_t length )
+
+int mqtt_subscribe(struct mqtt_context* tag, char* topicFilter)
 {
-	uint8_t lengthByte = 0, * pLengthEnd = pDestination;
+	struct mqtt_subscription subscription = { topicFilter, 0, 0 };
 
-	do
-	{
-		lengthByte = length % 128;
-		length = length / 128;
+	return subUnsub( tag, &subscription, 1, MQTT_PACKET_TYPE_SUBSCRIBE, 0, NULL, 0 );
+}
 
-		/* Set the high bit of this byte if there is more data. */
-		*( pLengthEnd++ ) = ( length > 0 ) ? lengthByte | 0x80 : lengthByte;
-	} while ( length > 0 );
+int mqtt_unSubscribe(struct mqtt_context* tag, char* topicFilter)
+{
+	struct mqtt_subscription subscription = { topicFilter, 0, 0 };
 
-	return pLengthEnd;
+	return subUnsub( tag, &subscription, 1, MQTT_PACKET_TYPE_UNSUBSCRIBE, 0, NULL, 0 );
 }
 
-// This function will parse an MQTT fixed header to the end of RemainingLength
-struct mqtt_header parseHeader( struct mqtt_context* tag )
+int mqtt_subscribe_many( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count )
 {
-	char status = MQTT_SUCCESS, multiplier = 1;
-	struct mqtt_header retVal = { 0 };
+	return subUnsub( tag, subscriptions, count, MQTT_PACKET_TYPE_SUBSCRIBE, 1, NULL, 0 );
+}
 
-	if ( 1 == mqtt_read( tag, &retVal.type, 1 ) )
-	{
-		uint8_t value;
-		do {
-			if ( 1 != mqtt_read( tag, &value, 1 ) ) 
-			{ 
-				status = MQTT_ERROR;
-				break;
-			}
-			else 
-			{
-				retVal.remainingLength  += ( value & 0x7F ) * multiplier;
-				multiplier *= 128;
-			}
-		} while ( ( value & 0x80 ) && ( multiplier < 2097152 ) );
-	}
-	else 
+int mqtt_unsubscribe_many( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count )
+{
+	return subUnsub( tag, subscriptions, count, MQTT_PACKET_TYPE_UNSUBSCRIBE, 1, NULL, 0 );
+}
+
+// Check the input buffer for the next MQTT packet and process it
+int mqtt_pollInput( struct mqtt_context* tag )
+{
+	struct mqtt_header header;
+	int status = parseHeader( tag, &header );
+
+	// Nothing arrived is not an error of the stream, and a malformed header was counted already
+	if ( status != MQTT_SUCCESS )
 	{
-		status = MQTT_ERROR;
+		return status;
 	}
+	return processPacket( tag, &header );
+}
 
-	if ( status == MQTT_ERROR ) {
-		retVal.type = 0;
-		retVal.remainingLength = 0;
+int mqtt_feed( struct mqtt_context* tag, const uint8_t* data, int32_t len )
+{
+	int status = MQTT_SUCCESS;
+	int32_t chunk, used;
+
+	while ( len > 0 )
+	{
+		switch ( tag->decodeState )
+		{
+		case DECODE_TYPE:
+			tag->decodeType = *( data++ );
+			len--;
+			tag->decodeLength = 0;
+			tag->decodeShift = 0;
+			tag->decodeCount = 0;
+			tag->decodeState = DECODE_LENGTH;
+			break;
+
+		case DECODE_LENGTH:
+			// Usually the whole Remaining Length is in this chunk and is decoded in one go, otherwise
+			//   it is put together a byte at a time
+			used = ( tag->decodeShift == 0 ) ? mqtt_decodeRemainingLength( data, len, &tag->decodeLength ) : 0;
+			if ( used == 0 )
+			{
+				used = mqtt_decodeRemainingLengthByte( &tag->decodeLength, &tag->decodeShift, *data );
+				data++;
+				len--;
+			}
+			else if ( used > 0 )
+			{
+				data += used;
+				len -= used;
+			}
+
+			if ( used < 0 )
+			{
+				// The Remaining Length is at most 4 bytes, we cannot find the next packet after this
+				countEvent( tag, &tag->stats.parseErrors, 1 );
+				tag->decodeState = DECODE_TYPE;
+				return MQTT_ERROR;
+			}
+			if ( used == 0 )
+			{
+				// Another byte of it follows
+				break;
+			}
+			countIn( tag, tag->decodeType, tag->decodeLength );
+
+			if ( tag->decodeLength == 0 )
+			{
+				tag->decodeState = DECODE_TYPE;
+				if ( feedPacket( tag, data ) != MQTT_SUCCESS )
+				{
+					status = MQTT_ERROR;
+				}
+			}
+			else
+			{
+				tag->decodeState = ( tag->decodeLength <= MQTT_INPUT_BUFFER_SIZE ) ? DECODE_BODY :
+								   ( ( tag->decodeType & 0xF0 ) == MQTT_PACKET_TYPE_PUBLISH ) ? DECODE_HEADER : DECODE_SKIP;
+			}
+			break;
+
+		case DECODE_HEADER:
+			// The whole packet is in this chunk after all, process it where it is
+			if ( ( tag->decodeCount == 0 ) && ( len >= tag->decodeLength ) )
+			{
+				tag->decodeState = DECODE_BODY;
+				break;
+			}
+
+			// Gather the variable header in the input buffer until it is complete
+			chunk = publishHeaderLength( tag->decodeType, tag->inputBuffer, tag->decodeCount );
+			if ( chunk == 0 )
+			{
+				chunk = tag->decodeCount + 1;
+			}
+			if ( ( chunk < 0 ) || ( chunk >= MQTT_INPUT_BUFFER_SIZE ) )
+			{
+				// Malformed, or the topic leaves no room for the payload
+				tag->decodeState = DECODE_SKIP;
+				break;
+			}
+			if ( chunk == tag->decodeCount )
+			{
+				if ( beginChunks( tag, tag->decodeType, tag->decodeCount, tag->decodeLength ) != MQTT_SUCCESS )
+				{
+					tag->decodeState = DECODE_SKIP;
+					break;
+				}
+				tag->decodeState = DECODE_CHUNKS;
+				break;
+			}
+
+			chunk -= tag->decodeCount;
+			if ( chunk > len )
+			{
+				chunk = len;
+			}
+			memcpy( &tag->inputBuffer[ tag->decodeCount ], data, chunk );
+			data += chunk;
+			len -= chunk;
+			tag->decodeCount += chunk;
+			break;
+
+		case DECODE_CHUNKS:
+			// Pass the payload up straight from the data fed in
+			chunk = tag->decodeLength - tag->decodeCount;
+			if ( chunk > len )
+			{
+				chunk = len;
+			}
+			if ( deliverChunk( tag, ( uint8_t* )data, chunk ) != MQTT_SUCCESS )
+			{
+				status = MQTT_ERROR;
+			}
+			data += chunk;
+			len -= chunk;
+			tag->decodeCount += chunk;
+
+			if ( tag->decodeCount == tag->decodeLength )
+			{
+				tag->decodeState = DECODE_TYPE;
+			}
+			break;
+
+		case DECODE_BODY:
+		case DECODE_SKIP:
+			// The whole body is in this chunk, process it where it is
+			if ( ( tag->decodeCount == 0 ) && ( len >= tag->decodeLength ) )
+			{
+				tag->decodeState = DECODE_TYPE;
+				if ( feedPacket( tag, data ) != MQTT_SUCCESS )
+				{
+					status = MQTT_ERROR;
+				}
+				data += tag->decodeLength;
+				len -= tag->decodeLength;
+				break;
+			}
+
+			chunk = tag->decodeLength - tag->decodeCount;
+			if ( chunk > len )
+			{
+				chunk = len;
+			}
+			if ( tag->decodeState == DECODE_BODY )
+			{
+				memcpy( &tag->inputBuffer[ tag->decodeCount ], data, chunk );
+			}
+			data += chunk;
+			len -= chunk;
+			tag->decodeCount += chunk;
+
+			if ( tag->decodeCount == tag->decodeLength )
+			{
+				if ( tag->decodeState == DECODE_SKIP )
+				{
+					countEvent( tag, &tag->stats.parseErrors, 1 );
+					status = MQTT_ERROR;
+				}
+				else if ( feedPacket( tag, tag->inputBuffer ) != MQTT_SUCCESS )
+				{
+					status = MQTT_ERROR;
+				}
+				tag->decodeState = DECODE_TYPE;
+			}
+			break;
+		}
+	}
+
+	return status;
+}
+
+// Process a packet decoded by mqtt_feed. The packet processors read the body through the feed
+//   view, so whatever they leave unread is dropped with it
+static int feedPacket( struct mqtt_context* tag, const uint8_t* pBody )
+{
+	struct mqtt_header header = { tag->decodeType, tag->decodeLength };
+	int status;
+
+	tag->feedData = pBody;
+	tag->feedLength = tag->decodeLength;
+	status = processPacket( tag, &header );
+	tag->feedData = NULL;
+	tag->feedLength = 0;
+
+	return status;
+}
+
+// Hand one received packet to the right processor
+static int processPacket( struct mqtt_context* tag, struct mqtt_header* header )
+{
+	int status = MQTT_SUCCESS;
+
+	// Here we decide which packets to pass up for processing and which to just swallow 
+	if ( ( header->type == MQTT_PACKET_TYPE_PUBACK ) ||
+		 ( header->type == MQTT_PACKET_TYPE_PUBREC ) ||
+		 ( header->type == MQTT_PACKET_TYPE_PUBREL ) ||
+		 ( header->type == MQTT_PACKET_TYPE_PUBCOMP ) )
+	{
+		// Move the QoS handshake along and swallow the packet
+		status = processAck( tag, header );
+	}
+	else if ( ( header->type & 0xF0 ) == MQTT_PACKET_TYPE_PUBLISH )
+	{
+		status = processPublish( tag, header );
+	}
+	else if ( ( header->type == MQTT_PACKET_TYPE_SUBACK ) ||
+			  ( header->type == MQTT_PACKET_TYPE_UNSUBACK ) )
+	{
+		status = processSubAck( tag, header );
+	}
+	else if ( header->type == MQTT_PACKET_TYPE_CONNACK )
+	{
+		// Only expected after mqtt_connect_pipelined, mqtt_Connect waits for it itself
+		status = processConnAck( tag, header );
+	}
+	else if ( header->type == MQTT_PACKET_TYPE_PINGRESP )
+	{
+		if ( tag->pingOutstanding )
+		{
+			recordTime( tag, &tag->stats.pingRoundTrip, mqtt_getTime( tag ) - tag->pingSendTime );
+		}
+		tag->pingOutstanding = 0;
+		status = mqtt_processPacket( tag, header );
+	}
+	else 
+	{
+		countEvent( tag, &tag->stats.parseErrors, 1 );
+		status = MQTT_ERROR;
+	}
+	return status;
+}
+
+// Decode a PUBLISH in place and pass it up. The message is looked at where it was received,
+//   in the input buffer or in the transport's receive buffer, and released once the application is done
+static int processPublish( struct mqtt_context* tag, struct mqtt_header* header )
+{
+	struct mqtt_message msg = { 0 };
+	int32_t offset;
+	int status = MQTT_ERROR, isNew = -1;
+	uint8_t qos = 0;
+	uint8_t* pBody = peekInput( tag, header->remainingLength );
+
+	if ( pBody == NULL )
+	{
+		if ( ( header->remainingLength > MQTT_INPUT_BUFFER_SIZE ) && ( tag->feedData == NULL ) )
+		{
+			// Too large to look at in one piece, pass it up in pieces
+			return processLargePublish( tag, header );
+		}
+
+		// Drop it to stay in step with the stream
+		countEvent( tag, &tag->stats.parseErrors, 1 );
+		skipInput( tag, header->remainingLength );
+		return MQTT_ERROR;
+	}
+
+	msg.flags = header->type & 0x0F;
+	offset = decodePublishHeader( tag, &msg, pBody, header->remainingLength );
+
+	// Only pass it up if the topic does not run past the end of the packet
+	if ( offset <= header->remainingLength )
+	{
+		msg.pData = &pBody[ offset ];
+		msg.len = header->remainingLength - offset;
+		msg.total = msg.len;
+
+		// A QoS 2 message is passed up only the first time, until the server releases its Packet Identifier
+		qos = ( msg.flags >> 1 ) & 0x03;
+		isNew = ( qos == 2 ) ? addReceivedId( tag, msg.packetId ) : 1;
+
+		if ( isNew > 0 )
+		{
+			status = mqtt_processPublish( tag, &msg );
+			if ( status != MQTT_SUCCESS )
+			{
+				countEvent( tag, &tag->stats.unroutedPublishes, 1 );
+				// Not taken, so the copy the server sends again must be passed up
+				if ( qos == 2 )
+				{
+					removeReceivedId( tag, msg.packetId );
+				}
+			}
+		}
+		else
+		{
+			status = ( isNew == 0 ) ? MQTT_SUCCESS : MQTT_ERROR;
+		}
+	}
+	else
+	{
+		countEvent( tag, &tag->stats.parseErrors, 1 );
+	}
+
+	consumeInput( tag, header->remainingLength );
+
+	// Acknowledge once the message is out of the receive buffer. A message the application did not
+	//   take, or a QoS 2 message we had no room to remember, is left unacknowledged so the server
+	//   sends it again
+	if ( ( qos > 0 ) && ( status == MQTT_SUCCESS ) )
+	{
+		sendAck( tag, ( qos == 1 ) ? MQTT_PACKET_TYPE_PUBACK : MQTT_PACKET_TYPE_PUBREC, msg.packetId );
+	}
+	return status;
+}
+
+// Pass up a PUBLISH too large for the input buffer in pieces. Its variable header is kept at the front
+//   of the input buffer, the payload is read into the room behind it one piece at a time
+static int processLargePublish( struct mqtt_context* tag, struct mqtt_header* header )
+{
+	int32_t headerLength, wanted, buffered, remaining, chunk, received;
+	int status = MQTT_SUCCESS;
+
+	// Read until the whole variable header is buffered
+	do {
+		buffered = tag->inputHead - tag->inputTail;
+		headerLength = publishHeaderLength( header->type, &tag->inputBuffer[ tag->inputTail ], buffered );
+		wanted = ( headerLength == 0 ) ? buffered + 1 : headerLength;
+
+		if ( ( headerLength < 0 ) || ( wanted >= MQTT_INPUT_BUFFER_SIZE ) || ( fillInput( tag, wanted ) != MQTT_SUCCESS ) )
+		{
+			countEvent( tag, &tag->stats.parseErrors, 1 );
+			skipInput( tag, header->remainingLength );
+			return MQTT_ERROR;
+		}
+	} while ( headerLength == 0 );
+
+	// Move it to the front to leave as much room as possible
+	buffered = tag->inputHead - tag->inputTail;
+	memmove( tag->inputBuffer, &tag->inputBuffer[ tag->inputTail ], buffered );
+	tag->inputTail = 0;
+	tag->inputHead = buffered;
+
+	if ( beginChunks( tag, header->type, headerLength, header->remainingLength ) != MQTT_SUCCESS )
+	{
+		countEvent( tag, &tag->stats.parseErrors, 1 );
+		tag->inputTail = headerLength;
+		skipInput( tag, header->remainingLength - headerLength );
+		return MQTT_ERROR;
+	}
+
+	for ( remaining = tag->chunkMessage.total; remaining > 0; remaining -= chunk )
+	{
+		buffered = tag->inputHead - headerLength;
+		if ( buffered == 0 )
+		{
+			chunk = MQTT_INPUT_BUFFER_SIZE - headerLength;
+			received = mqtt_read( tag, &tag->inputBuffer[ headerLength ], ( chunk < remaining ) ? chunk : remaining );
+			if ( received <= 0 )
+			{
+				// The rest of the payload is still on its way, whatever is read next would be taken for
+				//   a packet header. The stream is lost, like after a broken write. The message was not
+				//   acknowledged, so the copy the server sends after a reconnect must be passed up
+				if ( ( tag->chunkNew > 0 ) && ( ( ( tag->chunkMessage.flags >> 1 ) & 0x03 ) == 2 ) )
+				{
+					removeReceivedId( tag, tag->chunkMessage.packetId );
+				}
+				tag->connected = 0;
+				status = MQTT_ERROR;
+				break;
+			}
+			tag->inputHead += received;
+			buffered = received;
+		}
+
+		chunk = ( buffered < remaining ) ? buffered : remaining;
+		if ( deliverChunk( tag, &tag->inputBuffer[ headerLength ], chunk ) != MQTT_SUCCESS )
+		{
+			status = MQTT_ERROR;
+		}
+
+		// Whatever came in behind the piece belongs to the next packet
+		memmove( &tag->inputBuffer[ headerLength ], &tag->inputBuffer[ headerLength + chunk ], buffered - chunk );
+		tag->inputHead -= chunk;
+	}
+
+	tag->inputTail = headerLength;
+	return status;
+}
+
+// Length of the variable header of a PUBLISH, from the first available bytes of its body. Returns 0
+//   if more bytes are needed to tell and -1 if it is malformed
+static int32_t publishHeaderLength( uint8_t type, const uint8_t* pBody, int32_t available )
+{
+	int32_t length = 2;
+
+	if ( available < length )
+	{
+		return 0;
+	}
+	length += ( pBody[ 0 ] << 8 ) + pBody[ 1 ];
+
+	// QoS 1 and 2 messages carry a Packet Identifier after the topic
+	if ( type & 0x06 )
+	{
+		length += 2;
+	}
+
+#if MQTT_VERSION_5
+	{
+		int32_t propertyLength, used;
+
+		used = mqtt_decodeRemainingLength( &pBody[ length ], available - length, &propertyLength );
+		if ( used <= 0 )
+		{
+			return used;
+		}
+		length += used + propertyLength;
+	}
+#endif
+
+	return length;
+}
+
+// Decode the topic, Packet Identifier and properties of a PUBLISH into msg. Returns the offset of
+//   the payload, past length if they run past the end of the body
+static int32_t decodePublishHeader( struct mqtt_context* tag, struct mqtt_message* msg, uint8_t* pBody, int32_t length )
+{
+	int32_t offset = 2;
+
+	if ( length >= offset )
+	{
+		msg->topic = ( char* )&pBody[ 2 ];
+		msg->topicLength = ( pBody[ 0 ] << 8 ) + pBody[ 1 ];
+		offset += msg->topicLength;
+
+		// QoS 1 and 2 messages carry a Packet Identifier after the topic
+		if ( msg->flags & 0x06 )
+		{
+			if ( length >= offset + 2 )
+			{
+				msg->packetId = ( pBody[ offset ] << 8 ) + pBody[ offset + 1 ];
+			}
+			offset += 2;
+		}
+	}
+
+#if MQTT_VERSION_5
+	// The properties come next, the topic may have to be looked up by its alias
+	if ( offset <= length )
+	{
+		offset = resolveTopicAlias( tag, msg, pBody, offset, length );
+	}
+#else
+	( void )tag;
+#endif
+
+	return offset;
+}
+
+// Start passing up a PUBLISH in pieces. Its variable header of headerLength bytes is at the front of
+//   the input buffer and has to stay there until the last piece
+static int beginChunks( struct mqtt_context* tag, uint8_t type, int32_t headerLength, int32_t remainingLength )
+{
+	struct mqtt_message* msg = &tag->chunkMessage;
+
+	memset( msg, 0, sizeof( *msg ) );
+	msg->flags = type & 0x0F;
+	if ( decodePublishHeader( tag, msg, tag->inputBuffer, headerLength ) != headerLength )
+	{
+		return MQTT_ERROR;
+	}
+	msg->total = remainingLength - headerLength;
+
+	// A QoS 2 message is passed up only the first time, as in processPublish
+	tag->chunkNew = ( ( ( msg->flags >> 1 ) & 0x03 ) == 2 ) ? ( int8_t )addReceivedId( tag, msg->packetId ) : 1;
+	tag->chunkFailed = 0;
+	return MQTT_SUCCESS;
+}
+
+// Pass up the next piece of the payload and acknowledge the message after the last one
+static int deliverChunk( struct mqtt_context* tag, uint8_t* pData, int32_t len )
+{
+	struct mqtt_message* msg = &tag->chunkMessage;
+	uint8_t qos = ( msg->flags >> 1 ) & 0x03;
+	int status = MQTT_SUCCESS;
+
+	msg->pData = pData;
+	msg->len = len;
+	if ( ( tag->chunkNew > 0 ) && !tag->chunkFailed )
+	{
+		status = mqtt_processPublish( tag, msg );
+		tag->chunkFailed = ( status != MQTT_SUCCESS );
+		if ( tag->chunkFailed )
+		{
+			countEvent( tag, &tag->stats.unroutedPublishes, 1 );
+		}
+	}
+	msg->offset += len;
+
+	// A message the application did not take is left unacknowledged, as in processPublish, so the
+	//   server sends it again and it is passed up from its first piece
+	if ( msg->offset == msg->total )
+	{
+		if ( ( tag->chunkNew < 0 ) || tag->chunkFailed )
+		{
+			status = MQTT_ERROR;
+		}
+		if ( tag->chunkFailed && ( qos == 2 ) )
+		{
+			removeReceivedId( tag, msg->packetId );
+		}
+		if ( ( status == MQTT_SUCCESS ) && ( qos > 0 ) )
+		{
+			sendAck( tag, ( qos == 1 ) ? MQTT_PACKET_TYPE_PUBACK : MQTT_PACKET_TYPE_PUBREC, msg->packetId );
+		}
+	}
+	return status;
+}
+
+// Handle the packets that acknowledge QoS 1 and 2 publishes and (un)subscribe requests
+static int processAck( struct mqtt_context* tag, struct mqtt_header* header )
+{
+#if MQTT_VERSION_5
+	// A Reason Code and properties may follow the Packet Identifier
+	uint8_t* pBody = ( header->remainingLength >= 2 ) ? peekInput( tag, ( header->remainingLength > 2 ) ? 3 : 2 ) : NULL;
+	uint8_t reasonCode = ( ( pBody != NULL ) && ( header->remainingLength > 2 ) ) ? pBody[ 2 ] : 0;
+#else
+	uint8_t* pBody = ( header->remainingLength == 2 ) ? peekInput( tag, 2 ) : NULL;
+#endif
+	uint16_t packetId;
+	int slot;
+
+	if ( pBody == NULL )
+	{
+		countEvent( tag, &tag->stats.parseErrors, 1 );
+		skipInput( tag, header->remainingLength );
+		return MQTT_ERROR;
+	}
+
+	packetId = ( pBody[ 0 ] << 8 ) + pBody[ 1 ];
+	consumeInput( tag, 2 );
+
+#if MQTT_VERSION_5
+	skipInput( tag, header->remainingLength - 2 );
+
+	// A PUBREC that refuses the message ends the exchange, there is nothing to release
+	if ( ( header->type == MQTT_PACKET_TYPE_PUBREC ) && ( reasonCode >= 0x80 ) )
+	{
+		releasePacketId( tag, packetId, MQTT_PACKET_TYPE_PUBREC );
+		return MQTT_SUCCESS;
+	}
+#endif
+
+	switch ( header->type )
+	{
+	case MQTT_PACKET_TYPE_PUBREC:
+		// Our QoS 2 message arrived, keep the slot until the server confirms the release
+		slot = findInflight( tag, packetId, MQTT_PACKET_TYPE_PUBREC );
+		if ( slot >= 0 )
+		{
+			tag->inflight[ slot ].ack = MQTT_PACKET_TYPE_PUBCOMP;
+
+			// Only the PUBREL is left to send, the message itself need not be kept any longer
+			if ( tag->sessionStore != NULL )
+			{
+				tag->sessionStore->save( tag->sessionStore, packetId, MQTT_PACKET_TYPE_PUBCOMP, NULL, 0 );
+			}
+		}
+		return sendAck( tag, MQTT_PACKET_TYPE_PUBREL, packetId );
+
+	case MQTT_PACKET_TYPE_PUBREL:
+		// The server is done with a QoS 2 message it sent us, so the next one with this ID is new
+		removeReceivedId( tag, packetId );
+		return sendAck( tag, MQTT_PACKET_TYPE_PUBCOMP, packetId );
+
+	default:
+#if MQTT_STATS
+		// PUBACK or PUBCOMP, the publish is done
+		slot = findInflight( tag, packetId, header->type );
+		if ( slot >= 0 )
+		{
+			recordTime( tag, &tag->stats.publishAck, mqtt_getTime( tag ) - tag->inflight[ slot ].sendTime );
+		}
+#endif
+		releasePacketId( tag, packetId, header->type );
+		return MQTT_SUCCESS;
+	}
+}
+
+// Handle SUBACK and UNSUBACK. For multi-filter requests the return codes are stored in the request's
+//   filters and the packet is swallowed, for single ones it is passed up as before
+static int processSubAck( struct mqtt_context* tag, struct mqtt_header* header )
+{
+	uint8_t* pBody = ( header->remainingLength >= 2 ) ? peekInput( tag, 2 ) : NULL;
+	struct mqtt_inflight* pInflight;
+	uint16_t packetId, i;
+	int slot;
+
+	if ( pBody == NULL )
+	{
+		skipInput( tag, header->remainingLength );
+		return MQTT_ERROR;
+	}
+
+	packetId = ( pBody[ 0 ] << 8 ) + pBody[ 1 ];
+	slot = findInflight( tag, packetId, header->type );
+	if ( ( slot < 0 ) || ( tag->inflight[ slot ].subscriptions == NULL ) )
+	{
+		releasePacketId( tag, packetId, header->type );
+		if ( header->type == MQTT_PACKET_TYPE_UNSUBACK )
+		{
+			skipInput( tag, header->remainingLength );
+			return MQTT_SUCCESS;
+		}
+		return mqtt_processPacket( tag, header );
+	}
+
+	pInflight = &tag->inflight[ slot ];
+	tag->inflightUsed &= ~( 1UL << slot );
+
+#if MQTT_VERSION_5
+	// Both SUBACK and UNSUBACK have properties followed by one Reason Code per filter
+	pBody = peekInput( tag, header->remainingLength );
+	if ( pBody != NULL )
+	{
+		int32_t propertiesLength, used = decodeVarInt( &pBody[ 2 ], header->remainingLength - 2, &propertiesLength );
+
+		if ( ( used < 0 ) || ( header->remainingLength != 2 + used + propertiesLength + pInflight->subscriptionCount ) )
+		{
+			pBody = NULL;
+		}
+		else
+		{
+			// Move the codes to where MQTT 3.1.1 has them
+			pBody += used + propertiesLength;
+		}
+	}
+#else
+	if ( header->type == MQTT_PACKET_TYPE_UNSUBACK )
+	{
+		skipInput( tag, header->remainingLength );
+		for ( i = 0; i < pInflight->subscriptionCount; i++ )
+		{
+			pInflight->subscriptions[ i ].returnCode = 0;
+		}
+		return MQTT_SUCCESS;
+	}
+
+	// One return code per filter, in the order they were requested
+	pBody = ( header->remainingLength == 2 + pInflight->subscriptionCount ) ? peekInput( tag, header->remainingLength ) : NULL;
+#endif
+	if ( pBody == NULL )
+	{
+		skipInput( tag, header->remainingLength );
+		for ( i = 0; i < pInflight->subscriptionCount; i++ )
+		{
+			pInflight->subscriptions[ i ].returnCode = MQTT_SUBACK_FAILURE;
+		}
+		return MQTT_ERROR;
+	}
+
+	for ( i = 0; i < pInflight->subscriptionCount; i++ )
+	{
+		pInflight->subscriptions[ i ].returnCode = pBody[ 2 + i ];
+	}
+	consumeInput( tag, header->remainingLength );
+
+	return MQTT_SUCCESS;
+}
+
+// Send PUBACK, PUBREC, PUBREL or PUBCOMP for packetId
+static int sendAck( struct mqtt_context* tag, uint8_t packetType, uint16_t packetId )
+{
+	uint8_t buffer[ 4 ] = { packetType, 2, packetId >> 8, packetId & 0xFF };
+	struct mqtt_iovec iov = { buffer, 4 };
+
+	return sendControl( tag, &iov, 1 );
+}
+
+// Take a free in-flight slot and return a Packet Identifier that maps back to it, or 0 if all
+//   slots are taken. Identifiers move on by a full table width on every call, so a late
+//   acknowledgement for an earlier user of the slot will not match
+static uint16_t allocPacketId( struct mqtt_context* tag, uint8_t ack )
+{
+	uint32_t used = tag->inflightUsed | tag->inflightReserved;
+	uint32_t freeBit = ~used & ( used + 1 );
+	uint16_t slot = 0;
+
+	if ( ( freeBit & INFLIGHT_SLOTS_MASK ) == 0 )
+	{
+		return 0;
+	}
+
+	while ( ( freeBit >> slot ) != 1 )
+	{
+		slot++;
+	}
+
+	// Packet Identifier 0 is not allowed, so base + slot must stay below 0xFFFF
+	do {
+		tag->packetIdBase += MQTT_MAX_INFLIGHT;
+	} while ( ( uint16_t )( tag->packetIdBase + slot ) == 0xFFFF );
+
+	tag->inflightUsed |= freeBit;
+	tag->inflight[ slot ].packetId = tag->packetIdBase + slot + 1;
+	tag->inflight[ slot ].ack = ack;
+	tag->inflight[ slot ].subscriptions = NULL;
+#if MQTT_STATS
+	tag->inflight[ slot ].sendTime = mqtt_getTime( tag );
+#endif
+
+	return tag->inflight[ slot ].packetId;
+}
+
+// Return the in-flight slot of packetId if it is waiting for this type of acknowledgement, else -1
+static int findInflight( struct mqtt_context* tag, uint16_t packetId, uint8_t ack )
+{
+	uint16_t slot = ( packetId - 1 ) & ( MQTT_MAX_INFLIGHT - 1 );
+
+	if ( ( tag->inflightUsed & ( 1UL << slot ) ) &&
+		 ( tag->inflight[ slot ].packetId == packetId ) &&
+		 ( tag->inflight[ slot ].ack == ack ) )
+	{
+		return slot;
+	}
+	return -1;
+}
+
+// Free the in-flight slot of packetId if it was waiting for this type of acknowledgement
+static void releasePacketId( struct mqtt_context* tag, uint16_t packetId, uint8_t ack )
+{
+	int slot = findInflight( tag, packetId, ack );
+
+	if ( slot >= 0 )
+	{
+		tag->inflightUsed &= ~( 1UL << slot );
+
+		if ( ( tag->sessionStore != NULL ) && ( ack != MQTT_PACKET_TYPE_SUBACK ) && ( ack != MQTT_PACKET_TYPE_UNSUBACK ) )
+		{
+			tag->sessionStore->release( tag->sessionStore, packetId );
+		}
+	}
+}
+
+// Send a message from the session store again, in the in-flight slot its Packet Identifier had. If
+//   the server kept no session a QoS 2 message that was already received is done with, the rest go
+//   out as new messages
+static int replayMessage( struct mqtt_context* tag, uint16_t packetId, uint8_t ack, const uint8_t* pPacket, int32_t len )
+{
+	uint16_t slot = ( packetId - 1 ) & ( MQTT_MAX_INFLIGHT - 1 );
+	uint8_t fixedHeader;
+
+	if ( ( ack == MQTT_PACKET_TYPE_PUBCOMP ) && !tag->sessionPresent )
+	{
+		tag->sessionStore->release( tag->sessionStore, packetId );
+		return MQTT_SUCCESS;
+	}
+
+	// A slot that is taken means the store was written with a different MQTT_MAX_INFLIGHT
+	if ( ( packetId == 0 ) || ( tag->inflightUsed & ( 1UL << slot ) ) || ( ( ack != MQTT_PACKET_TYPE_PUBCOMP ) && ( len < 2 ) ) )
+	{
+		return MQTT_ERROR;
+	}
+
+	tag->inflightUsed |= 1UL << slot;
+	tag->inflight[ slot ].packetId = packetId;
+	tag->inflight[ slot ].ack = ack;
+	tag->inflight[ slot ].subscriptions = NULL;
+#if MQTT_STATS
+	tag->inflight[ slot ].sendTime = mqtt_getTime( tag );
+#endif
+
+	if ( ack == MQTT_PACKET_TYPE_PUBCOMP )
+	{
+		return sendAck( tag, MQTT_PACKET_TYPE_PUBREL, packetId );
+	}
+
+	// The DUP flag tells a server that kept the session it may have seen this one
+	fixedHeader = pPacket[ 0 ] | ( tag->sessionPresent ? 0x08 : 0 );
+	struct mqtt_iovec iov[ 2 ] = { { &fixedHeader, 1 }, { pPacket + 1, len - 1 } };
+
+	return sendPacket( tag, iov, 2 );
+}
+
+// Keep the in-flight slot of a stored message free until it is replayed
+static int reserveSlot( struct mqtt_context* tag, uint16_t packetId, uint8_t ack, const uint8_t* pPacket, int32_t len )
+{
+	( void )ack;
+	( void )pPacket;
+	( void )len;
+
+	if ( packetId != 0 )
+	{
+		tag->inflightReserved |= 1UL << ( ( packetId - 1 ) & ( MQTT_MAX_INFLIGHT - 1 ) );
+	}
+	return MQTT_SUCCESS;
+}
+
+// Remember the Packet Identifier of a received QoS 2 message. Returns 1 if it was new, 0 if it
+//   is a duplicate and -1 if there is no room to remember it
+static int addReceivedId( struct mqtt_context* tag, uint16_t packetId )
+{
+	uint16_t i = ( packetId ^ ( packetId >> 8 ) ) & RECEIVED_IDS_MASK;
+
+	if ( packetId == 0 )
+	{
+		return -1;
+	}
+
+	while ( tag->receivedIds[ i ] != 0 )
+	{
+		if ( tag->receivedIds[ i ] == packetId )
+		{
+			return 0;
+		}
+		i = ( i + 1 ) & RECEIVED_IDS_MASK;
+	}
+
+	if ( tag->receivedCount == MQTT_MAX_RECEIVED_QOS2 )
+	{
+		return -1;
+	}
+
+	tag->receivedIds[ i ] = packetId;
+	tag->receivedCount++;
+	return 1;
+}
+
+// Forget a received QoS 2 Packet Identifier. Entries after it are moved back so that every
+//   entry stays reachable from its home position without tombstones
+static void removeReceivedId( struct mqtt_context* tag, uint16_t packetId )
+{
+	uint16_t i = ( packetId ^ ( packetId >> 8 ) ) & RECEIVED_IDS_MASK;
+	uint16_t j, home;
+
+	while ( tag->receivedIds[ i ] != packetId )
+	{
+		if ( tag->receivedIds[ i ] == 0 )
+		{
+			return;
+		}
+		i = ( i + 1 ) & RECEIVED_IDS_MASK;
+	}
+
+	j = i;
+	for ( ;; )
+	{
+		tag->receivedIds[ i ] = 0;
+		do {
+			j = ( j + 1 ) & RECEIVED_IDS_MASK;
+			if ( tag->receivedIds[ j ] == 0 )
+			{
+				tag->receivedCount--;
+				return;
+			}
+			home = ( tag->receivedIds[ j ] ^ ( tag->receivedIds[ j ] >> 8 ) ) & RECEIVED_IDS_MASK;
+			// Keep looking while the entry at j sits between its home and the hole at i
+		} while ( ( ( j - home ) & RECEIVED_IDS_MASK ) < ( ( j - i ) & RECEIVED_IDS_MASK ) );
+		tag->receivedIds[ i ] = tag->receivedIds[ j ];
+		i = j;
+	}
+}
+
+int mqtt_inflightCount( struct mqtt_context* tag )
+{
+	uint32_t used = tag->inflightUsed;
+	int count = 0;
+
+	while ( used )
+	{
+		used &= used - 1;
+		count++;
+	}
+	return count;
+}
+
+// Hand all fragments of a packet to the transport at once. Succeeds only if every byte was written
+static int sendPacket( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count )
+{
+	int32_t total = 0;
+
+	for ( int i = 0; i < count; i++ )
+	{
+		total += iov[ i ].len;
+	}
+
+	// Nothing may come between the pieces of a streamed publish, small packets wait for its end. They
+	//   are counted once mqtt_publish_end writes them
+	if ( tag->streamOpen )
+	{
+		if ( total > MQTT_STREAM_DEFER_SIZE - tag->streamDeferredLength )
+		{
+			return MQTT_ERROR;
+		}
+		for ( int i = 0; i < count; i++ )
+		{
+			memcpy( &tag->streamDeferred[ tag->streamDeferredLength ], iov[ i ].base, iov[ i ].len );
+			tag->streamDeferredLength += iov[ i ].len;
+		}
+		return MQTT_SUCCESS;
+	}
+
+#if MQTT_TX_BUFFER_SIZE > 0
+	// Buffered publishes were made before this packet and have to arrive before it
+	if ( flushBuffer( tag ) != MQTT_SUCCESS )
+	{
+		return MQTT_ERROR;
+	}
+#endif
+
+	return writePacket( tag, iov, count, total );
+}
+
+// Send a PINGREQ or an acknowledgement. Nothing in the transmit buffer depends on them, so with
+//   MQTT_TX_PRIORITY they go ahead of it
+static int sendControl( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count )
+{
+#if MQTT_TX_PRIORITY
+	int32_t total = 0;
+
+	if ( !tag->streamOpen )
+	{
+		for ( int i = 0; i < count; i++ )
+		{
+			total += iov[ i ].len;
+		}
+		return writePacket( tag, iov, count, total );
+	}
+#endif
+	return sendPacket( tag, iov, count );
+}
+
+// Hand a packet of total bytes to the transport
+static int writePacket( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count, int32_t total )
+{
+	int written = mqtt_writev( tag, iov, count );
+
+	if ( written != total )
+	{
+		// A transport that took nothing may just be out of room, anything else breaks the stream
+		if ( written != 0 )
+		{
+			tag->connected = 0;
+		}
+		return MQTT_ERROR;
+	}
+
+	tag->lastSendTime = mqtt_getTime( tag );
+	countOut( tag, iov, count );
+	return MQTT_SUCCESS;
+}
+
+#if MQTT_TX_BUFFER_SIZE > 0
+// Add a packet to the transmit buffer. The buffer is written first when the packet does not fit or
+//   the oldest publish in it is due. Packets larger than the whole buffer are written directly
+static int queuePacket( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count )
+{
+	uint32_t now = mqtt_getTime( tag );
+	int32_t total = 0;
+	int status, i;
+
+	for ( i = 0; i < count; i++ )
+	{
+		total += iov[ i ].len;
+	}
+
+	if ( ( tag->txLength > 0 ) && ( ( total > MQTT_TX_BUFFER_SIZE - tag->txLength ) || ( ( int32_t )( now - tag->txDeadline ) >= 0 ) ) )
+	{
+		// A flush that has to wait only matters if there is no room left
+		status = mqtt_flush( tag );
+		if ( ( status == MQTT_ERROR ) || ( ( status == MQTT_BUSY ) && ( total > MQTT_TX_BUFFER_SIZE - tag->txLength ) ) )
+		{
+			return status;
+		}
+	}
+
+	if ( total > MQTT_TX_BUFFER_SIZE )
+	{
+#if MQTT_TX_PRIORITY
+		// Too large to buffer, it waits for the transport to catch up all the same
+		if ( mqtt_txQueued( tag ) >= MQTT_TX_HOL_LIMIT )
+		{
+			return MQTT_BUSY;
+		}
+#endif
+		return sendPacket( tag, iov, count );
+	}
+
+	if ( tag->txLength == 0 )
+	{
+		tag->txDeadline = now + MQTT_TX_FLUSH_TIME;
+	}
+	for ( i = 0; i < count; i++ )
+	{
+		memcpy( &tag->txBuffer[ tag->txLength ], iov[ i ].base, iov[ i ].len );
+		tag->txLength += iov[ i ].len;
+	}
+	countOut( tag, iov, count );
+	return MQTT_SUCCESS;
+}
+#endif
+
+// Read the next bytes of the current packet, using up buffered input before going to the network
+int mqtt_receive( struct mqtt_context* tag, uint8_t* ptr, int32_t len )
+{
+	int32_t count = tag->inputHead - tag->inputTail;
+	int32_t received;
+
+	// Anything only peeked at so far is read again from the start
+	tag->viewLength = 0;
+
+	if ( tag->feedData != NULL )
+	{
+		count = ( len < tag->feedLength ) ? len : tag->feedLength;
+		memcpy( ptr, tag->feedData, count );
+		consumeInput( tag, count );
+		return count;
+	}
+
+	if ( count > len )
+	{
+		count = len;
+	}
+
+	memcpy( ptr, &tag->inputBuffer[ tag->inputTail ], count );
+	tag->inputTail += count;
+
+	while ( count < len )
+	{
+		received = mqtt_read( tag, ptr + count, len - count );
+		if ( received <= 0 )
+		{
+			break;
+		}
+		count += received;
+	}
+	return count;
+}
+
+// Make sure at least count unread bytes are in the input buffer. Every read from the network
+//   asks for as much as fits, so a burst of small packets is pulled in with a single read
+static int fillInput( struct mqtt_context* tag, int32_t count )
+{
+	int32_t buffered = tag->inputHead - tag->inputTail;
+	int32_t received;
+
+	if ( count > MQTT_INPUT_BUFFER_SIZE )
+	{
+		return MQTT_ERROR;
+	}
+
+	// Start over at the front whenever everything has been consumed
+	if ( buffered == 0 )
+	{
+		tag->inputTail = 0;
+		tag->inputHead = 0;
+	}
+
+	// Move the unread bytes to the front if there is no room for the rest behind them
+	if ( tag->inputTail + count > MQTT_INPUT_BUFFER_SIZE )
+	{
+		memmove( tag->inputBuffer, &tag->inputBuffer[ tag->inputTail ], buffered );
+		tag->inputTail = 0;
+		tag->inputHead = buffered;
+	}
+
+	while ( tag->inputHead - tag->inputTail < count )
+	{
+		received = mqtt_read( tag, &tag->inputBuffer[ tag->inputHead ], MQTT_INPUT_BUFFER_SIZE - tag->inputHead );
+		if ( received <= 0 )
+		{
+			return MQTT_ERROR;
+		}
+		tag->inputHead += received;
+	}
+	return MQTT_SUCCESS;
+}
+
+// Return a pointer to the next count unread bytes in one piece, or NULL if they could not be had.
+//   The bytes stay unread until consumeInput is called
+static uint8_t* peekInput( struct mqtt_context* tag, int32_t count )
+{
+	// Nothing was consumed since any earlier peek, so this one replaces it
+	tag->viewLength = 0;
+
+	if ( tag->feedData != NULL )
+	{
+		return ( count <= tag->feedLength ) ? ( uint8_t* )tag->feedData : NULL;
+	}
+
+	if ( tag->inputHead - tag->inputTail >= count )
+	{
+		return &tag->inputBuffer[ tag->inputTail ];
+	}
+
+#if MQTT_ZERO_COPY_RECEIVE
+	// Nothing is buffered, so look at the data where the transport keeps it
+	if ( tag->inputHead == tag->inputTail )
+	{
+		uint8_t* pView;
+		int32_t contiguous = mqtt_readView( tag, &pView, count );
+
+		if ( contiguous >= count )
+		{
+			tag->viewLength = count;
+			return pView;
+		}
+		if ( contiguous <= 0 )
+		{
+			return NULL;
+		}
+		// The data wraps around the end of the transport's buffer, fall back to a copy
+	}
+#endif
+
+	if ( fillInput( tag, count ) != MQTT_SUCCESS )
+	{
+		return NULL;
+	}
+	return &tag->inputBuffer[ tag->inputTail ];
+}
+
+// Mark count bytes returned by peekInput as read
+static void consumeInput( struct mqtt_context* tag, int32_t count )
+{
+	if ( tag->feedData != NULL )
+	{
+		tag->feedData += count;
+		tag->feedLength -= count;
+		return;
+	}
+#if MQTT_ZERO_COPY_RECEIVE
+	if ( tag->viewLength > 0 )
+	{
+		mqtt_releaseView( tag, count );
+		tag->viewLength = 0;
+		return;
+	}
+#endif
+	tag->inputTail += count;
+}
+
+// Throw away the next count bytes of input
+static void skipInput( struct mqtt_context* tag, int32_t count )
+{
+	int32_t chunk;
+
+	if ( tag->feedData != NULL )
+	{
+		consumeInput( tag, ( count < tag->feedLength ) ? count : tag->feedLength );
+		return;
+	}
+
+	while ( count > 0 )
+	{
+		chunk = ( count < MQTT_INPUT_BUFFER_SIZE ) ? count : MQTT_INPUT_BUFFER_SIZE;
+		if ( fillInput( tag, chunk ) != MQTT_SUCCESS )
+		{
+			break;
+		}
+		tag->inputTail += chunk;
+		count -= chunk;
+	}
+}
+
+// This function will parse an MQTT fixed header to the end of RemainingLength, straight from the input buffer.
+//   Returns MQTT_BUSY if the header has not arrived completely and MQTT_ERROR if it is malformed
+int parseHeader( struct mqtt_context* tag, struct mqtt_header* header )
+{
+	int32_t headerLength = 1;
+	uint8_t* pHeader;
+	uint8_t shift = 0;
+	int complete;
+
+	// The Remaining Length is at most 4 bytes, each one with the high bit set if another follows
+	header->remainingLength = 0;
+	do {
+		if ( ( pHeader = peekInput( tag, headerLength + 1 ) ) == NULL )
+		{
+			return MQTT_BUSY;
+		}
+		complete = mqtt_decodeRemainingLengthByte( &header->remainingLength, &shift, pHeader[ headerLength++ ] );
+	} while ( complete == 0 );
+
+	if ( complete < 0 )
+	{
+		countEvent( tag, &tag->stats.parseErrors, 1 );
+		return MQTT_ERROR;
+	}
+
+	header->type = pHeader[ 0 ];
+	consumeInput( tag, headerLength );
+	countIn( tag, header->type, header->remainingLength );
+
+	return MQTT_SUCCESS;
+}
+
+#if MQTT_VERSION_5
+// Decode a Variable Byte Integer, the same encoding as the Remaining Length. Returns the number of
+//   bytes it took or -1 if it is malformed or runs past available
+static int32_t decodeVarInt( const uint8_t* pData, int32_t available, int32_t* pValue )
+{
+	int32_t used = mqtt_decodeRemainingLength( pData, available, pValue );
+
+	return ( used > 0 ) ? used : -1;
+}
+
+// Size of the value of property id, or -1 if the property is unknown or runs past available
+static int32_t propertySize( uint8_t id, const uint8_t* pData, int32_t available )
+{
+	int32_t size, value;
+
+	switch ( id )
+	{
+	// Byte
+	case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+		size = 1;
+		break;
+	// Two Byte Integer
+	case 0x13: case 0x21: case 0x22: case 0x23:
+		size = 2;
+		break;
+	// Four Byte Integer
+	case 0x02: case 0x11: case 0x18: case 0x27:
+		size = 4;
+		break;
+	// Variable Byte Integer
+	case 0x0B:
+		return decodeVarInt( pData, available, &value );
+	// UTF-8 String or Binary Data
+	case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+		size = ( available >= 2 ) ? 2 + ( pData[ 0 ] << 8 ) + pData[ 1 ] : -1;
+		break;
+	// UTF-8 String Pair
+	case 0x26:
+		size = ( available >= 2 ) ? 2 + ( pData[ 0 ] << 8 ) + pData[ 1 ] : -1;
+		size = ( ( size >= 0 ) && ( available >= size + 2 ) ) ? size + 2 + ( pData[ size ] << 8 ) + pData[ size + 1 ] : -1;
+		break;
+	default:
+		return -1;
+	}
+
+	return ( size <= available ) ? size : -1;
+}
+
+// Look for a Two Byte Integer property in a property list that starts with its length. Returns the
+//   size of the whole list or -1 if it is malformed
+static int32_t findProperty( const uint8_t* pData, int32_t length, uint8_t id, uint16_t* pValue )
+{
+	int32_t propertiesLength, offset, end, size;
+
+	offset = decodeVarInt( pData, length, &propertiesLength );
+	if ( ( offset < 0 ) || ( offset + propertiesLength > length ) )
+	{
+		return -1;
+	}
+
+	for ( end = offset + propertiesLength; offset < end; offset += size )
+	{
+		size = propertySize( pData[ offset ], &pData[ offset + 1 ], end - offset - 1 );
+		if ( size < 0 )
+		{
+			return -1;
+		}
+		if ( ( pData[ offset ] == id ) && ( size == 2 ) )
+		{
+			*pValue = ( pData[ offset + 1 ] << 8 ) + pData[ offset + 2 ];
+		}
+		offset++;
+	}
+
+	return end;
+}
+
+// Pick the Topic Alias for an outbound publish. A topic that already has one is sent as the alias
+//   alone, so *pTopicLength is set to 0. A new topic takes over the least recently used alias and is
+//   sent in full along with it. Returns the alias - 1, or -1 to send without an alias
+static int assignTopicAlias( struct mqtt_context* tag, const char* topic, uint16_t* pTopicLength )
+{
+	struct mqtt_topicAlias* pAlias;
+	int i, lru = 0;
+
+	if ( ( tag->topicAliasMaximum == 0 ) || ( *pTopicLength > MQTT_TOPIC_ALIAS_LENGTH ) )
+	{
+		return -1;
+	}
+
+	tag->aliasClock++;
+	for ( i = 0; i < tag->topicAliasMaximum; i++ )
+	{
+		pAlias = &tag->outboundAliases[ i ];
+		if ( ( pAlias->topicLength == *pTopicLength ) && ( memcmp( pAlias->topic, topic, *pTopicLength ) == 0 ) )
+		{
+			pAlias->lastUse = tag->aliasClock;
+			*pTopicLength = 0;
+			return i;
+		}
+
+		// Unused aliases have the oldest lastUse of all
+		if ( ( pAlias->topicLength == 0 ) ? ( tag->outboundAliases[ lru ].topicLength != 0 ) :
+			 ( ( tag->outboundAliases[ lru ].topicLength != 0 ) && ( pAlias->lastUse < tag->outboundAliases[ lru ].lastUse ) ) )
+		{
+			lru = i;
+		}
+	}
+
+	pAlias = &tag->outboundAliases[ lru ];
+	memcpy( pAlias->topic, topic, *pTopicLength );
+	pAlias->topicLength = *pTopicLength;
+	pAlias->lastUse = tag->aliasClock;
+	return lru;
+}
+
+// Walk the properties of an inbound PUBLISH that start at offset and apply its Topic Alias. A topic
+//   with an alias is remembered, an empty topic is replaced by the one remembered for its alias.
+//   Returns the offset of the payload, or past length if the message cannot be used
+static int32_t resolveTopicAlias( struct mqtt_context* tag, struct mqtt_message* msg, const uint8_t* pBody, int32_t offset, int32_t length )
+{
+	struct mqtt_topicAlias* pAlias;
+	uint16_t alias = 0;
+	int32_t end = findProperty( &pBody[ offset ], length - offset, MQTT_PROPERTY_TOPIC_ALIAS, &alias );
+
+	if ( ( end < 0 ) || ( alias > MQTT_MAX_INBOUND_TOPIC_ALIASES ) )
+	{
+		return length + 1;
 	}
+	end += offset;
 
-	return retVal;
+	if ( alias == 0 )
+	{
+		return ( msg->topicLength > 0 ) ? end : length + 1;
+	}
+
+	pAlias = &tag->inboundAliases[ alias - 1 ];
+	if ( msg->topicLength > 0 )
+	{
+		// Topics too long to keep leave the alias unset, later uses of it are dropped
+		pAlias->topicLength = ( msg->topicLength <= MQTT_TOPIC_ALIAS_LENGTH ) ? msg->topicLength : 0;
+		memcpy( pAlias->topic, msg->topic, pAlias->topicLength );
+	}
+	else if ( pAlias->topicLength > 0 )
+	{
+		msg->topic = pAlias->topic;
+		msg->topicLength = pAlias->topicLength;
+	}
+	else
+	{
+		return length + 1;
+	}
+
+	return end;
+}
+#endif
+
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+// Add a publish to the offline queue. When it is full the oldest messages are dropped to make room,
+//   or the new one with MQTT_DROP_NEWEST
+static int enqueuePublish( struct mqtt_context* tag, const char* topic, uint16_t topicLength, const uint8_t* pData, int32_t len, uint8_t qos )
+{
+	struct queuedPublish entry = { topicLength, qos, 0, len };
+	int32_t size = QUEUE_ENTRY_SIZE( topicLength, len );
+	int32_t offset;
+
+	if ( size > MQTT_OFFLINE_QUEUE_SIZE )
+	{
+		tag->queueDropped++;
+		return MQTT_ERROR;
+	}
+
+	for ( ;; )
+	{
+		if ( tag->queueCount == 0 )
+		{
+			tag->queueHead = 0;
+			tag->queueTail = 0;
+		}
+
+		// Free space is behind the head up to the end of the ring and before the tail, or between them
+		if ( ( tag->queueCount == 0 ) || ( tag->queueHead > tag->queueTail ) )
+		{
+			offset = ( tag->queueHead + size <= MQTT_OFFLINE_QUEUE_SIZE ) ? tag->queueHead : ( size <= tag->queueTail ) ? 0 : -1;
+		}
+		else
+		{
+			offset = ( tag->queueHead + size <= tag->queueTail ) ? tag->queueHead : -1;
+		}
+
+		if ( offset >= 0 )
+		{
+			break;
+		}
+
+		tag->queueDropped++;
+		if ( MQTT_OFFLINE_POLICY == MQTT_DROP_NEWEST )
+		{
+			return MQTT_ERROR;
+		}
+		dropQueued( tag );
+	}
+
+	// Tell the reader to go back to the start, unless too little is left there to hold an entry
+	if ( ( offset != tag->queueHead ) && ( tag->queueHead + ( int32_t )sizeof( entry ) <= MQTT_OFFLINE_QUEUE_SIZE ) )
+	{
+		struct queuedPublish wrap = { 0, 0, 1, 0 };
+		memcpy( &tag->queueBuffer[ tag->queueHead ], &wrap, sizeof( wrap ) );
+	}
+
+	memcpy( &tag->queueBuffer[ offset ], &entry, sizeof( entry ) );
+	memcpy( &tag->queueBuffer[ offset + sizeof( entry ) ], topic, topicLength );
+	memcpy( &tag->queueBuffer[ offset + sizeof( entry ) + topicLength ], pData, len );
+	tag->queueHead = offset + size;
+	tag->queueCount++;
+	return MQTT_SUCCESS;
+}
+
+// Read the entry at offset, following a wrap to the start of the ring. Returns where it really is
+static int32_t queueEntryAt( struct mqtt_context* tag, int32_t offset, struct queuedPublish* pEntry )
+{
+	if ( MQTT_OFFLINE_QUEUE_SIZE - offset < ( int32_t )sizeof( *pEntry ) )
+	{
+		offset = 0;
+	}
+	memcpy( pEntry, &tag->queueBuffer[ offset ], sizeof( *pEntry ) );
+	if ( pEntry->wrap )
+	{
+		offset = 0;
+		memcpy( pEntry, &tag->queueBuffer[ offset ], sizeof( *pEntry ) );
+	}
+	return offset;
+}
+
+static void dropQueued( struct mqtt_context* tag )
+{
+	struct queuedPublish entry;
+	int32_t offset = queueEntryAt( tag, tag->queueTail, &entry );
+
+	tag->queueTail = offset + QUEUE_ENTRY_SIZE( entry.topicLength, entry.len );
+	tag->queueCount--;
+}
+
+// Send the offline queue, up to MQTT_OFFLINE_DRAIN_BATCH messages to a write, straight from the
+//   ring. Stops with MQTT_BUSY when the in-flight slots run out, what is left goes out on a later call
+static int drainQueue( struct mqtt_context* tag )
+{
+	uint8_t headers[ MQTT_OFFLINE_DRAIN_BATCH ][ 7 ];
+	uint8_t packetIdBytes[ MQTT_OFFLINE_DRAIN_BATCH ][ 2 ];
+	uint16_t packetIds[ MQTT_OFFLINE_DRAIN_BATCH ];
+	uint8_t acks[ MQTT_OFFLINE_DRAIN_BATCH ];
+	struct mqtt_iovec iov[ MQTT_OFFLINE_DRAIN_BATCH * 5 ];
+	static const uint8_t noProperties = 0;
+	struct queuedPublish entry;
+	int32_t offset, tail, remainingLength;
+	uint8_t* pTopic, * pCursor;
+	int n, i, status, busy = 0;
+
+	while ( ( tag->queueCount > 0 ) && !busy )
+	{
+		tail = tag->queueTail;
+		for ( n = 0; ( n < MQTT_OFFLINE_DRAIN_BATCH ) && ( n < tag->queueCount ); n++ )
+		{
+			offset = queueEntryAt( tag, tail, &entry );
+			pTopic = &tag->queueBuffer[ offset + sizeof( entry ) ];
+			remainingLength = 2 + entry.topicLength + entry.len + ( MQTT_VERSION_5 ? 1 : 0 );
+
+			packetIds[ n ] = 0;
+			acks[ n ] = 0;
+			if ( entry.qos > 0 )
+			{
+				acks[ n ] = ( entry.qos == 1 ) ? MQTT_PACKET_TYPE_PUBACK : MQTT_PACKET_TYPE_PUBREC;
+				packetIds[ n ] = allocPacketId( tag, acks[ n ] );
+				if ( packetIds[ n ] == 0 )
+				{
+					busy = 1;
+					break;
+				}
+				remainingLength += 2;
+			}
+
+			headers[ n ][ 0 ] = MQTT_PACKET_TYPE_PUBLISH | ( entry.qos << 1 );
+			pCursor = mqtt_encodeRemainingLength( &headers[ n ][ 1 ], remainingLength );
+			*( pCursor++ ) = entry.topicLength >> 8;
+			*( pCursor++ ) = entry.topicLength & 0xFF;
+			packetIdBytes[ n ][ 0 ] = packetIds[ n ] >> 8;
+			packetIdBytes[ n ][ 1 ] = packetIds[ n ] & 0xFF;
+
+			// The same fragments as mqtt_publish, the properties are empty in MQTT 5 and absent before
+			iov[ n * 5 + 0 ].base = headers[ n ];
+			iov[ n * 5 + 0 ].len = ( int32_t )( pCursor - headers[ n ] );
+			iov[ n * 5 + 1 ].base = pTopic;
+			iov[ n * 5 + 1 ].len = entry.topicLength;
+			iov[ n * 5 + 2 ].base = packetIdBytes[ n ];
+			iov[ n * 5 + 2 ].len = ( entry.qos > 0 ) ? 2 : 0;
+			iov[ n * 5 + 3 ].base = &noProperties;
+			iov[ n * 5 + 3 ].len = MQTT_VERSION_5 ? 1 : 0;
+			iov[ n * 5 + 4 ].base = pTopic + entry.topicLength;
+			iov[ n * 5 + 4 ].len = entry.len;
+
+			if ( ( packetIds[ n ] != 0 ) && ( tag->sessionStore != NULL ) &&
+				 ( tag->sessionStore->save( tag->sessionStore, packetIds[ n ], acks[ n ], &iov[ n * 5 ], 5 ) != MQTT_SUCCESS ) )
+			{
+				releasePacketId( tag, packetIds[ n ], acks[ n ] );
+				busy = 1;
+				break;
+			}
+
+			tail = offset + QUEUE_ENTRY_SIZE( entry.topicLength, entry.len );
+		}
+
+		if ( n == 0 )
+		{
+			return MQTT_BUSY;
+		}
+
+		status = sendPacket( tag, iov, n * 5 );
+		if ( status != MQTT_SUCCESS )
+		{
+			// Still queued, they are sent again with new Packet Identifiers
+			for ( i = 0; i < n; i++ )
+			{
+				releasePacketId( tag, packetIds[ i ], acks[ i ] );
+			}
+			return status;
+		}
+
+		tag->queueTail = tail;
+		tag->queueCount -= n;
+	}
+
+	return busy ? MQTT_BUSY : MQTT_SUCCESS;
+}
+#endif
+
+#if MQTT_STATS
+int mqtt_statsSnapshot( struct mqtt_context* tag, struct mqtt_stats* pSnapshot )
+{
+	uint32_t sequence;
+	int tries;
+
+	// The core bumps the sequence before and after every update, a copy taken while it stayed the same
+	//   and even is consistent
+	for ( tries = 0; tries < MQTT_STATS_SNAPSHOT_TRIES; tries++ )
+	{
+		sequence = tag->stats.sequence;
+		MQTT_STATS_BARRIER();
+		memcpy( pSnapshot, &tag->stats, sizeof( *pSnapshot ) );
+		MQTT_STATS_BARRIER();
+		if ( !( sequence & 1 ) && ( tag->stats.sequence == sequence ) )
+		{
+			return MQTT_SUCCESS;
+		}
+	}
+	return MQTT_BUSY;
+}
+
+static void statsBegin( struct mqtt_context* tag )
+{
+	tag->stats.sequence++;
+	MQTT_STATS_BARRIER();
+}
+
+static void statsEnd( struct mqtt_context* tag )
+{
+	MQTT_STATS_BARRIER();
+	tag->stats.sequence++;
+}
+
+// Count a packet that was received, from its fixed header
+static void countIn( struct mqtt_context* tag, uint8_t type, int32_t remainingLength )
+{
+	statsBegin( tag );
+	tag->stats.packetsIn[ type >> 4 ]++;
+	tag->stats.bytesIn[ type >> 4 ] += 1 + mqtt_remainingLengthSize( remainingLength ) + remainingLength;
+	statsEnd( tag );
+}
+
+// Count the packets in one write. They may be split over the iovecs in any way, each one is found
+//   from the fixed header of the one before. The last may be cut short, as by mqtt_publish_begin
+static void countOut( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count )
+{
+	int32_t offset, length = 0, remaining = 0, chunk;
+	uint8_t type = 0, shift = 0, state = DECODE_TYPE;
+	int i, complete;
+
+	statsBegin( tag );
+	for ( i = 0; i < count; i++ )
+	{
+		for ( offset = 0; offset < iov[ i ].len; )
+		{
+			if ( state == DECODE_TYPE )
+			{
+				type = iov[ i ].base[ offset++ ] >> 4;
+				tag->stats.packetsOut[ type ]++;
+				tag->stats.bytesOut[ type ]++;
+				length = 0;
+				shift = 0;
+				state = DECODE_LENGTH;
+			}
+			else if ( state == DECODE_LENGTH )
+			{
+				complete = mqtt_decodeRemainingLengthByte( &length, &shift, iov[ i ].base[ offset++ ] );
+				tag->stats.bytesOut[ type ]++;
+				if ( complete < 0 )
+				{
+					statsEnd( tag );
+					return;
+				}
+				if ( complete > 0 )
+				{
+					remaining = length;
+					state = ( remaining > 0 ) ? DECODE_BODY : DECODE_TYPE;
+				}
+			}
+			else
+			{
+				chunk = iov[ i ].len - offset;
+				if ( chunk > remaining )
+				{
+					chunk = remaining;
+				}
+				tag->stats.bytesOut[ type ] += chunk;
+				offset += chunk;
+				remaining -= chunk;
+				if ( remaining == 0 )
+				{
+					state = DECODE_TYPE;
+				}
+			}
+		}
+	}
+	statsEnd( tag );
+}
+
+static void countEvent( struct mqtt_context* tag, uint32_t* pCounter, uint32_t n )
+{
+	statsBegin( tag );
+	*pCounter += n;
+	statsEnd( tag );
+}
+
+// Add a time to a histogram. The bucket is the bit length of ms, found in a fixed number of steps
+static void recordTime( struct mqtt_context* tag, struct mqtt_histogram* pHistogram, uint32_t ms )
+{
+	uint32_t value = ms;
+	uint8_t bucket = 0;
+
+	if ( value >= 0x10000UL )
+	{
+		bucket += 16;
+		value >>= 16;
+	}
+	if ( value >= 0x100 )
+	{
+		bucket += 8;
+		value >>= 8;
+	}
+	if ( value >= 0x10 )
+	{
+		bucket += 4;
+		value >>= 4;
+	}
+	if ( value >= 0x4 )
+	{
+		bucket += 2;
+		value >>= 2;
+	}
+	bucket += ( value >= 2 ) ? 2 : ( uint8_t )value;
+	if ( bucket >= MQTT_STATS_BUCKETS )
+	{
+		bucket = MQTT_STATS_BUCKETS - 1;
+	}
+
+	statsBegin( tag );
+	pHistogram->count++;
+	pHistogram->sum += ms;
+	if ( ms > pHistogram->max )
+	{
+		pHistogram->max = ms;
+	}
+	pHistogram->buckets[ bucket ]++;
+	statsEnd( tag );
 }
+#endif
@@ -2,10 +2,170 @@
 * This file contains the MQTT interface specification
 *
 */
+#ifndef MQTT_H
+#define MQTT_H
+
 #include <stdint.h>
 
 #define MQTT_SUCCESS 1
 #define MQTT_ERROR   0
+#define MQTT_BUSY    2		// All in-flight slots are taken or the transport took nothing, poll and try again
+
+// Size of the per-connection input buffer. Data is pulled from the network into this buffer in
+//   bulk and packet headers are decoded from it in place. A PUBLISH that does not fit is passed up
+//   in pieces, as long as its topic leaves room in the buffer
+#ifndef MQTT_INPUT_BUFFER_SIZE
+#define MQTT_INPUT_BUFFER_SIZE 256
+#endif
+
+// When set, inbound packets are decoded and handed to the application straight from the
+//   transport's own receive buffer (see mqtt_readView). Set to 0 if the transport cannot do this
+#ifndef MQTT_ZERO_COPY_RECEIVE
+#define MQTT_ZERO_COPY_RECEIVE 1
+#endif
+
+// Number of QoS 1 and 2 publishes and (un)subscribe requests that may await acknowledgement at the
+//   same time. Must be a power of two no larger than 32, the in-flight slot of a packet is taken
+//   from the low bits of its Packet Identifier
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8
+#endif
+
+#if ( MQTT_MAX_INFLIGHT & ( MQTT_MAX_INFLIGHT - 1 ) ) || ( MQTT_MAX_INFLIGHT > 32 )
+#error MQTT_MAX_INFLIGHT must be a power of two no larger than 32
+#endif
+
+// Number of inbound QoS 2 messages that may be delivered but not yet released by the server's
+//   PUBREL. Their Packet Identifiers are remembered to drop redelivered duplicates. Power of two
+#ifndef MQTT_MAX_RECEIVED_QOS2
+#define MQTT_MAX_RECEIVED_QOS2 8
+#endif
+
+#if ( MQTT_MAX_RECEIVED_QOS2 & ( MQTT_MAX_RECEIVED_QOS2 - 1 ) )
+#error MQTT_MAX_RECEIVED_QOS2 must be a power of two
+#endif
+
+// Speak MQTT 5 instead of MQTT 3.1.1. Publishes then use Topic Aliases in both directions, so a
+//   topic that is used again is sent as a 2 byte alias instead of the whole string
+#ifndef MQTT_VERSION_5
+#define MQTT_VERSION_5 0
+#endif
+
+#if MQTT_VERSION_5
+// Topic Aliases kept for our own publishes. The least recently used one is reassigned when a new
+//   topic comes along. The server may allow fewer in its CONNACK
+#ifndef MQTT_MAX_TOPIC_ALIASES
+#define MQTT_MAX_TOPIC_ALIASES 8
+#endif
+
+// Topic Aliases the server may use towards us, sent as Topic Alias Maximum in CONNECT
+#ifndef MQTT_MAX_INBOUND_TOPIC_ALIASES
+#define MQTT_MAX_INBOUND_TOPIC_ALIASES 8
+#endif
+
+// Longest topic that can get an alias. Longer topics are always sent in full
+#ifndef MQTT_TOPIC_ALIAS_LENGTH
+#define MQTT_TOPIC_ALIAS_LENGTH 64
+#endif
+#endif
+
+// Size of the per-connection transmit buffer. Publishes are copied into it and written together
+//   when it fills, when MQTT_TX_FLUSH_TIME has passed since the first one, or on mqtt_flush, so a
+//   burst of small messages shares TCP segments. 0 writes every publish straight away
+#ifndef MQTT_TX_BUFFER_SIZE
+#define MQTT_TX_BUFFER_SIZE 0
+#endif
+
+// Milliseconds a publish may wait in the transmit buffer for others to join it
+#ifndef MQTT_TX_FLUSH_TIME
+#define MQTT_TX_FLUSH_TIME 2
+#endif
+
+// Send PINGREQ and the acknowledgements ahead of publishes still in the transmit buffer, and only
+//   hand publishes to the transport while fewer than MQTT_TX_HOL_LIMIT bytes it took earlier still
+//   wait to be sent (see mqtt_txQueued). A ping then never queues behind more than that much bulk
+//   data on a saturated uplink. Needs the transmit buffer
+#ifndef MQTT_TX_PRIORITY
+#define MQTT_TX_PRIORITY 0
+#endif
+
+#ifndef MQTT_TX_HOL_LIMIT
+#define MQTT_TX_HOL_LIMIT 1460
+#endif
+
+#if MQTT_TX_PRIORITY && ( MQTT_TX_BUFFER_SIZE == 0 )
+#error MQTT_TX_PRIORITY needs MQTT_TX_BUFFER_SIZE
+#endif
+
+// Size of the per-connection offline queue. Publishes made while the connection is down are kept
+//   in it and sent after the next CONNACK, several to a write. 0 lets them fail as before. The
+//   queue lives in the context only, a session store does not keep it across a restart
+#ifndef MQTT_OFFLINE_QUEUE_SIZE
+#define MQTT_OFFLINE_QUEUE_SIZE 0
+#endif
+
+// What a full offline queue gives up: its oldest messages to make room, or the new one
+#define MQTT_DROP_OLDEST 0
+#define MQTT_DROP_NEWEST 1
+#ifndef MQTT_OFFLINE_POLICY
+#define MQTT_OFFLINE_POLICY MQTT_DROP_OLDEST
+#endif
+
+// Queued publishes gathered into one write when the offline queue is drained. Costs 5 iovecs and
+//   a few bytes of stack each
+#ifndef MQTT_OFFLINE_DRAIN_BATCH
+#define MQTT_OFFLINE_DRAIN_BATCH 8
+#endif
+
+// Bytes of other packets, acknowledgements and pings mostly, that can be held back while a streamed
+//   publish is being written. They go out after mqtt_publish_end
+#ifndef MQTT_STREAM_DEFER_SIZE
+#define MQTT_STREAM_DEFER_SIZE 32
+#endif
+
+// Keep statistics on every connection: packets and bytes per control packet type, errors, and
+//   histograms of ping round trips and publish acknowledgement times. See mqtt_statsSnapshot
+#ifndef MQTT_STATS
+#define MQTT_STATS 0
+#endif
+
+#if MQTT_STATS
+// Buckets of each latency histogram. Bucket 0 counts 0 ms, bucket n from 2^(n-1) to 2^n - 1 ms and
+//   the last one everything above
+#ifndef MQTT_STATS_BUCKETS
+#define MQTT_STATS_BUCKETS 16
+#endif
+
+// Times mqtt_statsSnapshot tries for a consistent copy before it gives up
+#ifndef MQTT_STATS_SNAPSHOT_TRIES
+#define MQTT_STATS_SNAPSHOT_TRIES 8
+#endif
+
+// Barrier around statistics updates. Only stops the compiler from reordering them, define it as a
+//   full memory barrier if snapshots are taken on another core than the connection runs on
+#ifndef MQTT_STATS_BARRIER
+#if defined( _MSC_VER )
+#define MQTT_STATS_BARRIER()    _ReadWriteBarrier()
+#else
+#define MQTT_STATS_BARRIER()    __asm__ __volatile__( "" ::: "memory" )
+#endif
+#endif
+#endif
+
+// Milliseconds after which mqtt_keepalive asks to be called again when a PINGREQ could not be written
+#ifndef MQTT_KEEPALIVE_RETRY_TIME
+#define MQTT_KEEPALIVE_RETRY_TIME 100
+#endif
+
+// Number of Topic Filters mqtt_subscribe_many and mqtt_unsubscribe_many put into one packet. The
+//   whole SUBACK has to fit the input buffer, and the call takes 3 iovecs per filter of stack
+#ifndef MQTT_MAX_FILTERS_PER_PACKET
+#define MQTT_MAX_FILTERS_PER_PACKET 32
+#endif
+
+#if ( MQTT_MAX_FILTERS_PER_PACKET + 2 > MQTT_INPUT_BUFFER_SIZE )
+#error MQTT_INPUT_BUFFER_SIZE must hold a SUBACK for MQTT_MAX_FILTERS_PER_PACKET filters
+#endif
 
 /*
  * MQTT control packet type and flags. Always the first byte of an MQTT packet.
@@ -22,6 +182,83 @@
 #define MQTT_PACKET_TYPE_SUBACK                                ( ( uint8_t ) 0x90U ) /**< @brief SUBACK (server-to-client). */
 #define MQTT_PACKET_TYPE_UNSUBSCRIBE                           ( ( uint8_t ) 0xa2U ) /**< @brief UNSUBSCRIBE (client-to-server). */
 #define MQTT_PACKET_TYPE_UNSUBACK                              ( ( uint8_t ) 0xb0U ) /**< @brief UNSUBACK (server-to-client). */
+// Applies to QOS1/2 packets only
+#define MQTT_PACKET_TYPE_PUBACK                                ( ( uint8_t ) 0x40U ) /**< @brief PUBACK (bi-directional). */
+#define MQTT_PACKET_TYPE_PUBREC                                ( ( uint8_t ) 0x50U ) /**< @brief PUBREC (bi-directional). */
+#define MQTT_PACKET_TYPE_PUBREL                                ( ( uint8_t ) 0x62U ) /**< @brief PUBREL (bi-directional). */
+#define MQTT_PACKET_TYPE_PUBCOMP                               ( ( uint8_t ) 0x70U ) /**< @brief PUBCOMP (bi-directional). */
+
+// SUBACK return code for a refused Topic Filter. Granted filters get their maximum QoS, 0 to 2
+#define MQTT_SUBACK_FAILURE              0x80
+// returnCode of a filter whose SUBACK or UNSUBACK has not arrived yet
+#define MQTT_SUBSCRIPTION_PENDING        0xFE
+
+// One Topic Filter of a mqtt_subscribe_many or mqtt_unsubscribe_many request
+struct mqtt_subscription {
+	char*    topicFilter;
+	uint8_t  qos;						// Requested QoS, not used when unsubscribing
+	uint8_t  returnCode;				// Filled in when the acknowledgement arrives
+};
+
+// A packet that was sent and still awaits acknowledgement
+struct mqtt_inflight {
+	uint16_t packetId;
+	uint8_t  ack;						// Packet type of the acknowledgement we are waiting for
+	uint16_t subscriptionCount;
+	struct mqtt_subscription* subscriptions;	// Results of a multi-filter request go here, else NULL
+#if MQTT_STATS
+	uint32_t sendTime;					// When the packet was made, for the acknowledgement time
+#endif
+};
+
+#if MQTT_STATS
+// Distribution of a time in milliseconds, see MQTT_STATS_BUCKETS
+struct mqtt_histogram {
+	uint32_t count;
+	uint32_t sum;
+	uint32_t max;
+	uint32_t buckets[ MQTT_STATS_BUCKETS ];
+};
+
+// Statistics of one connection, kept for the lifetime of the context. Counters wrap around, take
+//   the difference between two snapshots
+struct mqtt_stats {
+	volatile uint32_t sequence;			// Odd while an update is under way
+	uint32_t packetsIn[ 16 ];			// Indexed by control packet type, the high nibble of the first byte
+	uint32_t packetsOut[ 16 ];
+	uint32_t bytesIn[ 16 ];				// Whole packets, fixed header included
+	uint32_t bytesOut[ 16 ];
+	uint32_t parseErrors;				// Malformed packets and bodies that could not be looked at
+	uint32_t unroutedPublishes;			// Publishes mqtt_processPublish did not take
+	struct mqtt_histogram pingRoundTrip;	// PINGREQ to PINGRESP
+	struct mqtt_histogram publishAck;	// Publish to PUBACK for QoS 1, to PUBCOMP for QoS 2
+};
+#endif
+
+#if MQTT_VERSION_5
+// A topic bound to a Topic Alias on this connection. Alias n is entry n - 1 of its table
+struct mqtt_topicAlias {
+	uint16_t topicLength;				// 0 for an alias that is not in use
+	uint32_t lastUse;
+	char     topic[ MQTT_TOPIC_ALIAS_LENGTH ];
+};
+#endif
+
+// An inbound PUBLISH as handed to the application. topic and pData point into a receive buffer,
+//   so they are NOT null terminated and only valid until mqtt_processPublish returns. A message too
+//   large for the input buffer is passed up in pieces, one call per piece with the same topic, in
+//   order of offset. The last piece has offset + len == total. Once a piece is refused the rest is
+//   not passed up and the message is not acknowledged, a QoS 1 or 2 message comes again from offset 0
+struct mqtt_message {
+	uint8_t  flags;						// DUP, QoS and RETAIN bits from the fixed header
+	uint16_t packetId;					// Only present for QoS 1 and 2
+	char*    topic;
+	uint16_t topicLength;
+	uint8_t* pData;
+	int32_t  len;
+	int32_t  offset;					// Where pData starts in the payload, 0 unless it comes in pieces
+	int32_t  total;						// Length of the whole payload, more than len for a message in pieces
+};
 
 // Contains MQTT settings, an opague to the network connection instance and some session state
 struct mqtt_context {
@@ -30,8 +267,73 @@ struct mqtt_context {
 	uint8_t	 clientId[23];              // MQTT Client ID as per MQTT Spec
 	uint16_t keepaliveTimeout;			// Keepalive Timeout period to request when connecting
 	uint8_t  dontRequestCleanSession;	// Set this to non-zero if you do NOT want a clean session
+	struct mqtt_sessionStore* sessionStore;	// Optional, keeps unacknowledged publishes across restarts
 	// Connection Status Data (output)
 	uint8_t  sessionPresent;			// After successful connection this will be set to indicate "session present"
+	uint8_t  connected;					// Set by an accepted CONNACK, cleared by mqtt_Disconnect, a broken write or
+										//   a read that timed out inside a PUBLISH passed up in pieces
+	uint8_t  connectPending;			// Set by mqtt_connect_pipelined until the CONNACK arrives
+	uint8_t  connectResult;				// eMqttConnectResult_t of the last CONNACK
+	// Input Buffer (internal). Bytes from inputTail up to inputHead were received but not yet consumed
+	uint8_t  inputBuffer[ MQTT_INPUT_BUFFER_SIZE ];
+	int32_t  inputHead;
+	int32_t  inputTail;
+	int32_t  viewLength;				// Bytes currently looked at in place in the transport's receive buffer
+	// In-flight Table (internal). Slot i holds the packet whose Packet Identifier - 1 has i in its low bits
+	struct mqtt_inflight inflight[ MQTT_MAX_INFLIGHT ];
+	uint32_t inflightUsed;				// Bitmap of slots in use
+	uint32_t inflightReserved;			// Slots stored messages are replayed into once the CONNACK arrives
+	uint16_t packetIdBase;				// Packet Identifiers are handed out as packetIdBase + slot + 1
+	// Received QoS 2 Packet Identifiers (internal). Open addressed hash set, 0 marks an empty entry
+	uint16_t receivedIds[ MQTT_MAX_RECEIVED_QOS2 * 2 ];
+	uint16_t receivedCount;
+	// Incremental Decoder (internal). Where mqtt_feed is in the packet it is currently decoding
+	uint8_t  decodeState;
+	uint8_t  decodeType;
+	int32_t  decodeLength;				// Remaining Length, as far as decoded
+	uint8_t  decodeShift;				// Bits of the Remaining Length decoded so far
+	int32_t  decodeCount;				// Body bytes buffered or skipped so far
+	const uint8_t* feedData;			// Body of the packet being dispatched by mqtt_feed, else NULL
+	int32_t  feedLength;
+	// Chunked Delivery (internal). The PUBLISH being passed up in pieces, its topic stays at the front
+	//   of the input buffer until the last piece
+	struct mqtt_message chunkMessage;
+	int8_t   chunkNew;					// As returned by addReceivedId, 1 for QoS 0 and 1
+	uint8_t  chunkFailed;				// Set once the application refused a piece, the rest is not passed up
+	// Keepalive (internal). Times are in milliseconds as returned by mqtt_getTime
+	uint32_t lastSendTime;				// When the last packet was written
+	uint32_t pingSendTime;
+	uint8_t  pingOutstanding;			// Set while a PINGREQ awaits its PINGRESP
+#if MQTT_OFFLINE_QUEUE_SIZE > 0
+	// Offline Queue (internal). Ring of publishes made while disconnected, oldest at queueTail
+	uint8_t  queueBuffer[ MQTT_OFFLINE_QUEUE_SIZE ];
+	int32_t  queueHead;
+	int32_t  queueTail;
+	uint16_t queueCount;
+	uint32_t queueDropped;				// Messages lost to a full queue (output)
+#endif
+	// Streamed Publish (internal). Between mqtt_publish_begin and mqtt_publish_end nothing else may be
+	//   written, other packets wait in streamDeferred
+	uint8_t  streamOpen;
+	int32_t  streamRemaining;			// Payload bytes still to be appended
+	uint8_t  streamDeferred[ MQTT_STREAM_DEFER_SIZE ];
+	int32_t  streamDeferredLength;
+#if MQTT_TX_BUFFER_SIZE > 0
+	// Transmit Buffer (internal). Publishes not yet written
+	uint8_t  txBuffer[ MQTT_TX_BUFFER_SIZE ];
+	int32_t  txLength;
+	uint32_t txDeadline;				// When the first buffered publish has waited MQTT_TX_FLUSH_TIME
+#endif
+#if MQTT_VERSION_5
+	// Topic Aliases (internal). They only last as long as the network connection
+	struct mqtt_topicAlias outboundAliases[ MQTT_MAX_TOPIC_ALIASES ];
+	struct mqtt_topicAlias inboundAliases[ MQTT_MAX_INBOUND_TOPIC_ALIASES ];
+	uint16_t topicAliasMaximum;			// Aliases the server accepts from us, from its CONNACK
+	uint32_t aliasClock;
+#endif
+#if MQTT_STATS
+	struct mqtt_stats stats;			// Written by the core only, read with mqtt_statsSnapshot (output)
+#endif
 };
 
 struct mqtt_header {
@@ -39,6 +341,33 @@ struct mqtt_header {
 	int32_t remainingLength;
 };
 
+// One fragment of an outbound packet. A packet is handed to mqtt_writev as a list of these so
+//   the fixed header, topic and payload never have to be copied together by the core
+struct mqtt_iovec {
+	const uint8_t* base;
+	int32_t        len;
+};
+
+// Called by a session store for every message it replays. pPacket is the PUBLISH as it was saved,
+//   len 0 for a QoS 2 message that only awaits its PUBCOMP
+typedef int ( *mqtt_replayFn_t )( struct mqtt_context* tag, uint16_t packetId, uint8_t ack, const uint8_t* pPacket, int32_t len );
+
+// Keeps unacknowledged QoS 1 and 2 publishes, so they survive a restart of the application when
+//   dontRequestCleanSession is set. Each PUBLISH is saved before it is written, saved again with
+//   no data when its PUBREC arrives and released on PUBACK or PUBCOMP. With a clean session the
+//   store is cleared. After CONNACK replay must call fn for each message, in the order they were
+//   first saved, until fn fails; fn may release the message it is called for. A pipelined connect
+//   also calls replay before the CONNECT is written, with an fn that only looks at the Packet
+//   Identifiers. Only messages that
+//   were written, at most MQTT_MAX_INFLIGHT, are ever in the store. Those still in the offline
+//   queue have no Packet Identifier yet and are not saved
+struct mqtt_sessionStore {
+	int  ( *save )( struct mqtt_sessionStore* store, uint16_t packetId, uint8_t ack, const struct mqtt_iovec* iov, int count );
+	void ( *release )( struct mqtt_sessionStore* store, uint16_t packetId );
+	void ( *clear )( struct mqtt_sessionStore* store );
+	int  ( *replay )( struct mqtt_sessionStore* store, mqtt_replayFn_t fn, struct mqtt_context* tag );
+};
+
 typedef enum {
 	MQTT_CONNECT_ACCEPTED = 0,
 	MQTT_CONNECT_REFUSED_PROTVERSION = 1,
@@ -51,25 +380,112 @@ typedef enum {
 
 
 // These functions must be supplied by the application
-int  mqtt_write( struct mqtt_context* tag, uint8_t* ptr, int32_t len );
+// mqtt_writev must put all fragments on the wire back to back and return the total bytes written
+int  mqtt_writev( struct mqtt_context* tag, const struct mqtt_iovec* iov, int count );
+// mqtt_read returns whatever is available up to len bytes, waiting only until at least one byte
+//   arrives. It returns 0 if nothing arrived within the receive timeout
 int  mqtt_read( struct mqtt_context* tag, uint8_t* ptr, int32_t len );
 int  mqtt_processPacket( struct mqtt_context* tag, struct mqtt_header* header );
+// mqtt_processPublish returns MQTT_SUCCESS once it has taken the message. A QoS 1 or 2 message it
+//   returns anything else for is not acknowledged, so the server sends it again
+int  mqtt_processPublish( struct mqtt_context* tag, struct mqtt_message* msg );
+// mqtt_getTime returns a free running millisecond count, it may wrap
+uint32_t mqtt_getTime( struct mqtt_context* tag );
+#if MQTT_TX_PRIORITY
+// mqtt_txQueued returns how many bytes handed to mqtt_writev are still waiting in the transport to
+//   be put on the wire, ahead of anything written next
+int32_t mqtt_txQueued( struct mqtt_context* tag );
+#endif
+#if MQTT_ZERO_COPY_RECEIVE
+// mqtt_readView waits until len bytes can be read and returns how many of them lie contiguous at
+//   *pptr without consuming any. 0 means they did not arrive in time or can never fit.
+//   mqtt_releaseView consumes len bytes once the core is done looking at them
+int32_t mqtt_readView( struct mqtt_context* tag, uint8_t** pptr, int32_t len );
+void mqtt_releaseView( struct mqtt_context* tag, int32_t len );
+#endif
 
-// The application needs to call this to check for incoming packets
+// The application needs to call this to check for incoming packets. Returns MQTT_BUSY if no complete
+//   fixed header arrived before mqtt_read timed out, what did arrive is kept for the next call, and
+//   MQTT_ERROR for a malformed or refused packet. If mqtt_read times out inside the payload of a
+//   PUBLISH passed up in pieces, connected is cleared and the connection has to be closed, the
+//   stream cannot be picked up again
 int  mqtt_pollInput( struct mqtt_context* tag );
 
+// Alternatively, hand received bytes to the core as they arrive, in chunks of any size. Complete
+//   packets are processed from the chunk itself where possible, the rest is gathered in the input
+//   buffer. A PUBLISH that does not fit is passed up in pieces as they arrive, other bodies that do
+//   not fit are dropped. Never calls mqtt_read or mqtt_readView, so it
+//   does not block and may run from a socket callback. Do not mix with mqtt_pollInput on one
+//   connection. Returns MQTT_ERROR if the stream is malformed or a packet was not processed
+int  mqtt_feed( struct mqtt_context* tag, const uint8_t* data, int32_t len );
+
+// Packet processors call this to read the body of the current packet. Buffered bytes are used
+//   first, the rest is read from the network straight into ptr
+int  mqtt_receive( struct mqtt_context* tag, uint8_t* ptr, int32_t len );
+
 // General MQTT interface functions
 int mqtt_Connect( struct mqtt_context* tag );
 int mqtt_Disconnect( struct mqtt_context* tag );
+
+// Connect without waiting for the CONNACK. CONNECT and a SUBSCRIBE for count filters (none if 0) go
+//   out in one write, queued publishes right behind them unless a session store has to be replayed
+//   first. The CONNACK and SUBACK are taken in by mqtt_pollInput or mqtt_feed like any other packet:
+//   connectPending is cleared, connectResult set, and the subscriptions get their return codes.
+//   If the server refuses the connection, whatever was sent along with the CONNECT is lost. The
+//   SUBSCRIBE does not take an in-flight slot a stored message needs for its replay, if they all do
+//   MQTT_BUSY is returned and nothing written
+int mqtt_connect_pipelined( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count );
 int mqtt_PingReq( struct mqtt_context* tag );
+
+// Send PINGREQ if nothing was sent for keepaliveTimeout seconds, so the server only hears pings from
+//   idle connections. Returns MQTT_ERROR if the PINGRESP to an earlier ping did not arrive within
+//   keepaliveTimeout, the connection should then be closed, and MQTT_BUSY if the PINGREQ could not
+//   be written. If pNextCheck is not NULL it is set to the milliseconds after which this needs to be
+//   called again, 0 if keepalive is off. Buffered publishes are flushed here once their time is up
+int mqtt_keepalive( struct mqtt_context* tag, uint32_t* pNextCheck );
+
+// Write the publishes waiting in the transmit buffer. Call after a burst when mqtt_keepalive will
+//   not run within MQTT_TX_FLUSH_TIME. Any other packet flushes them first as well, except with
+//   MQTT_TX_PRIORITY, which also makes this return MQTT_BUSY while the transport is backed up
+int mqtt_flush( struct mqtt_context* tag );
 int mqtt_subscribe(struct mqtt_context* tag, char* topicFilter);
 int mqtt_unSubscribe(struct mqtt_context* tag, char* topicFilter);
 
+// Subscribe to or unsubscribe from up to MQTT_MAX_FILTERS_PER_PACKET filters with a single packet.
+//   Every returnCode is set to MQTT_SUBSCRIPTION_PENDING and filled in by mqtt_pollInput when the
+//   acknowledgement arrives, so the array must stay valid until then. UNSUBACK sets them to 0
+int mqtt_subscribe_many( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count );
+int mqtt_unsubscribe_many( struct mqtt_context* tag, struct mqtt_subscription* subscriptions, uint16_t count );
+
+// Publish a message. With an offline queue, messages published while not connected, or while older
+//   ones still wait in the queue, are queued and MQTT_SUCCESS is returned. That includes the one
+//   whose write finds the connection broken. A negative len, or one that makes the packet larger than
+//   a Remaining Length can describe, fails with MQTT_ERROR before anything is sent
 int mqtt_publish(
 	struct mqtt_context* tag,
 	char* topic,
 	uint8_t* pData,
-	int32_t len );
+	int32_t len,
+	uint8_t qos );
+
+// Publish a payload of totalLen bytes that is handed over in pieces, for payloads too large to hold in
+//   RAM. mqtt_publish_begin writes everything up to the payload, mqtt_publish_append writes the next
+//   piece straight to the transport and mqtt_publish_end finishes once all totalLen bytes went out.
+//   Packets the core has to send in the meantime are held back until then, if they do not fit
+//   MQTT_STREAM_DEFER_SIZE they fail. A failed append or an early end leave the connection unusable.
+//   Streamed messages are not kept in the session store. totalLen is checked as len of mqtt_publish
+int mqtt_publish_begin( struct mqtt_context* tag, char* topic, int32_t totalLen, uint8_t qos );
+int mqtt_publish_append( struct mqtt_context* tag, const uint8_t* pChunk, int32_t len );
+int mqtt_publish_end( struct mqtt_context* tag );
 
+// Number of packets still awaiting acknowledgement
+int mqtt_inflightCount( struct mqtt_context* tag );
 
+#if MQTT_STATS
+// Copy the statistics of a connection while it is in use, for example from a task that exports them
+//   periodically. The copy is consistent, the core only has to retry if it was updated meanwhile.
+//   Returns MQTT_BUSY if no consistent copy was had in MQTT_STATS_SNAPSHOT_TRIES tries
+int mqtt_statsSnapshot( struct mqtt_context* tag, struct mqtt_stats* pSnapshot );
+#endif
 
+#endif /* MQTT_H */
@@ -0,0 +1,621 @@
+/*
+* This file implements the MQTT broker, the server side of MQTT 3.1.1 for clients on the local network.
+*   Messages are passed on at QoS 0 whatever QoS they were published and subscribed with, and neither
+*   retained messages nor sessions are kept, every connection starts clean
+*
+*/
+#include <string.h>
+#include "mqtt_broker.h"
+#include "mqtt_router.h"
+#include "mqtt_rlength.h"
+
+#define MQTT_VERSION_3_1_1    4U
+
+// CONNACK return codes
+#define CONNACK_UNACCEPTABLE_PROTOCOL    1
+#define CONNACK_IDENTIFIER_REJECTED      2
+
+static int32_t packetLength( const uint8_t* pData, int32_t available );
+static int processPacket( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pPacket, int32_t len );
+static int processConnect( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pBody, int32_t length );
+static int processPublish( struct mqtt_broker* broker, struct mqtt_brokerClient* client, uint8_t type, const uint8_t* pBody, int32_t length );
+static int processSubscribe( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pBody, int32_t length );
+static int processUnsubscribe( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pBody, int32_t length );
+static int fanOut( struct mqtt_broker* broker, struct mqtt_message* msg );
+static int reply( struct mqtt_brokerClient* client, uint8_t* pPacket, int32_t len );
+static int sendAck( struct mqtt_brokerClient* client, uint8_t type, const uint8_t* pPacketId );
+static uint16_t* findReceived( struct mqtt_brokerClient* client, uint16_t packetId );
+static void closeClient( struct mqtt_broker* broker, struct mqtt_brokerClient* client );
+static void dropSubscriptions( struct mqtt_broker* broker, uint8_t index );
+
+void mqtt_brokerInit( struct mqtt_broker* broker )
+{
+	memset( broker, 0, sizeof( *broker ) );
+}
+
+struct mqtt_brokerClient* mqtt_brokerAttach( struct mqtt_broker* broker, void* network_tag )
+{
+	struct mqtt_brokerClient* client;
+	int i;
+
+	for ( i = 0; i < MQTT_BROKER_MAX_CLIENTS; i++ )
+	{
+		client = &broker->clients[ i ];
+		if ( client->state == MQTT_BROKER_FREE )
+		{
+			client->network_tag = network_tag;
+			client->state = MQTT_BROKER_ACCEPTED;
+			client->clientId[ 0 ] = '\0';
+			client->keepalive = 0;
+			client->lastReceive = broker->time;
+			client->dropped = 0;
+			client->inputLength = 0;
+			memset( client->received, 0, sizeof( client->received ) );
+			return client;
+		}
+	}
+	return NULL;
+}
+
+void mqtt_brokerDetach( struct mqtt_broker* broker, struct mqtt_brokerClient* client )
+{
+	dropSubscriptions( broker, ( uint8_t )( client - broker->clients ) );
+	client->state = MQTT_BROKER_FREE;
+	client->network_tag = NULL;
+	client->inputLength = 0;
+}
+
+int mqtt_brokerInput( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* data, int32_t len )
+{
+	int32_t total, take;
+
+	if ( client->state == MQTT_BROKER_CLOSING )
+	{
+		return MQTT_ERROR;
+	}
+	client->lastReceive = broker->time;
+
+	while ( len > 0 )
+	{
+		if ( client->inputLength == 0 )
+		{
+			// Every packet that is there whole is processed where it was received
+			total = packetLength( data, len );
+			if ( total < 0 )
+			{
+				closeClient( broker, client );
+				return MQTT_ERROR;
+			}
+			if ( ( total > 0 ) && ( total <= len ) )
+			{
+				if ( processPacket( broker, client, data, total ) != MQTT_SUCCESS )
+				{
+					closeClient( broker, client );
+					return MQTT_ERROR;
+				}
+				data += total;
+				len -= total;
+				continue;
+			}
+			if ( total > MQTT_BROKER_INPUT_SIZE )
+			{
+				closeClient( broker, client );
+				return MQTT_ERROR;
+			}
+			// The start of a packet, the rest comes with the next call. A header of up to 5 bytes
+			//   that is not complete fits as well
+			memcpy( client->input, data, len );
+			client->inputLength = len;
+			return MQTT_SUCCESS;
+		}
+
+		// Complete the packet in the input buffer. Until its length is known it grows one byte at a time
+		total = packetLength( client->input, client->inputLength );
+		if ( ( total < 0 ) || ( total > MQTT_BROKER_INPUT_SIZE ) )
+		{
+			closeClient( broker, client );
+			return MQTT_ERROR;
+		}
+		take = ( total == 0 ) ? 1 : total - client->inputLength;
+		if ( take > len )
+		{
+			take = len;
+		}
+		memcpy( &client->input[ client->inputLength ], data, take );
+		client->inputLength += take;
+		data += take;
+		len -= take;
+
+		if ( client->inputLength == total )
+		{
+			client->inputLength = 0;
+			if ( processPacket( broker, client, client->input, total ) != MQTT_SUCCESS )
+			{
+				closeClient( broker, client );
+				return MQTT_ERROR;
+			}
+		}
+	}
+	return MQTT_SUCCESS;
+}
+
+int mqtt_brokerPublish( struct mqtt_broker* broker, const char* topic, const uint8_t* pData, int32_t len )
+{
+	struct mqtt_message msg;
+	int32_t topicLength = ( int32_t )strlen( topic );
+
+	if ( !mqtt_validTopicName( topic, topicLength ) )
+	{
+		return 0;
+	}
+	msg.flags = 0;
+	msg.packetId = 0;
+	msg.topic = ( char* )topic;
+	msg.topicLength = ( uint16_t )topicLength;
+	msg.pData = ( uint8_t* )pData;
+	msg.len = len;
+	return fanOut( broker, &msg );
+}
+
+void mqtt_brokerKeepalive( struct mqtt_broker* broker, uint32_t now )
+{
+	struct mqtt_brokerClient* client;
+	uint32_t limit;
+	int i;
+
+	broker->time = now;
+	for ( i = 0; i < MQTT_BROKER_MAX_CLIENTS; i++ )
+	{
+		client = &broker->clients[ i ];
+		if ( client->state == MQTT_BROKER_ACCEPTED )
+		{
+			limit = MQTT_BROKER_CONNECT_TIMEOUT;
+		}
+		else if ( ( client->state == MQTT_BROKER_CONNECTED ) && ( client->keepalive > 0 ) )
+		{
+			// One and a half times the keepalive, see MQTT 3.1.1 section 3.1.2.10
+			limit = client->keepalive * 1500UL;
+		}
+		else
+		{
+			continue;
+		}
+
+		if ( now - client->lastReceive > limit )
+		{
+			closeClient( broker, client );
+			mqtt_brokerShutdown( client );
+		}
+	}
+}
+
+// Length of the whole packet at pData once its fixed header is complete, 0 before and -1 if the
+//   Remaining Length is malformed
+static int32_t packetLength( const uint8_t* pData, int32_t available )
+{
+	int32_t length, size;
+
+	size = mqtt_decodeRemainingLength( pData + 1, available - 1, &length );
+	if ( size <= 0 )
+	{
+		return size;
+	}
+	return 1 + size + length;
+}
+
+static int processPacket( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pPacket, int32_t len )
+{
+	uint8_t type = pPacket[ 0 ];
+	int32_t header = 2;
+	const uint8_t* pBody;
+	int32_t length;
+
+	// The Remaining Length was checked by packetLength, it ends with the first byte below 0x80
+	while ( pPacket[ header - 1 ] & 0x80 )
+	{
+		header++;
+	}
+	pBody = pPacket + header;
+	length = len - header;
+
+	if ( client->state == MQTT_BROKER_ACCEPTED )
+	{
+		// The first packet must be the CONNECT, see MQTT 3.1.1 section 3.1
+		if ( type != MQTT_PACKET_TYPE_CONNECT )
+		{
+			return MQTT_ERROR;
+		}
+		return processConnect( broker, client, pBody, length );
+	}
+
+	if ( ( type & 0xF0 ) == MQTT_PACKET_TYPE_PUBLISH )
+	{
+		return processPublish( broker, client, type, pBody, length );
+	}
+
+	switch ( type )
+	{
+	case MQTT_PACKET_TYPE_SUBSCRIBE:
+		return processSubscribe( broker, client, pBody, length );
+
+	case MQTT_PACKET_TYPE_UNSUBSCRIBE:
+		return processUnsubscribe( broker, client, pBody, length );
+
+	case MQTT_PACKET_TYPE_PUBREL:
+	{
+		uint16_t* pReceived;
+
+		if ( length != 2 )
+		{
+			return MQTT_ERROR;
+		}
+		// The message was passed on when its PUBLISH arrived, its Packet Identifier may now be used again
+		pReceived = findReceived( client, ( uint16_t )( ( pBody[ 0 ] << 8 ) | pBody[ 1 ] ) );
+		if ( pReceived != NULL )
+		{
+			*pReceived = 0;
+		}
+		return sendAck( client, MQTT_PACKET_TYPE_PUBCOMP, pBody );
+	}
+
+	case MQTT_PACKET_TYPE_PINGREQ:
+	{
+		uint8_t pingresp[ 2 ] = { MQTT_PACKET_TYPE_PINGRESP, 0 };
+
+		return reply( client, pingresp, sizeof( pingresp ) );
+	}
+
+	case MQTT_PACKET_TYPE_PUBACK:
+	case MQTT_PACKET_TYPE_PUBREC:
+	case MQTT_PACKET_TYPE_PUBCOMP:
+		// Nothing is sent with QoS 1 or 2, so nothing is waiting for these
+		return MQTT_SUCCESS;
+
+	default:
+		// DISCONNECT, a second CONNECT or a packet a client must not send
+		return MQTT_ERROR;
+	}
+}
+
+static int processConnect( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pBody, int32_t length )
+{
+	uint8_t connack[ 4 ] = { MQTT_PACKET_TYPE_CONNACK, 2, 0, 0 };
+	uint16_t idLength;
+	int i;
+
+	// Protocol Name, Level, Connect Flags, Keep Alive and the length of the ClientID
+	if ( ( length < 12 ) || ( pBody[ 0 ] != 0 ) || ( pBody[ 1 ] != 4 ) || ( memcmp( &pBody[ 2 ], "MQTT", 4 ) != 0 ) )
+	{
+		return MQTT_ERROR;
+	}
+	if ( pBody[ 6 ] != MQTT_VERSION_3_1_1 )
+	{
+		connack[ 3 ] = CONNACK_UNACCEPTABLE_PROTOCOL;
+		reply( client, connack, sizeof( connack ) );
+		return MQTT_ERROR;
+	}
+	// The reserved flag must be 0. Will, User Name and Password are not used
+	if ( pBody[ 7 ] & 0x01 )
+	{
+		return MQTT_ERROR;
+	}
+
+	idLength = ( uint16_t )( ( pBody[ 10 ] << 8 ) | pBody[ 11 ] );
+	if ( 12 + idLength > length )
+	{
+		return MQTT_ERROR;
+	}
+	if ( idLength >= sizeof( client->clientId ) )
+	{
+		connack[ 3 ] = CONNACK_IDENTIFIER_REJECTED;
+		reply( client, connack, sizeof( connack ) );
+		return MQTT_ERROR;
+	}
+	memcpy( client->clientId, &pBody[ 12 ], idLength );
+	client->clientId[ idLength ] = '\0';
+	client->keepalive = ( uint16_t )( ( pBody[ 8 ] << 8 ) | pBody[ 9 ] );
+
+	// A second connection with the same ClientID takes over from the first, see MQTT 3.1.1 section 3.1.4.
+	//   Empty ClientIDs are all different
+	for ( i = 0; ( i < MQTT_BROKER_MAX_CLIENTS ) && ( idLength > 0 ); i++ )
+	{
+		struct mqtt_brokerClient* other = &broker->clients[ i ];
+
+		if ( ( other != client ) && ( other->state == MQTT_BROKER_CONNECTED ) && ( strcmp( other->clientId, client->clientId ) == 0 ) )
+		{
+			closeClient( broker, other );
+			mqtt_brokerShutdown( other );
+		}
+	}
+
+	client->state = MQTT_BROKER_CONNECTED;
+	return reply( client, connack, sizeof( connack ) );
+}
+
+static int processPublish( struct mqtt_broker* broker, struct mqtt_brokerClient* client, uint8_t type, const uint8_t* pBody, int32_t length )
+{
+	struct mqtt_message msg;
+	uint8_t qos = ( type >> 1 ) & 0x03;
+	uint16_t* pReceived;
+	int32_t offset;
+
+	if ( ( qos == 3 ) || ( length < 2 ) )
+	{
+		return MQTT_ERROR;
+	}
+	msg.flags = type & 0x0F;
+	msg.topicLength = ( uint16_t )( ( pBody[ 0 ] << 8 ) | pBody[ 1 ] );
+	msg.topic = ( char* )&pBody[ 2 ];
+	offset = 2 + msg.topicLength;
+	msg.packetId = 0;
+	if ( qos > 0 )
+	{
+		if ( offset + 2 > length )
+		{
+			return MQTT_ERROR;
+		}
+		msg.packetId = ( uint16_t )( ( pBody[ offset ] << 8 ) | pBody[ offset + 1 ] );
+		offset += 2;
+		if ( msg.packetId == 0 )
+		{
+			return MQTT_ERROR;
+		}
+	}
+	if ( ( offset > length ) || !mqtt_validTopicName( msg.topic, msg.topicLength ) )
+	{
+		return MQTT_ERROR;
+	}
+	msg.pData = ( uint8_t* )&pBody[ offset ];
+	msg.len = length - offset;
+
+	// A QoS 2 message is passed on once, until the client releases its Packet Identifier with PUBREL.
+	//   Copies sent again before that only get their PUBREC again
+	if ( qos == 2 )
+	{
+		if ( findReceived( client, msg.packetId ) != NULL )
+		{
+			return sendAck( client, MQTT_PACKET_TYPE_PUBREC, &pBody[ offset - 2 ] );
+		}
+		pReceived = findReceived( client, 0 );
+		if ( pReceived == NULL )
+		{
+			return MQTT_ERROR;
+		}
+		*pReceived = msg.packetId;
+	}
+
+	fanOut( broker, &msg );
+	if ( broker->onPublish != NULL )
+	{
+		broker->onPublish( broker, client, &msg );
+	}
+
+	if ( qos == 1 )
+	{
+		return sendAck( client, MQTT_PACKET_TYPE_PUBACK, &pBody[ offset - 2 ] );
+	}
+	if ( qos == 2 )
+	{
+		return sendAck( client, MQTT_PACKET_TYPE_PUBREC, &pBody[ offset - 2 ] );
+	}
+	return MQTT_SUCCESS;
+}
+
+// Every Topic Filter gets its own return code in the SUBACK, 0 when it was added and MQTT_SUBACK_FAILURE
+//   when it is malformed or there is no room for it. Filters the client already has are not added twice
+static int processSubscribe( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pBody, int32_t length )
+{
+	uint8_t suback[ 1 + 2 + 2 + MQTT_BROKER_MAX_SUBSCRIPTIONS ];
+	uint8_t index = ( uint8_t )( client - broker->clients );
+	struct mqtt_brokerSubscription* slot;
+	const char* filter;
+	uint16_t filterLength;
+	int32_t offset = 2, count = 0, header;
+	int i;
+
+	if ( length < 2 + 3 )
+	{
+		return MQTT_ERROR;
+	}
+
+	while ( offset < length )
+	{
+		if ( ( offset + 2 > length ) || ( count == MQTT_BROKER_MAX_SUBSCRIPTIONS ) )
+		{
+			return MQTT_ERROR;
+		}
+		filterLength = ( uint16_t )( ( pBody[ offset ] << 8 ) | pBody[ offset + 1 ] );
+		filter = ( const char* )&pBody[ offset + 2 ];
+		offset += 2 + filterLength + 1;
+		if ( ( offset > length ) || ( pBody[ offset - 1 ] > 2 ) )
+		{
+			return MQTT_ERROR;
+		}
+
+		suback[ 5 + count ] = MQTT_SUBACK_FAILURE;
+		if ( ( filterLength <= MQTT_BROKER_FILTER_LENGTH ) && mqtt_validTopicFilter( filter, filterLength ) )
+		{
+			slot = NULL;
+			for ( i = 0; i < MQTT_BROKER_MAX_SUBSCRIPTIONS; i++ )
+			{
+				struct mqtt_brokerSubscription* sub = &broker->subscriptions[ i ];
+
+				if ( sub->filterLength == 0 )
+				{
+					if ( slot == NULL )
+					{
+						slot = sub;
+					}
+				}
+				else if ( ( sub->client == index ) && ( sub->filterLength == filterLength ) && ( memcmp( sub->filter, filter, filterLength ) == 0 ) )
+				{
+					slot = NULL;
+					suback[ 5 + count ] = 0;
+					break;
+				}
+			}
+			if ( slot != NULL )
+			{
+				slot->client = index;
+				slot->filterLength = ( uint8_t )filterLength;
+				memcpy( slot->filter, filter, filterLength );
+				suback[ 5 + count ] = 0;
+			}
+		}
+		count++;
+	}
+
+	// The Remaining Length takes 1 or 2 bytes, the packet is built backwards from the Packet Identifier
+	suback[ 3 ] = pBody[ 0 ];
+	suback[ 4 ] = pBody[ 1 ];
+	header = 3 - 1 - mqtt_remainingLengthSize( 2 + count );
+	suback[ header ] = MQTT_PACKET_TYPE_SUBACK;
+	mqtt_encodeRemainingLength( &suback[ header + 1 ], 2 + count );
+	return reply( client, &suback[ header ], 5 - header + count );
+}
+
+static int processUnsubscribe( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* pBody, int32_t length )
+{
+	uint8_t index = ( uint8_t )( client - broker->clients );
+	uint16_t filterLength;
+	int32_t offset = 2;
+	int i;
+
+	if ( length < 2 + 2 )
+	{
+		return MQTT_ERROR;
+	}
+
+	while ( offset < length )
+	{
+		if ( offset + 2 > length )
+		{
+			return MQTT_ERROR;
+		}
+		filterLength = ( uint16_t )( ( pBody[ offset ] << 8 ) | pBody[ offset + 1 ] );
+		offset += 2;
+		if ( offset + filterLength > length )
+		{
+			return MQTT_ERROR;
+		}
+		for ( i = 0; i < MQTT_BROKER_MAX_SUBSCRIPTIONS; i++ )
+		{
+			struct mqtt_brokerSubscription* sub = &broker->subscriptions[ i ];
+
+			if ( ( sub->filterLength == filterLength ) && ( sub->client == index ) && ( memcmp( sub->filter, &pBody[ offset ], filterLength ) == 0 ) )
+			{
+				sub->filterLength = 0;
+			}
+		}
+		offset += filterLength;
+	}
+
+	return sendAck( client, MQTT_PACKET_TYPE_UNSUBACK, pBody );
+}
+
+// Pass msg on to every client with a matching subscription, once even if several match. The PUBLISH
+//   is written straight from the topic and data of msg, behind a fixed header built on the stack.
+//   Clients without room for it lose the message and have it counted in dropped
+static int fanOut( struct mqtt_broker* broker, struct mqtt_message* msg )
+{
+	uint8_t header[ 1 + 4 + 2 ];
+	uint8_t sent[ ( MQTT_BROKER_MAX_CLIENTS + 7 ) / 8 ];
+	struct mqtt_iovec iov[ 3 ];
+	struct mqtt_brokerClient* target;
+	uint8_t* pos;
+	int i, delivered = 0;
+
+	header[ 0 ] = MQTT_PACKET_TYPE_PUBLISH;
+	pos = mqtt_encodeRemainingLength( &header[ 1 ], 2 + msg->topicLength + msg->len );
+	*pos++ = ( uint8_t )( msg->topicLength >> 8 );
+	*pos++ = ( uint8_t )msg->topicLength;
+	iov[ 0 ].base = header;
+	iov[ 0 ].len = ( int32_t )( pos - header );
+	iov[ 1 ].base = ( const uint8_t* )msg->topic;
+	iov[ 1 ].len = msg->topicLength;
+	iov[ 2 ].base = msg->pData;
+	iov[ 2 ].len = msg->len;
+
+	memset( sent, 0, sizeof( sent ) );
+	for ( i = 0; i < MQTT_BROKER_MAX_SUBSCRIPTIONS; i++ )
+	{
+		struct mqtt_brokerSubscription* sub = &broker->subscriptions[ i ];
+
+		if ( ( sub->filterLength == 0 ) || ( sent[ sub->client >> 3 ] & ( 1 << ( sub->client & 7 ) ) ) ||
+			 !mqtt_topicMatches( sub->filter, sub->filterLength, msg->topic, msg->topicLength ) )
+		{
+			continue;
+		}
+		sent[ sub->client >> 3 ] |= ( uint8_t )( 1 << ( sub->client & 7 ) );
+
+		target = &broker->clients[ sub->client ];
+		if ( mqtt_brokerWritev( target, iov, ( msg->len > 0 ) ? 3 : 2 ) == MQTT_SUCCESS )
+		{
+			delivered++;
+		}
+		else
+		{
+			target->dropped++;
+		}
+	}
+	return delivered;
+}
+
+// Acknowledgements that cannot be written close the connection, a client that is not reading would
+//   wait for them forever
+static int reply( struct mqtt_brokerClient* client, uint8_t* pPacket, int32_t len )
+{
+	struct mqtt_iovec iov;
+
+	iov.base = pPacket;
+	iov.len = len;
+	return ( mqtt_brokerWritev( client, &iov, 1 ) == MQTT_SUCCESS ) ? MQTT_SUCCESS : MQTT_ERROR;
+}
+
+static int sendAck( struct mqtt_brokerClient* client, uint8_t type, const uint8_t* pPacketId )
+{
+	uint8_t ack[ 4 ];
+
+	ack[ 0 ] = type;
+	ack[ 1 ] = 2;
+	ack[ 2 ] = pPacketId[ 0 ];
+	ack[ 3 ] = pPacketId[ 1 ];
+	return reply( client, ack, sizeof( ack ) );
+}
+
+// The entry holding packetId among the received QoS 2 Packet Identifiers of a client, NULL if there
+//   is none. Pass 0 to find a free entry
+static uint16_t* findReceived( struct mqtt_brokerClient* client, uint16_t packetId )
+{
+	int i;
+
+	for ( i = 0; i < MQTT_BROKER_MAX_RECEIVED_QOS2; i++ )
+	{
+		if ( client->received[ i ] == packetId )
+		{
+			return &client->received[ i ];
+		}
+	}
+	return NULL;
+}
+
+// Stop passing messages to a client that is going away. Its slot stays taken until mqtt_brokerDetach
+static void closeClient( struct mqtt_broker* broker, struct mqtt_brokerClient* client )
+{
+	dropSubscriptions( broker, ( uint8_t )( client - broker->clients ) );
+	client->state = MQTT_BROKER_CLOSING;
+	client->inputLength = 0;
+}
+
+static void dropSubscriptions( struct mqtt_broker* broker, uint8_t index )
+{
+	int i;
+
+	for ( i = 0; i < MQTT_BROKER_MAX_SUBSCRIPTIONS; i++ )
+	{
+		if ( broker->subscriptions[ i ].client == index )
+		{
+			broker->subscriptions[ i ].filterLength = 0;
+		}
+	}
+}
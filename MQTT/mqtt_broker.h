@@ -0,0 +1,121 @@
+/*
+* This file contains the interface of the MQTT broker, the server side of MQTT 3.1.1 for clients on the
+*   local network. It takes in the bytes of every client connection, answers CONNECT, SUBSCRIBE,
+*   UNSUBSCRIBE and PINGREQ, and passes every PUBLISH on to the clients subscribed to its topic, a
+*   QoS 2 message once however often it arrives before its PUBREL. All
+*   memory is static and nothing blocks, so one task can serve every connection from a select loop
+*
+*/
+#ifndef MQTT_BROKER_H
+#define MQTT_BROKER_H
+
+#include <stdint.h>
+
+#include "mqtt.h"
+
+// Client connections one broker can hold
+#ifndef MQTT_BROKER_MAX_CLIENTS
+#define MQTT_BROKER_MAX_CLIENTS 16
+#endif
+
+// Topic Filters all clients together can be subscribed to
+#ifndef MQTT_BROKER_MAX_SUBSCRIPTIONS
+#define MQTT_BROKER_MAX_SUBSCRIPTIONS 64
+#endif
+
+// Longest Topic Filter that can be subscribed to
+#ifndef MQTT_BROKER_FILTER_LENGTH
+#define MQTT_BROKER_FILTER_LENGTH 64
+#endif
+
+// Size of the per-client input buffer. A packet that arrives in pieces is put together in it, so no
+//   client may send a larger packet. Packets that arrive whole are processed where they were received
+#ifndef MQTT_BROKER_INPUT_SIZE
+#define MQTT_BROKER_INPUT_SIZE 512
+#endif
+
+// Inbound QoS 2 messages per client that were passed on but not yet released by the client's PUBREL.
+//   Their Packet Identifiers are remembered so a PUBLISH the client sends again is not passed on a
+//   second time. A client that leaves more of them unreleased is disconnected
+#ifndef MQTT_BROKER_MAX_RECEIVED_QOS2
+#define MQTT_BROKER_MAX_RECEIVED_QOS2 8
+#endif
+
+// Milliseconds a new connection gets to send its CONNECT
+#ifndef MQTT_BROKER_CONNECT_TIMEOUT
+#define MQTT_BROKER_CONNECT_TIMEOUT 10000
+#endif
+
+#if MQTT_BROKER_MAX_CLIENTS > 255
+#error MQTT_BROKER_MAX_CLIENTS must be below 256
+#endif
+#if MQTT_BROKER_FILTER_LENGTH > 255
+#error MQTT_BROKER_FILTER_LENGTH must be below 256
+#endif
+
+// States of a client slot
+#define MQTT_BROKER_FREE       0
+#define MQTT_BROKER_ACCEPTED   1		// Connected, the CONNECT has not arrived yet
+#define MQTT_BROKER_CONNECTED  2
+#define MQTT_BROKER_CLOSING    3		// Shut down by the broker, waiting for mqtt_brokerDetach
+
+// One client connection
+struct mqtt_brokerClient {
+	void*    network_tag;				// Passed in by mqtt_brokerAttach, for the port to find the connection
+	uint8_t  state;
+	char     clientId[ 24 ];			// Null terminated, from CONNECT
+	uint16_t keepalive;					// Seconds, 0 for none
+	uint32_t lastReceive;				// Time of the last packet, in the milliseconds of mqtt_brokerKeepalive
+	uint32_t dropped;					// Messages not passed on because the connection had no room (output)
+	// Received QoS 2 Packet Identifiers (internal), 0 for a free entry
+	uint16_t received[ MQTT_BROKER_MAX_RECEIVED_QOS2 ];
+	// Input Buffer (internal). The start of a packet that has not arrived completely
+	uint8_t  input[ MQTT_BROKER_INPUT_SIZE ];
+	int32_t  inputLength;
+};
+
+// One Topic Filter one client is subscribed to
+struct mqtt_brokerSubscription {
+	uint8_t  client;					// Index into clients
+	uint8_t  filterLength;				// 0 for a free entry
+	char     filter[ MQTT_BROKER_FILTER_LENGTH ];
+};
+
+struct mqtt_broker {
+	struct mqtt_brokerClient clients[ MQTT_BROKER_MAX_CLIENTS ];
+	struct mqtt_brokerSubscription subscriptions[ MQTT_BROKER_MAX_SUBSCRIPTIONS ];
+	uint32_t time;						// Last time passed to mqtt_brokerKeepalive
+	// Optional, called for every PUBLISH a client sends, after it was passed on. topic and pData point
+	//   into a receive buffer, as for mqtt_processPublish. A gateway forwards upstream from here
+	void ( *onPublish )( struct mqtt_broker* broker, struct mqtt_brokerClient* client, struct mqtt_message* msg );
+};
+
+// These functions must be supplied by the application
+// mqtt_brokerWritev must write all fragments back to back or nothing, and never block. It returns
+//   MQTT_SUCCESS once they are written and MQTT_BUSY when the connection has no room for them right now
+int  mqtt_brokerWritev( struct mqtt_brokerClient* client, const struct mqtt_iovec* iov, int count );
+// Close the connection of a client the broker gave up on: a protocol error, a missed keepalive or a
+//   second connection with its ClientID. Call mqtt_brokerDetach once it is closed
+void mqtt_brokerShutdown( struct mqtt_brokerClient* client );
+
+void mqtt_brokerInit( struct mqtt_broker* broker );
+
+// Take on a new connection. Returns NULL if all client slots are taken
+struct mqtt_brokerClient* mqtt_brokerAttach( struct mqtt_broker* broker, void* network_tag );
+
+// Free the slot of a closed connection and drop its subscriptions
+void mqtt_brokerDetach( struct mqtt_broker* broker, struct mqtt_brokerClient* client );
+
+// Hand bytes received from a client to the broker, in chunks of any size. Returns MQTT_ERROR when the
+//   connection has to be closed, after a DISCONNECT or a malformed or refused packet
+int  mqtt_brokerInput( struct mqtt_broker* broker, struct mqtt_brokerClient* client, const uint8_t* data, int32_t len );
+
+// Publish a message of the application itself, for example one that came from upstream, to the
+//   subscribed clients. Returns the number of clients it was passed to
+int  mqtt_brokerPublish( struct mqtt_broker* broker, const char* topic, const uint8_t* pData, int32_t len );
+
+// Call regularly with a free running millisecond count. Clients that sent nothing for one and a half
+//   times their keepalive are shut down
+void mqtt_brokerKeepalive( struct mqtt_broker* broker, uint32_t now );
+
+#endif /* MQTT_BROKER_H */
@@ -0,0 +1,57 @@
+/*
+* This file contains the perfect hash dispatch used for fixed sets of exact topic names.
+*   The table itself is generated at build time by Tools/mqtt_phashgen.c, which picks a seed
+*   so that every topic of the set lands in a slot of its own. Dispatching a message then costs
+*   one hash of the topic, one compare and one call
+*
+*/
+#ifndef MQTT_PHASH_H
+#define MQTT_PHASH_H
+
+#include <string.h>
+#include "mqtt_router.h"
+
+struct mqtt_phashEntry {
+	const char*    topic;				// NULL for an empty slot
+	uint16_t       topicLength;
+	mqtt_routeFn_t fn;
+};
+
+struct mqtt_phashTable {
+	uint32_t seed;
+	uint32_t mask;						// Number of slots - 1, the slot count is a power of two
+	const struct mqtt_phashEntry* slots;
+};
+
+// Seeded FNV-1a, the generator uses this same function so both sides agree on the slots
+static __inline uint32_t mqtt_phash( uint32_t seed, const char* topic, uint16_t topicLength )
+{
+	uint32_t hash = 2166136261UL ^ seed;
+	uint16_t i;
+
+	for ( i = 0; i < topicLength; i++ )
+	{
+		hash ^= ( uint8_t )topic[ i ];
+		hash *= 16777619UL;
+	}
+
+	return hash ^ ( hash >> 16 );
+}
+
+// Call the handler of the topic of msg. Returns MQTT_ERROR if the topic is not in the table, so the
+//   caller can fall back to the router for anything outside the fixed set
+static __inline int mqtt_phashDispatch( const struct mqtt_phashTable* table, struct mqtt_message* msg )
+{
+	const struct mqtt_phashEntry* entry = &table->slots[ mqtt_phash( table->seed, msg->topic, msg->topicLength ) & table->mask ];
+
+	if ( ( entry->topicLength != msg->topicLength ) || ( entry->topic == NULL ) ||
+		 ( memcmp( entry->topic, msg->topic, msg->topicLength ) != 0 ) )
+	{
+		return MQTT_ERROR;
+	}
+
+	entry->fn( msg );
+	return MQTT_SUCCESS;
+}
+
+#endif /* MQTT_PHASH_H */
@@ -0,0 +1,113 @@
+/*
+* This file contains the codec for the Remaining Length of the MQTT fixed header, a Variable Byte
+*   Integer of 1 to 4 bytes with 7 bits each, least significant first. MQTT 5 uses the same
+*   encoding for property lengths. Every length takes one compare per byte instead of a division
+*
+*/
+#ifndef MQTT_RLENGTH_H
+#define MQTT_RLENGTH_H
+
+#include <stdint.h>
+
+// Largest length that can be encoded, 4 bytes of 7 bits
+#define MQTT_MAX_REMAINING_LENGTH    268435455L
+
+// Write length, which must not be larger than MQTT_MAX_REMAINING_LENGTH, to pDestination and
+//   return a pointer to the byte after it
+static __inline uint8_t* mqtt_encodeRemainingLength( uint8_t* pDestination, int32_t length )
+{
+	if ( length < 128L )
+	{
+		pDestination[ 0 ] = ( uint8_t )length;
+		return pDestination + 1;
+	}
+	pDestination[ 0 ] = ( uint8_t )( length | 0x80 );
+	if ( length < 16384L )
+	{
+		pDestination[ 1 ] = ( uint8_t )( length >> 7 );
+		return pDestination + 2;
+	}
+	pDestination[ 1 ] = ( uint8_t )( ( length >> 7 ) | 0x80 );
+	if ( length < 2097152L )
+	{
+		pDestination[ 2 ] = ( uint8_t )( length >> 14 );
+		return pDestination + 3;
+	}
+	pDestination[ 2 ] = ( uint8_t )( ( length >> 14 ) | 0x80 );
+	pDestination[ 3 ] = ( uint8_t )( length >> 21 );
+	return pDestination + 4;
+}
+
+// Number of bytes length takes when encoded
+static __inline int32_t mqtt_remainingLengthSize( int32_t length )
+{
+	return 1 + ( length >= 128L ) + ( length >= 16384L ) + ( length >= 2097152L );
+}
+
+// Decode a length from the first available bytes of pData. Returns the number of bytes it took,
+//   0 if it runs past available and -1 if it is longer than 4 bytes. *pValue is only written
+//   when the length is complete
+static __inline int32_t mqtt_decodeRemainingLength( const uint8_t* pData, int32_t available, int32_t* pValue )
+{
+	int32_t value;
+
+	if ( available < 1 )
+	{
+		return 0;
+	}
+	value = pData[ 0 ];
+	if ( value < 0x80 )
+	{
+		*pValue = value;
+		return 1;
+	}
+
+	if ( available < 2 )
+	{
+		return 0;
+	}
+	value = ( value & 0x7F ) | ( ( int32_t )pData[ 1 ] << 7 );
+	if ( pData[ 1 ] < 0x80 )
+	{
+		*pValue = value;
+		return 2;
+	}
+
+	if ( available < 3 )
+	{
+		return 0;
+	}
+	value = ( value & 0x3FFF ) | ( ( int32_t )pData[ 2 ] << 14 );
+	if ( pData[ 2 ] < 0x80 )
+	{
+		*pValue = value;
+		return 3;
+	}
+
+	if ( available < 4 )
+	{
+		return 0;
+	}
+	if ( pData[ 3 ] >= 0x80 )
+	{
+		return -1;
+	}
+	*pValue = ( value & 0x1FFFFF ) | ( ( int32_t )pData[ 3 ] << 21 );
+	return 4;
+}
+
+// Add the next byte of a length that arrives one byte at a time. *pValue and *pShift start at 0.
+//   Returns 1 once the length is complete in *pValue, 0 if another byte follows and -1 if it is
+//   longer than 4 bytes
+static __inline int mqtt_decodeRemainingLengthByte( int32_t* pValue, uint8_t* pShift, uint8_t value )
+{
+	*pValue |= ( int32_t )( value & 0x7F ) << *pShift;
+	if ( value < 0x80 )
+	{
+		return 1;
+	}
+	*pShift += 7;
+	return ( *pShift < 28 ) ? 0 : -1;
+}
+
+#endif /* MQTT_RLENGTH_H */
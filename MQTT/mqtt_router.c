@@ -0,0 +1,305 @@
+/*
+* This file implements the topic router. Filters are compiled into a trie with one node per topic
+*   level, '+' and '#' get their own links so matching a topic walks the trie level by level. The
+*   exact children of every node sit in one hash table keyed by parent and level, so each level is
+*   one lookup however many filters share it. The Topic Name and Filter checks and the match of a
+*   single filter live here as well, for the broker
+*
+*/
+#include <string.h>
+#include "mqtt_router.h"
+
+static int16_t newNode( struct mqtt_router* router, const char* level, uint16_t levelLength );
+static uint32_t levelHash( int16_t parent, const char* level, int32_t levelLength );
+static int16_t findChild( struct mqtt_router* router, int16_t parent, const char* level, int32_t levelLength );
+static int16_t addChild( struct mqtt_router* router, int16_t parent, const char* level, uint16_t levelLength );
+static int routeFrom( struct mqtt_router* router, int16_t index, const char* topic, int32_t length, int atEnd, int exactOnly, struct mqtt_message* msg );
+
+
+void mqtt_routerInit( struct mqtt_router* router )
+{
+	int i;
+
+	router->count = 0;
+	for ( i = 0; i < MQTT_ROUTER_HASH_SIZE; i++ )
+	{
+		router->children[ i ] = -1;
+	}
+	newNode( router, "", 0 );
+}
+
+int mqtt_routerAdd( struct mqtt_router* router, const char* topicFilter, mqtt_routeFn_t fn )
+{
+	int16_t index = 0, child;
+	const char* level = topicFilter;
+	uint16_t levelLength;
+
+	if ( !mqtt_validTopicFilter( topicFilter, ( int32_t )strlen( topicFilter ) ) )
+	{
+		return MQTT_ERROR;
+	}
+
+	for ( ;; )
+	{
+		levelLength = 0;
+		while ( ( level[ levelLength ] != '/' ) && ( level[ levelLength ] != '\0' ) )
+		{
+			levelLength++;
+		}
+
+		if ( ( levelLength == 1 ) && ( level[ 0 ] == '#' ) )
+		{
+			// Multi-level wildcard, the filter was checked to end here
+			router->nodes[ index ].hashFn = fn;
+			return MQTT_SUCCESS;
+		}
+
+		if ( ( levelLength == 1 ) && ( level[ 0 ] == '+' ) )
+		{
+			child = router->nodes[ index ].plus;
+			if ( child < 0 )
+			{
+				child = newNode( router, level, levelLength );
+				if ( child < 0 )
+				{
+					return MQTT_ERROR;
+				}
+				router->nodes[ index ].plus = child;
+			}
+		}
+		else
+		{
+			child = findChild( router, index, level, levelLength );
+			if ( child < 0 )
+			{
+				child = addChild( router, index, level, levelLength );
+				if ( child < 0 )
+				{
+					return MQTT_ERROR;
+				}
+			}
+		}
+
+		index = child;
+		if ( level[ levelLength ] == '\0' )
+		{
+			router->nodes[ index ].fn = fn;
+			return MQTT_SUCCESS;
+		}
+		level += levelLength + 1;
+	}
+}
+
+int mqtt_routerDispatch( struct mqtt_router* router, struct mqtt_message* msg )
+{
+	if ( router->count == 0 )
+	{
+		return 0;
+	}
+
+	// Wildcards in the first level do not match topics starting with '$', see MQTT 3.1.1 section 4.7.2
+	return routeFrom( router, 0, msg->topic, msg->topicLength, 0, ( msg->topicLength > 0 ) && ( msg->topic[ 0 ] == '$' ), msg );
+}
+
+// Match the remaining topic levels against the trie below node index. atEnd is set once every
+//   level of the topic has been matched, exactOnly to pass over the wildcards of this node
+static int routeFrom( struct mqtt_router* router, int16_t index, const char* topic, int32_t length, int atEnd, int exactOnly, struct mqtt_message* msg )
+{
+	struct mqtt_routeNode* node = &router->nodes[ index ];
+	int32_t levelLength = 0;
+	int16_t child;
+	int matches = 0;
+
+	// A '#' below this node matches everything that is left, even nothing ("a/#" matches "a")
+	if ( ( node->hashFn != NULL ) && !exactOnly )
+	{
+		node->hashFn( msg );
+		matches++;
+	}
+
+	if ( atEnd )
+	{
+		if ( node->fn != NULL )
+		{
+			node->fn( msg );
+			matches++;
+		}
+		return matches;
+	}
+
+	while ( ( levelLength < length ) && ( topic[ levelLength ] != '/' ) )
+	{
+		levelLength++;
+	}
+
+	child = findChild( router, index, topic, levelLength );
+	if ( child >= 0 )
+	{
+		matches += routeFrom( router, child, topic + levelLength + 1, length - levelLength - 1, levelLength == length, 0, msg );
+	}
+
+	if ( ( node->plus >= 0 ) && !exactOnly )
+	{
+		matches += routeFrom( router, node->plus, topic + levelLength + 1, length - levelLength - 1, levelLength == length, 0, msg );
+	}
+
+	return matches;
+}
+
+int mqtt_validTopicName( const char* topic, int32_t length )
+{
+	int32_t i;
+
+	if ( length == 0 )
+	{
+		return 0;
+	}
+	for ( i = 0; i < length; i++ )
+	{
+		if ( ( topic[ i ] == '+' ) || ( topic[ i ] == '#' ) || ( topic[ i ] == '\0' ) )
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int mqtt_validTopicFilter( const char* filter, int32_t length )
+{
+	int32_t i;
+
+	if ( length == 0 )
+	{
+		return 0;
+	}
+	for ( i = 0; i < length; i++ )
+	{
+		if ( filter[ i ] == '\0' )
+		{
+			return 0;
+		}
+		if ( ( filter[ i ] == '+' ) || ( filter[ i ] == '#' ) )
+		{
+			if ( ( ( i > 0 ) && ( filter[ i - 1 ] != '/' ) ) ||
+				 ( ( filter[ i ] == '+' ) && ( i + 1 < length ) && ( filter[ i + 1 ] != '/' ) ) ||
+				 ( ( filter[ i ] == '#' ) && ( i + 1 != length ) ) )
+			{
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+int mqtt_topicMatches( const char* filter, int32_t filterLength, const char* topic, int32_t topicLength )
+{
+	int32_t f = 0, t = 0;
+
+	if ( ( topicLength > 0 ) && ( topic[ 0 ] == '$' ) && ( ( filter[ 0 ] == '+' ) || ( filter[ 0 ] == '#' ) ) )
+	{
+		return 0;
+	}
+
+	while ( f < filterLength )
+	{
+		if ( filter[ f ] == '#' )
+		{
+			return 1;
+		}
+		if ( filter[ f ] == '+' )
+		{
+			while ( ( t < topicLength ) && ( topic[ t ] != '/' ) )
+			{
+				t++;
+			}
+			f++;
+			continue;
+		}
+		if ( t == topicLength )
+		{
+			// "a/#" matches "a" as well
+			return ( f + 2 == filterLength ) && ( filter[ f ] == '/' ) && ( filter[ f + 1 ] == '#' );
+		}
+		if ( filter[ f ] != topic[ t ] )
+		{
+			return 0;
+		}
+		f++;
+		t++;
+	}
+	return t == topicLength;
+}
+
+static int16_t newNode( struct mqtt_router* router, const char* level, uint16_t levelLength )
+{
+	struct mqtt_routeNode* node;
+
+	if ( router->count >= MQTT_ROUTER_MAX_NODES )
+	{
+		return -1;
+	}
+
+	node = &router->nodes[ router->count ];
+	memset( node, 0, sizeof( *node ) );
+	node->level = level;
+	node->levelLength = levelLength;
+	node->parent = -1;
+	node->plus = -1;
+
+	return router->count++;
+}
+
+// FNV-1a over the parent and the level, so the same level under different parents lands apart
+static uint32_t levelHash( int16_t parent, const char* level, int32_t levelLength )
+{
+	uint32_t hash = 2166136261UL;
+	int32_t i;
+
+	hash = ( hash ^ ( uint8_t )parent ) * 16777619UL;
+	hash = ( hash ^ ( uint8_t )( parent >> 8 ) ) * 16777619UL;
+	for ( i = 0; i < levelLength; i++ )
+	{
+		hash = ( hash ^ ( uint8_t )level[ i ] ) * 16777619UL;
+	}
+	return hash;
+}
+
+// Exact-match child of parent for level, -1 if there is none. The table always has free slots, so
+//   the probe ends at one
+static int16_t findChild( struct mqtt_router* router, int16_t parent, const char* level, int32_t levelLength )
+{
+	uint32_t slot = levelHash( parent, level, levelLength ) & ( MQTT_ROUTER_HASH_SIZE - 1 );
+	struct mqtt_routeNode* node;
+	int16_t child;
+
+	while ( ( child = router->children[ slot ] ) >= 0 )
+	{
+		node = &router->nodes[ child ];
+		if ( ( node->parent == parent ) && ( node->levelLength == levelLength ) &&
+			 ( memcmp( node->level, level, levelLength ) == 0 ) )
+		{
+			return child;
+		}
+		slot = ( slot + 1 ) & ( MQTT_ROUTER_HASH_SIZE - 1 );
+	}
+	return -1;
+}
+
+static int16_t addChild( struct mqtt_router* router, int16_t parent, const char* level, uint16_t levelLength )
+{
+	uint32_t slot = levelHash( parent, level, levelLength ) & ( MQTT_ROUTER_HASH_SIZE - 1 );
+	int16_t child = newNode( router, level, levelLength );
+
+	if ( child < 0 )
+	{
+		return -1;
+	}
+	router->nodes[ child ].parent = parent;
+
+	while ( router->children[ slot ] >= 0 )
+	{
+		slot = ( slot + 1 ) & ( MQTT_ROUTER_HASH_SIZE - 1 );
+	}
+	router->children[ slot ] = child;
+	return child;
+}
@@ -0,0 +1,75 @@
+/*
+* This file contains the interface of the topic router, which dispatches inbound PUBLISH
+*   messages to handlers by MQTT Topic Filter, wildcards included
+*
+*/
+#ifndef MQTT_ROUTER_H
+#define MQTT_ROUTER_H
+
+#include "mqtt.h"
+
+// Number of trie nodes available to each router. Every distinct topic level of every filter
+//   added takes one node, plus one for the root
+#ifndef MQTT_ROUTER_MAX_NODES
+#define MQTT_ROUTER_MAX_NODES 64
+#endif
+
+// Slots of the hash table that finds the exact child of a node by its level, a power of two. Keep it
+//   at twice the nodes or more so lookups stay short
+#ifndef MQTT_ROUTER_HASH_SIZE
+#define MQTT_ROUTER_HASH_SIZE ( 2 * MQTT_ROUTER_MAX_NODES )
+#endif
+
+#if ( MQTT_ROUTER_HASH_SIZE & ( MQTT_ROUTER_HASH_SIZE - 1 ) ) != 0
+#error MQTT_ROUTER_HASH_SIZE must be a power of two
+#endif
+#if MQTT_ROUTER_HASH_SIZE <= MQTT_ROUTER_MAX_NODES
+#error MQTT_ROUTER_HASH_SIZE must be larger than MQTT_ROUTER_MAX_NODES
+#endif
+
+// Handler called for every message whose topic matches the filter it was added with
+typedef void (*mqtt_routeFn_t)( struct mqtt_message* msg );
+
+// One topic level of the trie
+struct mqtt_routeNode {
+	const char*    level;				// Topic level matched by this node, points into the filter string
+	uint16_t       levelLength;
+	int16_t        parent;				// Node this one is an exact-match child of, -1 for the root and '+'
+	int16_t        plus;				// Child for the '+' wildcard, -1 if none
+	mqtt_routeFn_t fn;					// Handler for filters that end at this node
+	mqtt_routeFn_t hashFn;				// Handler for a '#' filter level below this node
+};
+
+struct mqtt_router {
+	struct mqtt_routeNode nodes[ MQTT_ROUTER_MAX_NODES ];	// nodes[ 0 ] is the root
+	int16_t count;
+	// Exact-match children of all nodes, hashed by parent and level. Node index or -1 for a free slot
+	int16_t children[ MQTT_ROUTER_HASH_SIZE ];
+};
+
+void mqtt_routerInit( struct mqtt_router* router );
+
+// Route messages matching topicFilter to fn. The filter string is referenced, not copied, so it must
+//   stay valid for as long as the router is in use. Returns MQTT_ERROR if the filter is malformed
+//   or the router is out of nodes
+int mqtt_routerAdd( struct mqtt_router* router, const char* topicFilter, mqtt_routeFn_t fn );
+
+// Call the handler of every filter that matches the topic of msg and return how many were called.
+//   Every level of the topic is one hash lookup, so the cost depends on the depth of the topic and
+//   the wildcards on its way, not on how many filters share a level. The router is only read,
+//   handlers may dispatch again
+int mqtt_routerDispatch( struct mqtt_router* router, struct mqtt_message* msg );
+
+// Topic Names must not be empty nor contain wildcards, see MQTT 3.1.1 section 4.7.3
+int mqtt_validTopicName( const char* topic, int32_t length );
+
+// Topic Filters must not be empty, '+' must take a whole level and '#' the last one, see MQTT 3.1.1
+//   section 4.7.1
+int mqtt_validTopicFilter( const char* filter, int32_t length );
+
+// Match one topic against one valid filter, by the same rules as mqtt_routerDispatch: wildcards in the
+//   first level do not match topics starting with '$' and "a/#" matches "a" as well. For filters that
+//   come and go, like the subscriptions of a broker, where building a trie does not pay
+int mqtt_topicMatches( const char* filter, int32_t filterLength, const char* topic, int32_t topicLength );
+
+#endif /* MQTT_ROUTER_H */
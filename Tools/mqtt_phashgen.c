@@ -0,0 +1,211 @@
+/*
+* Generator for MQTT/mqtt_phash.h tables. This is a host tool, it is not part of the firmware.
+*
+* Reads lines of the form "<topic> <handler>" from stdin and writes a header to stdout that
+*   declares the handlers and defines a struct mqtt_phashTable named after the first argument.
+*   Blank lines and lines starting with '#' are ignored. Any other line that is not a topic and a C
+*   identifier, and more than MAX_TOPICS topics, stop the generator with an error and exit code 1.
+*   The Visual Studio project runs it as a custom build step on mqtt_routes.txt, by hand:
+*
+*   gcc -O2 -I. -IMQTT Tools/mqtt_phashgen.c -o mqtt_phashgen
+*   ./mqtt_phashgen mqtt_staticRoutes < mqtt_routes.txt > mqtt_routes.h
+*
+*/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MQTT/mqtt_phash.h"
+
+#define MAX_TOPICS 1024
+#define MAX_LINE   256
+
+struct route {
+	char topic[ MAX_LINE ];
+	char handler[ MAX_LINE ];
+	uint16_t topicLength;
+};
+
+static struct route routes[ MAX_TOPICS ];
+static int slotOf[ MAX_TOPICS * 8 ];
+
+// Handlers are declared and referenced by name, so they must be C identifiers
+static int validIdentifier( const char* name )
+{
+	if ( !isalpha( ( unsigned char )name[ 0 ] ) && ( name[ 0 ] != '_' ) )
+	{
+		return 0;
+	}
+	for ( name++; *name != '\0'; name++ )
+	{
+		if ( !isalnum( ( unsigned char )*name ) && ( *name != '_' ) )
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Write a topic as a C string literal. Quotes, backslashes and all bytes that are not printable
+//   ASCII are written as three digit octal escapes, which never run into the next character
+static void printTopic( const char* topic )
+{
+	const unsigned char* pByte;
+
+	putchar( '"' );
+	for ( pByte = ( const unsigned char* )topic; *pByte != '\0'; pByte++ )
+	{
+		if ( ( *pByte < 0x20 ) || ( *pByte > 0x7E ) || ( *pByte == '"' ) || ( *pByte == '\\' ) || ( *pByte == '?' ) )
+		{
+			printf( "\\%03o", *pByte );
+		}
+		else
+		{
+			putchar( *pByte );
+		}
+	}
+	putchar( '"' );
+}
+
+// Try seeds until every topic hashes to its own slot. Returns 1 and fills slotOf on success
+static int findSeed( int count, uint32_t slots, uint32_t* seed )
+{
+	uint32_t attempt;
+	int i;
+
+	for ( attempt = 0; attempt < 1000000UL; attempt++ )
+	{
+		for ( i = 0; i < ( int )slots; i++ )
+		{
+			slotOf[ i ] = -1;
+		}
+		for ( i = 0; i < count; i++ )
+		{
+			uint32_t slot = mqtt_phash( attempt, routes[ i ].topic, routes[ i ].topicLength ) & ( slots - 1 );
+			if ( slotOf[ slot ] >= 0 )
+			{
+				break;
+			}
+			slotOf[ slot ] = i;
+		}
+		if ( i == count )
+		{
+			*seed = attempt;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int main( int argc, char** argv )
+{
+	char line[ MAX_LINE * 2 ];
+	char topic[ MAX_LINE ], handler[ MAX_LINE ], extra[ 2 ];
+	const char* name = ( argc > 1 ) ? argv[ 1 ] : "mqtt_staticRoutes";
+	uint32_t slots = 1, seed = 0;
+	int count = 0, lineNumber = 0, fields, i, j;
+
+	if ( !validIdentifier( name ) )
+	{
+		fprintf( stderr, "%s: the table name must be a C identifier\n", name );
+		return 1;
+	}
+
+	while ( fgets( line, sizeof( line ), stdin ) != NULL )
+	{
+		lineNumber++;
+		if ( ( strchr( line, '\n' ) == NULL ) && !feof( stdin ) )
+		{
+			fprintf( stderr, "line %d: longer than %d characters\n", lineNumber, ( int )sizeof( line ) - 2 );
+			return 1;
+		}
+
+		// Topics and handlers longer than the buffers spill over into a third field
+		fields = sscanf( line, "%255s %255s %1s", topic, handler, extra );
+		if ( ( fields <= 0 ) || ( topic[ 0 ] == '#' ) )
+		{
+			continue;
+		}
+		if ( fields != 2 )
+		{
+			fprintf( stderr, "line %d: expected \"<topic> <handler>\"\n", lineNumber );
+			return 1;
+		}
+		if ( strpbrk( topic, "+#" ) != NULL )
+		{
+			fprintf( stderr, "line %d: %s: wildcards are not allowed, use the router for filters\n", lineNumber, topic );
+			return 1;
+		}
+		if ( !validIdentifier( handler ) )
+		{
+			fprintf( stderr, "line %d: %s: the handler must be a C identifier\n", lineNumber, handler );
+			return 1;
+		}
+		for ( j = 0; j < count; j++ )
+		{
+			if ( strcmp( routes[ j ].topic, topic ) == 0 )
+			{
+				fprintf( stderr, "line %d: %s: duplicate topic\n", lineNumber, topic );
+				return 1;
+			}
+		}
+		if ( count == MAX_TOPICS )
+		{
+			fprintf( stderr, "line %d: more than %d topics, raise MAX_TOPICS\n", lineNumber, MAX_TOPICS );
+			return 1;
+		}
+
+		strcpy( routes[ count ].topic, topic );
+		strcpy( routes[ count ].handler, handler );
+		routes[ count ].topicLength = ( uint16_t )strlen( topic );
+		count++;
+	}
+
+	// Start with the smallest power of two that holds all topics and double until a seed is found
+	while ( slots < ( uint32_t )count )
+	{
+		slots <<= 1;
+	}
+	while ( !findSeed( count, slots, &seed ) )
+	{
+		if ( slots >= MAX_TOPICS * 8 )
+		{
+			fprintf( stderr, "No collision free seed found\n" );
+			return 1;
+		}
+		slots <<= 1;
+	}
+
+	printf( "/*\n* Generated by Tools/mqtt_phashgen.c, do not edit\n*\n*/\n" );
+	printf( "#include \"MQTT/mqtt_phash.h\"\n\n" );
+	for ( i = 0; i < count; i++ )
+	{
+		for ( j = 0; ( j < i ) && ( strcmp( routes[ j ].handler, routes[ i ].handler ) != 0 ); j++ )
+		{
+		}
+		if ( j == i )
+		{
+			printf( "void %s( struct mqtt_message* msg );\n", routes[ i ].handler );
+		}
+	}
+
+	printf( "\nstatic const struct mqtt_phashEntry %s_slots[ %lu ] = {\n", name, ( unsigned long )slots );
+	for ( i = 0; i < ( int )slots; i++ )
+	{
+		if ( slotOf[ i ] < 0 )
+		{
+			printf( "\t{ NULL, 0, NULL },\n" );
+		}
+		else
+		{
+			printf( "\t{ " );
+			printTopic( routes[ slotOf[ i ] ].topic );
+			printf( ", %u, %s },\n", routes[ slotOf[ i ] ].topicLength, routes[ slotOf[ i ] ].handler );
+		}
+	}
+	printf( "};\n\nstatic const struct mqtt_phashTable %s = { %luUL, %luUL, %s_slots };\n",
+		name, ( unsigned long )seed, ( unsigned long )( slots - 1 ), name );
+
+	return 0;
+}
@@ -17,6 +17,8 @@
 #include "FreeRTOS_IP.h"
 #include "FreeRTOS_Sockets.h"
 #include "TCPEchoClient_SingleTasks.h"
+#include "MQTTMultiClient_SingleTask.h"
+#include "MQTTBroker_SingleTask.h"
 #include "demo_logging.h"
 
 #include "myconfig.h"
@@ -106,6 +108,18 @@ void vApplicationIPNetworkEventHook( eIPCallbackEvent_t eNetworkEvent )
 			}
 			#endif /* mainCREATE_TCP_ECHO_TASKS_SINGLE */
 
+			#if( mainCREATE_MQTT_MULTI_CLIENT_TASK == 1 )
+			{
+				vStartMQTTMultiClientTask( mainECHO_CLIENT_TASK_STACK_SIZE, mainECHO_CLIENT_TASK_PRIORITY );
+			}
+			#endif /* mainCREATE_MQTT_MULTI_CLIENT_TASK */
+
+			#if( mainCREATE_MQTT_BROKER_TASK == 1 )
+			{
+				vStartMQTTBrokerTask( mainECHO_CLIENT_TASK_STACK_SIZE, mainECHO_CLIENT_TASK_PRIORITY );
+			}
+			#endif /* mainCREATE_MQTT_BROKER_TASK */
+
 			xTasksAlreadyCreated = pdTRUE;
 		}
 
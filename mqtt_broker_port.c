@@ -0,0 +1,205 @@
+/*
+* This file serves the MQTT broker to clients on the local network from a FreeRTOS+TCP listen socket,
+*   see mqtt_brokerListen() in mqtt_port.h
+*
+*/
+/* FreeRTOS includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* FreeRTOS+TCP includes. */
+#include "FreeRTOS_IP.h"
+#include "FreeRTOS_Sockets.h"
+#include "FreeRTOS_IP_Private.h"
+#include "FreeRTOS_Stream_Buffer.h"
+
+#include "mqtt_port.h"
+#include "MQTT/mqtt_broker.h"
+
+#if (ipconfigSUPPORT_SELECT_FUNCTION == 1)
+/* The listen socket and every client socket sit in one socket set and the task waits for any of them
+ *   in FreeRTOS_select(). Received bytes are handed to mqtt_brokerInput() straight from the rx stream
+ *   of the socket, and a PUBLISH is copied from there into the tx stream of every subscriber, so a
+ *   message is never copied inside the broker. The network_tag of a client is its Socket_t.
+ */
+static Socket_t xListenSocket = FREERTOS_INVALID_SOCKET;
+static SocketSet_t xBrokerSocketSet = NULL;
+
+/* Write one packet to a client without blocking, all of it or nothing. The task that fans out a PUBLISH
+ *   must not wait for one slow subscriber, so when the tx stream has no room the packet is dropped.
+ */
+int  mqtt_brokerWritev(struct mqtt_brokerClient* client, const struct mqtt_iovec* iov, int count)
+{
+	FreeRTOS_Socket_t* pxSocket = (FreeRTOS_Socket_t*)client->network_tag;
+	int32_t xTotal = 0;
+	BaseType_t xGathered = pdFALSE;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		xTotal += iov[i].len;
+	}
+
+	vTaskSuspendAll();
+	{
+		if ((pxSocket->u.xTCP.txStream != NULL) &&
+			(pxSocket->u.xTCP.ucTCPState == eESTABLISHED) &&
+			(FreeRTOS_tx_space(pxSocket) >= xTotal))
+		{
+			for (i = 0; i < count; i++)
+			{
+				uxStreamBufferAdd(pxSocket->u.xTCP.txStream, 0ul, iov[i].base, (size_t)iov[i].len);
+			}
+			xGathered = pdTRUE;
+		}
+	}
+	xTaskResumeAll();
+
+	if (xGathered == pdFALSE)
+	{
+		/* The tx stream is only created with the first send, FreeRTOS_send() of nothing would not do it. */
+		if ((pxSocket->u.xTCP.txStream == NULL) && (pxSocket->u.xTCP.ucTCPState == eESTABLISHED))
+		{
+			for (i = 0; i < count; i++)
+			{
+				if (FreeRTOS_send((Socket_t)pxSocket, iov[i].base, iov[i].len, FREERTOS_MSG_DONTWAIT) != iov[i].len)
+				{
+					return MQTT_ERROR;
+				}
+			}
+			return MQTT_SUCCESS;
+		}
+		return MQTT_BUSY;
+	}
+
+	/* Let the IP task know there is data to send, the same way FreeRTOS_send() does. */
+	pxSocket->u.xTCP.usTimeout = 1u;
+	xSendEventToIPTask(eTCPTimerEvent);
+	return MQTT_SUCCESS;
+}
+
+/* The socket reports eSELECT_EXCEPT once it is closed, mqtt_brokerService() closes it then. */
+void mqtt_brokerShutdown(struct mqtt_brokerClient* client)
+{
+	FreeRTOS_shutdown((Socket_t)client->network_tag, FREERTOS_SHUT_RDWR);
+}
+
+int  mqtt_brokerListen(struct mqtt_broker* broker, uint16_t usPort)
+{
+	struct freertos_sockaddr xAddress;
+	static const TickType_t xNoWait = 0;
+
+	mqtt_brokerInit(broker);
+
+	xBrokerSocketSet = FreeRTOS_CreateSocketSet();
+	if (xBrokerSocketSet == NULL)
+	{
+		return MQTT_ERROR;
+	}
+
+	xListenSocket = FreeRTOS_socket(FREERTOS_AF_INET, FREERTOS_SOCK_STREAM, FREERTOS_IPPROTO_TCP);
+	if (xListenSocket == FREERTOS_INVALID_SOCKET)
+	{
+		return MQTT_ERROR;
+	}
+	FreeRTOS_setsockopt(xListenSocket, 0, FREERTOS_SO_RCVTIMEO, &xNoWait, sizeof(xNoWait));
+
+	xAddress.sin_port = FreeRTOS_htons(usPort);
+	xAddress.sin_addr = 0;
+	if ((FreeRTOS_bind(xListenSocket, &xAddress, sizeof(xAddress)) != 0) ||
+		(FreeRTOS_listen(xListenSocket, mqttportBROKER_BACKLOG) != 0))
+	{
+		FreeRTOS_closesocket(xListenSocket);
+		xListenSocket = FREERTOS_INVALID_SOCKET;
+		return MQTT_ERROR;
+	}
+
+	FreeRTOS_FD_SET(xListenSocket, xBrokerSocketSet, eSELECT_READ);
+	return MQTT_SUCCESS;
+}
+
+static void prvCloseClient(struct mqtt_broker* broker, struct mqtt_brokerClient* client)
+{
+	Socket_t xSocket = (Socket_t)client->network_tag;
+
+	FreeRTOS_FD_CLR(xSocket, xBrokerSocketSet, eSELECT_ALL);
+	mqtt_brokerDetach(broker, client);
+	FreeRTOS_closesocket(xSocket);
+}
+
+int  mqtt_brokerService(struct mqtt_broker* broker, TickType_t xBlockTime)
+{
+	struct mqtt_brokerClient* client;
+	struct freertos_sockaddr xAddress;
+	socklen_t xAddressLength = sizeof(xAddress);
+	Socket_t xSocket;
+	EventBits_t xBits;
+	BaseType_t xCount;
+	uint8_t* pucData;
+	int i, lost = 0;
+
+	/* Wake up often enough to notice clients that went quiet. */
+	if (xBlockTime > pdMS_TO_TICKS(mqttportBROKER_CHECK_PERIOD_MS))
+	{
+		xBlockTime = pdMS_TO_TICKS(mqttportBROKER_CHECK_PERIOD_MS);
+	}
+	mqtt_brokerKeepalive(broker, (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS));
+
+	if ((xBrokerSocketSet == NULL) || (FreeRTOS_select(xBrokerSocketSet, xBlockTime) == 0))
+	{
+		return lost;
+	}
+
+	/* Take on every new connection the backlog holds, those beyond the last client slot are closed. */
+	if (FreeRTOS_FD_ISSET(xListenSocket, xBrokerSocketSet) & eSELECT_READ)
+	{
+		while (((xSocket = FreeRTOS_accept(xListenSocket, &xAddress, &xAddressLength)) != NULL) &&
+			(xSocket != FREERTOS_INVALID_SOCKET))
+		{
+			client = mqtt_brokerAttach(broker, (void*)xSocket);
+			if (client == NULL)
+			{
+				FreeRTOS_debug_printf(("Broker : no room for another client\r\n"));
+				FreeRTOS_closesocket(xSocket);
+				continue;
+			}
+			FreeRTOS_FD_SET(xSocket, xBrokerSocketSet, eSELECT_READ | eSELECT_EXCEPT);
+		}
+	}
+
+	for (i = 0; i < MQTT_BROKER_MAX_CLIENTS; i++)
+	{
+		client = &broker->clients[i];
+		if (client->state == MQTT_BROKER_FREE)
+		{
+			continue;
+		}
+
+		xSocket = (Socket_t)client->network_tag;
+		xBits = FreeRTOS_FD_ISSET(xSocket, xBrokerSocketSet);
+		xCount = 0;
+
+		/* A PUBLISH that arrived whole is passed on from right here, before the rx stream is released. */
+		if (xBits & eSELECT_READ)
+		{
+			while ((xCount = FreeRTOS_recv(xSocket, &pucData, ipconfigTCP_MSS * 4, FREERTOS_ZERO_COPY | FREERTOS_MSG_DONTWAIT)) > 0)
+			{
+				if ((client->state != MQTT_BROKER_CLOSING) &&
+					(mqtt_brokerInput(broker, client, pucData, (int32_t)xCount) == MQTT_ERROR))
+				{
+					FreeRTOS_shutdown(xSocket, FREERTOS_SHUT_RDWR);
+				}
+				FreeRTOS_recv(xSocket, NULL, xCount, 0);
+			}
+		}
+
+		if ((xBits & eSELECT_EXCEPT) || (xCount < 0))
+		{
+			prvCloseClient(broker, client);
+			lost++;
+		}
+	}
+
+	return lost;
+}
+#endif /* ipconfigSUPPORT_SELECT_FUNCTION */
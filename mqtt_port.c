@@ -1,146 +1,413 @@
 /* FreeRTOS includes. */
 #include "FreeRTOS.h"
 #include "task.h"
+#include "timers.h"
 
 /* FreeRTOS+TCP includes. */
 #include "FreeRTOS_IP.h"
 #include "FreeRTOS_Sockets.h"
+#include "FreeRTOS_IP_Private.h"
+#include "FreeRTOS_Stream_Buffer.h"
 
-#include "MQTT/mqtt.h"
+#include "mqtt_port.h"
+#include "MQTT/mqtt_router.h"
+
+/* Exact topic names in mqtt_routes.txt are dispatched through a generated perfect hash table before
+ *    the router is consulted. Set to 0 to route everything through the router.
+ */
+#ifndef MQTT_STATIC_ROUTES
+#define MQTT_STATIC_ROUTES 1
+#endif
+
+#if MQTT_STATIC_ROUTES
+#include "mqtt_routes.h"
+#endif
 
 /*-----------------------------------------------------------*/
-int  mqtt_write(struct mqtt_context* mqtt, uint8_t* ptr, int32_t len)
+/* Write all fragments of one MQTT packet to the socket.
+ * When the whole packet fits, the fragments are copied straight into the socket's tx stream
+ *   while the scheduler is suspended, so the IP task only ever sees complete packets and a
+ *   single wake-up is sent for the lot. Otherwise we fall back to a blocking send per fragment.
+ */
+int  mqtt_writev(struct mqtt_context* mqtt, const struct mqtt_iovec* iov, int count)
+{
+	FreeRTOS_Socket_t* pxSocket = (FreeRTOS_Socket_t*)*(Socket_t*)mqtt->network_tag;
+	int32_t xTotal = 0, xSent = 0;
+	BaseType_t xGathered = pdFALSE;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		xTotal += iov[i].len;
+	}
+
+	vTaskSuspendAll();
+	{
+		if ((pxSocket->u.xTCP.txStream != NULL) &&
+			(pxSocket->u.xTCP.ucTCPState == eESTABLISHED) &&
+			(FreeRTOS_tx_space(pxSocket) >= xTotal))
+		{
+			for (i = 0; i < count; i++)
+			{
+				xSent += (int32_t)uxStreamBufferAdd(pxSocket->u.xTCP.txStream, 0ul, iov[i].base, (size_t)iov[i].len);
+			}
+			xGathered = pdTRUE;
+		}
+	}
+	xTaskResumeAll();
+
+	if (xGathered != pdFALSE)
+	{
+		/* Let the IP task know there is data to send, the same way FreeRTOS_send() does. */
+		pxSocket->u.xTCP.usTimeout = 1u;
+		if (xIsCallingFromIPTask() == pdFALSE)
+		{
+			xSendEventToIPTask(eTCPTimerEvent);
+		}
+		return xSent;
+	}
+
+	/* The IP task and callers that hold the scheduler cannot wait for room in the stream. */
+	if ((xIsCallingFromIPTask() != pdFALSE) || (xTaskGetSchedulerState() == taskSCHEDULER_SUSPENDED))
+	{
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		BaseType_t xReturned = FreeRTOS_send((Socket_t)pxSocket,	/* The socket being sent to. */
+			(void*)iov[i].base,										/* The data being sent. */
+			iov[i].len,												/* The length of the data being sent. */
+			0);														/* No flags. */
+
+		if (xReturned != iov[i].len)
+		{
+			break;
+		}
+		xSent += xReturned;
+	}
+	return xSent;
+}
+
+#if MQTT_TX_PRIORITY
+/* Bytes in the socket's tx stream that the IP task has not yet taken into its send window. */
+int32_t mqtt_txQueued(struct mqtt_context* mqtt)
 {
-	/* Send the string to the socket. */
-	return FreeRTOS_send(*(Socket_t*)mqtt->network_tag,		/* The socket being sent to. */
-		(void*)ptr,												/* The data being sent. */
-		len,													/* The length of the data being sent. */
-		0);														/* No flags. */
+	FreeRTOS_Socket_t* pxSocket = (FreeRTOS_Socket_t*)*(Socket_t*)mqtt->network_tag;
+
+	if (pxSocket->u.xTCP.txStream == NULL)
+	{
+		return 0;
+	}
+	return (int32_t)uxStreamBufferMidSpace(pxSocket->u.xTCP.txStream);
 }
+#endif
 
+/* Read whatever the socket has buffered, up to len bytes. Blocks only until the first bytes
+ *   arrive or the receive timeout expires, in which case 0 is returned.
+ */
 int  mqtt_read(struct mqtt_context* mqtt, uint8_t* ptr, int32_t len)
 {
-	int32_t  xReceivedBytes = 0;
 	int xReturned;
 
-	while (xReceivedBytes < len)
+	xReturned = FreeRTOS_recv(*(Socket_t*)mqtt->network_tag,		/* The socket being received from. */
+		ptr,								/* The buffer into which the received data will be written. */
+		len,								/* The size of the buffer provided to receive the data. */
+		0);									/* No flags. */
+	configASSERT(xReturned >= 0);
+
+	return xReturned;
+}
+
+
+uint32_t mqtt_getTime(struct mqtt_context* mqtt)
+{
+	return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
+}
+
+/*-----------------------------------------------------------*/
+/* Keepalive. Every connection gets a one-shot software timer that is set to expire exactly when
+ *   mqtt_keepalive() has something to do, so an idle connection wakes up once per keepalive period
+ *   and a busy one not at all. The timer task outranks the IP task and the application tasks, so it
+ *   must not call into the core while one of them may be half way through a call of its own. It only
+ *   marks the check as due and notifies the task that started the keepalive, which calls
+ *   mqtt_keepalive() itself from mqtt_serviceKeepalive(). When the PINGRESP does not come the socket
+ *   is shut down, which ends any receive that waits on it.
+ */
+static struct {
+	struct mqtt_context* mqtt;
+	TimerHandle_t xTimer;
+	TaskHandle_t xOwner;
+	volatile BaseType_t xDue;
+} xKeepaliveTimers[mqttportMAX_KEEPALIVE_CONNECTIONS];
+
+static void prvKeepaliveTimer(TimerHandle_t xTimer)
+{
+	int i;
+
+	for (i = 0; i < mqttportMAX_KEEPALIVE_CONNECTIONS; i++)
+	{
+		if ((xKeepaliveTimers[i].xTimer == xTimer) && (xKeepaliveTimers[i].mqtt != NULL))
+		{
+			xKeepaliveTimers[i].xDue = pdTRUE;
+
+			/* Ends a wait of the owner on a stream buffer, those wait for a task notification. */
+			xTaskNotify(xKeepaliveTimers[i].xOwner, 0, eNoAction);
+		}
+	}
+}
+
+int  mqtt_startKeepalive(struct mqtt_context* mqtt)
+{
+	int i;
+
+	if (mqtt->keepaliveTimeout == 0)
 	{
-		xReturned = FreeRTOS_recv(*(Socket_t*)mqtt->network_tag,		/* The socket being received from. */
-			ptr + xReceivedBytes,				/* The buffer into which the received data will be written. */
-			len - xReceivedBytes,				/* The size of the buffer provided to receive the data. */
-			0);									/* No flags. */
-		configASSERT(xReturned >= 0);
+		return MQTT_SUCCESS;
+	}
+
+	for (i = 0; i < mqttportMAX_KEEPALIVE_CONNECTIONS; i++)
+	{
+		if (xKeepaliveTimers[i].mqtt == NULL)
+		{
+			/* Timers are created once and reused by later connections. */
+			if (xKeepaliveTimers[i].xTimer == NULL)
+			{
+				xKeepaliveTimers[i].xTimer = xTimerCreate("MQTTKeepalive", pdMS_TO_TICKS(1000), pdFALSE, NULL, prvKeepaliveTimer);
+				if (xKeepaliveTimers[i].xTimer == NULL)
+				{
+					return MQTT_ERROR;
+				}
+			}
+			xKeepaliveTimers[i].xOwner = xTaskGetCurrentTaskHandle();
+			xKeepaliveTimers[i].xDue = pdFALSE;
+			xKeepaliveTimers[i].mqtt = mqtt;
+			xTimerChangePeriod(xKeepaliveTimers[i].xTimer, pdMS_TO_TICKS(mqtt->keepaliveTimeout * 1000UL), portMAX_DELAY);
+			return MQTT_SUCCESS;
+		}
+	}
+	return MQTT_ERROR;
+}
 
-		if (xReturned == 0)
+void mqtt_stopKeepalive(struct mqtt_context* mqtt)
+{
+	int i;
+
+	for (i = 0; i < mqttportMAX_KEEPALIVE_CONNECTIONS; i++)
+	{
+		if (xKeepaliveTimers[i].mqtt == mqtt)
+		{
+			xTimerStop(xKeepaliveTimers[i].xTimer, portMAX_DELAY);
+			xKeepaliveTimers[i].mqtt = NULL;
+			xKeepaliveTimers[i].xDue = pdFALSE;
+		}
+	}
+}
+
+int  mqtt_serviceKeepalive(struct mqtt_context* mqtt)
+{
+	uint32_t ulNextCheck = 0;
+	int i, status;
+
+	for (i = 0; i < mqttportMAX_KEEPALIVE_CONNECTIONS; i++)
+	{
+		if ((xKeepaliveTimers[i].mqtt == mqtt) && (xKeepaliveTimers[i].xDue != pdFALSE))
 		{
-			/* Timed out. We must now exit*/
 			break;
 		}
-		else
+	}
+	if (i == mqttportMAX_KEEPALIVE_CONNECTIONS)
+	{
+		return MQTT_SUCCESS;
+	}
+	xKeepaliveTimers[i].xDue = pdFALSE;
+
+#if (ipconfigUSE_CALLBACKS == 1)
+	/* The IP task works on a bound context, keep it out as every other call into the core must. */
+	if (mqtt_boundMessages(mqtt) != NULL)
+	{
+		vTaskSuspendAll();
+		{
+			status = mqtt_keepalive(mqtt, &ulNextCheck);
+		}
+		xTaskResumeAll();
+	}
+	else
+#endif
+	{
+		status = mqtt_keepalive(mqtt, &ulNextCheck);
+	}
+
+	if (status == MQTT_ERROR)
+	{
+		FreeRTOS_debug_printf(("Keepalive : no PINGRESP, closing the connection\r\n"));
+		FreeRTOS_shutdown(*(Socket_t*)mqtt->network_tag, FREERTOS_SHUT_RDWR);
+		return MQTT_ERROR;
+	}
+	if (ulNextCheck > 0)
+	{
+		xTimerChangePeriod(xKeepaliveTimers[i].xTimer, pdMS_TO_TICKS(ulNextCheck) + 1, portMAX_DELAY);
+	}
+	return MQTT_SUCCESS;
+}
+
+/* Look at the next len bytes of the socket's rx stream without copying them out.
+ * Waits, like FreeRTOS_recv() would, until all len bytes are there and returns how many of
+ *   them are contiguous. Fewer than len means the data wraps around the end of the stream.
+ */
+int32_t mqtt_readView(struct mqtt_context* mqtt, uint8_t** pptr, int32_t len)
+{
+	FreeRTOS_Socket_t* pxSocket = (FreeRTOS_Socket_t*)*(Socket_t*)mqtt->network_tag;
+	TickType_t xRemainingTime = pxSocket->xReceiveBlockTime;
+	TimeOut_t xTimeOut;
+
+	/* The stream keeps one byte free, so larger packets can never be seen in one piece. */
+	if ((size_t)len >= pxSocket->u.xTCP.uxRxStreamSize)
+	{
+		return 0;
+	}
+
+	vTaskSetTimeOutState(&xTimeOut);
+	while (FreeRTOS_rx_size(pxSocket) < len)
+	{
+		if ((pxSocket->u.xTCP.ucTCPState != eESTABLISHED) ||
+			(xTaskCheckForTimeOut(&xTimeOut, &xRemainingTime) != pdFALSE))
 		{
-			/* Keep a count of the bytes received so far. */
-			xReceivedBytes += xReturned;
+			return 0;
 		}
+
+		/* Block until there is a down-stream event. */
+		xEventGroupWaitBits(pxSocket->xEventGroup, eSOCKET_RECEIVE | eSOCKET_CLOSED,
+			pdTRUE /*xClearOnExit*/, pdFALSE /*xWaitAllBits*/, xRemainingTime);
 	}
-	return xReceivedBytes;
+
+	return FreeRTOS_recv((Socket_t)pxSocket, (void*)pptr, len, FREERTOS_ZERO_COPY);
 }
 
+/* Done with a view, drop the bytes from the rx stream and let the window open up again. */
+void mqtt_releaseView(struct mqtt_context* mqtt, int32_t len)
+{
+	FreeRTOS_recv(*(Socket_t*)mqtt->network_tag, NULL, len, 0);
+}
 
 /*
  * What follows is an example of how a MQTT packet processor could be built as a middle layer.
- * This layer will receive MQTT messages (PUBLISH and others) from the network stream using 
- *   the read function and route the received messages to the appropriate processor.
+ * This layer will receive MQTT messages (PUBLISH and others) from the MQTT core, PUBLISH already
+ *   decoded in place and other packets via the receive function, and route them to the appropriate processor.
  * While PUBLISH messages are routed based on their Topic according to a lookup table, other
  *   messages are routed by message type as contained in the header.
  *
 */
 
-/* Prototype function pointer for callbacks */
-typedef void (*processPacketFn_t)(uint8_t* data, int32_t len);
-
 /* Two example functions to show how processing could happen in upstream modules. 
  * The function pointers could be stored statically as application level configuration or 
  *    be injected by the upstream modules at runtime by choice of the application.
  */
-void topic1Function(uint8_t* data, int32_t len) 
+void topic1Function(struct mqtt_message* msg) 
 {
-	FreeRTOS_debug_printf(("Topic 1 data : %s\r\n", data));
+	FreeRTOS_debug_printf(("Topic 1 data : %.*s\r\n", (int)msg->len, msg->pData));
 }
-void topic2Function(uint8_t* data, int32_t len) 
+void topic2Function(struct mqtt_message* msg) 
 {
-	FreeRTOS_debug_printf(("Topic 2 data : %s\r\n", data));
+	FreeRTOS_debug_printf(("Topic 2 data : %.*s\r\n", (int)msg->len, msg->pData));
 }
 
-/* Create a routing table for topic data (Topics here are NOT Topic filters with wildcards! */
-struct processingTable {
-	char   topicName[32];  /* Topic name to route */
-	processPacketFn_t fn;  /* Function for processing this topic */
-} processingTable[2] = {
+/* Routing table for topic data. These are Topic Filters, so '+' and '#' wildcards can be used and
+ *    one message may be handed to more than one function.
+ */
+static const struct processingTable {
+	const char*    topicFilter;  /* Topic filter to route */
+	mqtt_routeFn_t fn;           /* Function for processing matching topics */
+} processingTable[] = {
+#if !MQTT_STATIC_ROUTES
 	{"MyTopic", topic1Function},
-	{"OtherTopic", topic2Function}
+	{"OtherTopic", topic2Function},
+#endif
+	{"OtherTopic/+/status", topic2Function},
+	{"MyTopic/#", topic1Function}
 };
 
-/* Function to process and route packets. This function transforms the stream from TCP into
- *    a packet that lives in a statically allocated buffer
+/* The table is compiled into a topic trie the first time it is needed, from then on routing a
+ *    message costs one trie walk over its topic levels, however many filters there are.
  */
-int  mqtt_processPacket(struct mqtt_context* tag, struct mqtt_header* header)
+static struct mqtt_router router;
+
+/* Function to route PUBLISH messages by topic. The message data is handed to the processing
+ *    function where it was received, no copy is made and there is no size limit. Messages larger
+ *    than the input buffer are routed once per piece, see msg->offset and msg->total.
+ */
+int  mqtt_processPublish(struct mqtt_context* tag, struct mqtt_message* msg)
 {
-	int status = MQTT_ERROR;
-	static uint8_t buffer[128];
+#if (ipconfigUSE_CALLBACKS == 1)
+	struct StreamBufferDef_t* xMessages = mqtt_boundMessages(tag);
 
-	if (header->remainingLength > 128)
+	// Decoded by the IP task, leave the processing to the consumer of the connection
+	if (xMessages != NULL)
 	{
-		return MQTT_ERROR;
+		return mqtt_postMessage(xMessages, msg);
 	}
+#endif
 
-	// First always clear the buffer out
-	memset(buffer, 0, sizeof(buffer));
+	/* A message no route wants is printed and dropped on purpose. It still counts as taken, refusing it
+	 *   would leave it unacknowledged and the server would only send it again.
+	 */
+	(void)mqtt_routeMessage(msg);
+	return MQTT_SUCCESS;
+}
 
-	// Process our pubish packet. We could use a lookup table here to route by topic.
-	if (header->type == MQTT_PACKET_TYPE_PUBLISH)
+int  mqtt_routeMessage(struct mqtt_message* msg)
+{
+#if MQTT_STATIC_ROUTES
+	// Exact topics of the fixed set take the fast path and are not matched against the filters
+	if (mqtt_phashDispatch(&mqtt_staticRoutes, msg) == MQTT_SUCCESS)
 	{
-		uint16_t topicLength;
+		return MQTT_SUCCESS;
+	}
+#endif
 
-		// Read the entire packet into the processing buffer
-		if (mqtt_read(tag, buffer, header->remainingLength) == header->remainingLength)
+	if (router.count == 0)
+	{
+		mqtt_routerInit(&router);
+		for (int i = 0; i < sizeof(processingTable) / sizeof(processingTable[0]); i++)
 		{
-			topicLength = (buffer[0] << 8) + buffer[1];
-			
-			// If we get a valid topic length which does not excceed the packet length
-			if (topicLength < header->remainingLength - 2)
-			{
-				// In case we do not find it
-				// Route the packet to the right function
-				for (int i = 0; i < sizeof(processingTable) / sizeof(processingTable[0]); i++)
-				{
-					if (strncmp(&buffer[2], processingTable[i].topicName, topicLength) == 0)
-					{
-						// We found a match, process it!
-						status = MQTT_SUCCESS;
-						processingTable[i].fn(&buffer[topicLength + 2], header->remainingLength - topicLength - 2);
-					}
-				}
+			int added = mqtt_routerAdd(&router, processingTable[i].topicFilter, processingTable[i].fn);
+			configASSERT(added == MQTT_SUCCESS);
+			(void)added;
+		}
+	}
 
-				if (status == MQTT_ERROR)
-				{
-					// No match, just print it out
-					FreeRTOS_debug_printf(("Unprocessed Publish : %s\r\n", &buffer[topicLength + 2]));
-				}
-			}
-		}	
+	// Route the packet to every function with a matching filter
+	if (mqtt_routerDispatch(&router, msg) == 0)
+	{
+		// No match, just print it out
+		FreeRTOS_debug_printf(("Unprocessed Publish : %.*s\r\n", (int)msg->len, msg->pData));
+		return MQTT_ERROR;
 	}
-	else if ((header->type == MQTT_PACKET_TYPE_SUBACK) ||
-			 (header->type == MQTT_PACKET_TYPE_UNSUBACK))
+
+	return MQTT_SUCCESS;
+}
+
+/* Function to process all other packets. Their contents are read into a statically allocated buffer
+ */
+int  mqtt_processPacket(struct mqtt_context* tag, struct mqtt_header* header)
+{
+	static uint8_t buffer[128];
+
+	if (header->remainingLength > 128)
+	{
+		return MQTT_ERROR;
+	}
+
+	if ((header->type == MQTT_PACKET_TYPE_SUBACK) ||
+		(header->type == MQTT_PACKET_TYPE_UNSUBACK))
 	{
 		// Just read the data and ignore. For SUBACK it has packet ID and QOS values, for UNSUBACK just ID 
-		mqtt_read(tag, buffer, header->remainingLength);
-		status = MQTT_SUCCESS;
+		mqtt_receive(tag, buffer, header->remainingLength);
 	}
 	else // Just dump all other packets for now
 	{
-		mqtt_read(tag, buffer, header->remainingLength);
-		status = MQTT_SUCCESS;
+		mqtt_receive(tag, buffer, header->remainingLength);
 	}
 	
-	return status;
+	return MQTT_SUCCESS;
 }
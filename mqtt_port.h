@@ -0,0 +1,123 @@
+/*
+* This file contains the interface of the FreeRTOS+TCP port of the MQTT core that goes beyond the
+*   hooks the core itself needs
+*
+*/
+#ifndef MQTT_PORT_H
+#define MQTT_PORT_H
+
+#include "FreeRTOS.h"
+#include "FreeRTOS_IP.h"
+
+#include "MQTT/mqtt.h"
+
+/* Route one PUBLISH to the processing functions of the application. */
+int  mqtt_routeMessage(struct mqtt_message* msg);
+
+/* Number of connections that can have keepalive running at the same time. */
+#ifndef mqttportMAX_KEEPALIVE_CONNECTIONS
+#define mqttportMAX_KEEPALIVE_CONNECTIONS 2
+#endif
+
+/* Keep the connection of mqtt alive with a FreeRTOS software timer. PINGREQ is only sent when nothing else
+ *    was sent for keepaliveTimeout seconds. If the PINGRESP is missing the socket is shut down. Start from
+ *    the task that owns the connection once mqtt_Connect() has succeeded and stop before closing the socket.
+ * The timer never calls into the core itself, it notifies the owner, which has to call
+ *    mqtt_serviceKeepalive(). mqtt_receiveMessage() does so for a connection bound to the IP task, a task
+ *    that polls its connection calls it in its loop, at least once per receive timeout.
+ */
+int  mqtt_startKeepalive(struct mqtt_context* mqtt);
+void mqtt_stopKeepalive(struct mqtt_context* mqtt);
+
+/* Run mqtt_keepalive() if the timer found it due. Returns MQTT_ERROR if the PINGRESP is missing and the
+ *    socket was shut down.
+ */
+int  mqtt_serviceKeepalive(struct mqtt_context* mqtt);
+
+#if (ipconfigSUPPORT_SELECT_FUNCTION == 1)
+
+/* Number of connections one task can drive with mqtt_serviceConnections(). */
+#ifndef mqttportMAX_MANAGED_CONNECTIONS
+#define mqttportMAX_MANAGED_CONNECTIONS 8
+#endif
+
+/* Let the calling task service the connection of mqtt together with all other managed connections, instead
+ *    of giving every connection a task of its own. Call once mqtt_Connect() has succeeded. Managed
+ *    connections get their keepalive from mqtt_serviceConnections(), do not start a keepalive timer for them.
+ */
+int  mqtt_manageConnection(struct mqtt_context* mqtt);
+void mqtt_unmanageConnection(struct mqtt_context* mqtt);
+
+/* Wait up to xBlockTime for any managed connection to receive data and process everything that arrived.
+ *    Connections that were closed, by the server, for a missing PINGRESP or because mqtt_feed() failed on
+ *    what they received, are dropped from the set.
+ *    Returns how many were dropped, their sockets still need closing by the application.
+ */
+int  mqtt_serviceConnections(TickType_t xBlockTime);
+
+struct mqtt_broker;
+
+/* Connections waiting in the listen socket for mqtt_brokerService() to accept them. */
+#ifndef mqttportBROKER_BACKLOG
+#define mqttportBROKER_BACKLOG 4
+#endif
+
+/* Longest time mqtt_brokerService() waits before it checks the keepalive of the clients. */
+#ifndef mqttportBROKER_CHECK_PERIOD_MS
+#define mqttportBROKER_CHECK_PERIOD_MS 1000
+#endif
+
+/* Run broker as an MQTT server for clients on the local network, listening on usPort. Only one broker
+ *    can listen at a time. Clients are limited by MQTT_BROKER_MAX_CLIENTS and by the sockets and
+ *    network buffers FreeRTOS+TCP is configured with.
+ */
+int  mqtt_brokerListen(struct mqtt_broker* broker, uint16_t usPort);
+
+/* Wait up to xBlockTime for new connections or data from any client and process everything that arrived,
+ *    all from the calling task. Returns how many client connections were closed.
+ */
+int  mqtt_brokerService(struct mqtt_broker* broker, TickType_t xBlockTime);
+
+#endif /* ipconfigSUPPORT_SELECT_FUNCTION */
+
+#if (ipconfigUSE_CALLBACKS == 1)
+
+/* Stream buffers are named by their struct, the same type as a StreamBufferHandle_t, as stream_buffer.h
+ *    clashes with the FreeRTOS+TCP stream buffer header used in mqtt_port.c.
+ */
+struct StreamBufferDef_t;
+
+/* Number of connections that can be bound to the IP task at the same time. */
+#ifndef mqttportMAX_BOUND_CONNECTIONS
+#define mqttportMAX_BOUND_CONNECTIONS 2
+#endif
+
+/* Decode everything received on the connection of mqtt from within the IP task, through the socket's
+ *    FREERTOS_SO_TCP_RECV_HANDLER, instead of with mqtt_pollInput(). Acknowledgements are handled and
+ *    sent by the IP task, only complete PUBLISH messages are posted to xMessages for a consumer to pick
+ *    up with mqtt_receiveMessage(). Call once mqtt_Connect() has succeeded, or just before
+ *    mqtt_connect_pipelined() so the IP task takes in the CONNACK as well.
+ * While bound, the IP task changes the MQTT context at any time. Other calls into the core, like
+ *    mqtt_publish(), must be made between vTaskSuspendAll() and xTaskResumeAll(). They will fail rather
+ *    than block when the socket has no room.
+ */
+int  mqtt_bindIPTask(struct mqtt_context* mqtt, struct StreamBufferDef_t* xMessages);
+void mqtt_unbindIPTask(struct mqtt_context* mqtt);
+
+/* Wait for the next message posted by the IP task and decode it into msg. The topic and data are copied
+ *    into pBuffer and msg points into it. Returns MQTT_ERROR on time-out, if the message did not fit or if
+ *    the keepalive of the connection, which is serviced while waiting, found the PINGRESP missing.
+ */
+int  mqtt_receiveMessage(struct StreamBufferDef_t* xMessages, uint8_t* pBuffer, size_t uxBufferSize, TickType_t xTicksToWait, struct mqtt_message* msg);
+
+/* Used by mqtt_processPublish() to hand messages decoded by the IP task to the consumer of their connection.
+ *    mqtt_postMessage() returns MQTT_ERROR when xMessages has no room. A QoS 1 or 2 message is then not
+ *    acknowledged and the server delivers it again, a QoS 0 message is lost. Size xMessages for the
+ *    bursts the consumer has to absorb.
+ */
+struct StreamBufferDef_t* mqtt_boundMessages(struct mqtt_context* mqtt);
+int  mqtt_postMessage(struct StreamBufferDef_t* xMessages, struct mqtt_message* msg);
+
+#endif /* ipconfigUSE_CALLBACKS */
+
+#endif /* MQTT_PORT_H */
@@ -0,0 +1,200 @@
+/*
+* This file binds MQTT connections to the FreeRTOS+TCP IP task, see mqtt_bindIPTask() in mqtt_port.h
+*
+*/
+/* FreeRTOS includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "stream_buffer.h"
+
+/* FreeRTOS+TCP includes. */
+#include "FreeRTOS_IP.h"
+#include "FreeRTOS_Sockets.h"
+
+#include "mqtt_port.h"
+
+#if (ipconfigUSE_CALLBACKS == 1)
+/* IP task binding. Every TCP segment received on a bound socket is handed to mqtt_feed() by the IP task
+ *   itself, straight from the network buffer when the rx stream is empty, so no task has to wake up to
+ *   read it. PUBLISH messages are passed on through a stream buffer as a struct mqtt_postedMessage
+ *   followed by the topic and the data. The IP task is the only writer, so the parts of one message
+ *   are never interleaved with those of another.
+ */
+struct mqtt_postedMessage {
+	uint8_t  flags;
+	uint16_t packetId;
+	uint16_t topicLength;
+	int32_t  len;
+	int32_t  offset;
+	int32_t  total;
+};
+
+static struct {
+	Socket_t xSocket;
+	struct mqtt_context* mqtt;
+	StreamBufferHandle_t xMessages;
+} xBoundConnections[mqttportMAX_BOUND_CONNECTIONS];
+
+static BaseType_t prvOnTcpReceive(Socket_t xSocket, void* pData, size_t xLength)
+{
+	int i;
+
+	for (i = 0; i < mqttportMAX_BOUND_CONNECTIONS; i++)
+	{
+		if (xBoundConnections[i].xSocket == xSocket)
+		{
+			mqtt_feed(xBoundConnections[i].mqtt, (const uint8_t*)pData, (int32_t)xLength);
+			break;
+		}
+	}
+
+	/* The data has been used, do not keep it in the rx stream. */
+	return 1;
+}
+
+StreamBufferHandle_t mqtt_boundMessages(struct mqtt_context* mqtt)
+{
+	int i;
+
+	for (i = 0; i < mqttportMAX_BOUND_CONNECTIONS; i++)
+	{
+		if (xBoundConnections[i].mqtt == mqtt)
+		{
+			return xBoundConnections[i].xMessages;
+		}
+	}
+	return NULL;
+}
+
+/* Called from the IP task, so this never blocks. A message that does not fit is refused with MQTT_ERROR,
+ *   which leaves a QoS 1 or 2 message unacknowledged so the server sends it again. The pieces of a message
+ *   too large for the input buffer are posted one by one, each with its topic. Once one piece is refused
+ *   the rest are not passed up, the consumer sees the message start over at offset 0 when it comes again.
+ */
+int  mqtt_postMessage(StreamBufferHandle_t xMessages, struct mqtt_message* msg)
+{
+	struct mqtt_postedMessage xHeader = { msg->flags, msg->packetId, msg->topicLength, msg->len, msg->offset, msg->total };
+
+	if (xStreamBufferSpacesAvailable(xMessages) < sizeof(xHeader) + msg->topicLength + msg->len)
+	{
+		FreeRTOS_debug_printf(("Dropped Publish : no room for %d bytes\r\n", (int)msg->len));
+		return MQTT_ERROR;
+	}
+
+	xStreamBufferSend(xMessages, &xHeader, sizeof(xHeader), 0);
+	xStreamBufferSend(xMessages, msg->topic, msg->topicLength, 0);
+	xStreamBufferSend(xMessages, msg->pData, msg->len, 0);
+	return MQTT_SUCCESS;
+}
+
+int  mqtt_bindIPTask(struct mqtt_context* mqtt, StreamBufferHandle_t xMessages)
+{
+	Socket_t xSocket = *(Socket_t*)mqtt->network_tag;
+	F_TCP_UDP_Handler_t xHandler = { 0 };
+	uint8_t* pucData;
+	BaseType_t xCount;
+	int i, status = MQTT_ERROR;
+
+	xHandler.pxOnTCPReceive = prvOnTcpReceive;
+
+	/* Hold the IP task while the handler is installed, so nothing it receives can slip past the core. */
+	vTaskSuspendAll();
+	{
+		for (i = 0; i < mqttportMAX_BOUND_CONNECTIONS; i++)
+		{
+			if (xBoundConnections[i].mqtt == NULL)
+			{
+				xBoundConnections[i].xSocket = xSocket;
+				xBoundConnections[i].mqtt = mqtt;
+				xBoundConnections[i].xMessages = xMessages;
+				FreeRTOS_setsockopt(xSocket, 0, FREERTOS_SO_TCP_RECV_HANDLER, &xHandler, sizeof(xHandler));
+
+				/* Whatever arrived since mqtt_Connect() is already in the rx stream, decode that first. */
+				while ((xCount = FreeRTOS_recv(xSocket, &pucData, ipconfigTCP_MSS, FREERTOS_ZERO_COPY | FREERTOS_MSG_DONTWAIT)) > 0)
+				{
+					mqtt_feed(mqtt, pucData, (int32_t)xCount);
+					FreeRTOS_recv(xSocket, NULL, xCount, 0);
+				}
+				status = MQTT_SUCCESS;
+				break;
+			}
+		}
+	}
+	xTaskResumeAll();
+
+	return status;
+}
+
+void mqtt_unbindIPTask(struct mqtt_context* mqtt)
+{
+	F_TCP_UDP_Handler_t xHandler = { 0 };
+	int i;
+
+	vTaskSuspendAll();
+	{
+		for (i = 0; i < mqttportMAX_BOUND_CONNECTIONS; i++)
+		{
+			if (xBoundConnections[i].mqtt == mqtt)
+			{
+				FreeRTOS_setsockopt(xBoundConnections[i].xSocket, 0, FREERTOS_SO_TCP_RECV_HANDLER, &xHandler, sizeof(xHandler));
+				xBoundConnections[i].xSocket = NULL;
+				xBoundConnections[i].mqtt = NULL;
+				xBoundConnections[i].xMessages = NULL;
+			}
+		}
+	}
+	xTaskResumeAll();
+}
+
+int  mqtt_receiveMessage(StreamBufferHandle_t xMessages, uint8_t* pBuffer, size_t uxBufferSize, TickType_t xTicksToWait, struct mqtt_message* msg)
+{
+	struct mqtt_postedMessage xHeader;
+	struct mqtt_context* mqtt = NULL;
+	TimeOut_t xTimeOut;
+	size_t uxLength;
+	int i;
+
+	for (i = 0; i < mqttportMAX_BOUND_CONNECTIONS; i++)
+	{
+		if ((xBoundConnections[i].xMessages == xMessages) && (xBoundConnections[i].mqtt != NULL))
+		{
+			mqtt = xBoundConnections[i].mqtt;
+		}
+	}
+
+	/* The keepalive timer cuts the wait short when a check is due, it is done here by the owner of the
+	 *   connection and the wait goes on for whatever time is left.
+	 */
+	vTaskSetTimeOutState(&xTimeOut);
+	while (xStreamBufferReceive(xMessages, &xHeader, sizeof(xHeader), xTicksToWait) != sizeof(xHeader))
+	{
+		if (((mqtt != NULL) && (mqtt_serviceKeepalive(mqtt) != MQTT_SUCCESS)) ||
+			(xTaskCheckForTimeOut(&xTimeOut, &xTicksToWait) != pdFALSE))
+		{
+			return MQTT_ERROR;
+		}
+	}
+
+	/* The rest of the message was written together with its header. */
+	uxLength = xHeader.topicLength + xHeader.len;
+	if (uxLength > uxBufferSize)
+	{
+		while (uxLength > 0)
+		{
+			uxLength -= xStreamBufferReceive(xMessages, pBuffer, (uxLength < uxBufferSize) ? uxLength : uxBufferSize, 0);
+		}
+		return MQTT_ERROR;
+	}
+	xStreamBufferReceive(xMessages, pBuffer, uxLength, 0);
+
+	msg->flags = xHeader.flags;
+	msg->packetId = xHeader.packetId;
+	msg->topic = (char*)pBuffer;
+	msg->topicLength = xHeader.topicLength;
+	msg->pData = pBuffer + xHeader.topicLength;
+	msg->len = xHeader.len;
+	msg->offset = xHeader.offset;
+	msg->total = xHeader.total;
+	return MQTT_SUCCESS;
+}
+#endif /* ipconfigUSE_CALLBACKS */
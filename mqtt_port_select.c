@@ -0,0 +1,142 @@
+/*
+* This file lets a single task drive many MQTT connections, see mqtt_manageConnection() in mqtt_port.h
+*
+*/
+/* FreeRTOS includes. */
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* FreeRTOS+TCP includes. */
+#include "FreeRTOS_IP.h"
+#include "FreeRTOS_Sockets.h"
+
+#include "mqtt_port.h"
+
+#if (ipconfigSUPPORT_SELECT_FUNCTION == 1)
+/* All managed sockets sit in one socket set and the task waits for any of them in FreeRTOS_select().
+ *   Received bytes are handed to mqtt_feed(), which keeps the decoding state of every connection in
+ *   its own context, so a connection that only got half a packet never holds up the others.
+ *   Keepalive is handled by the same task, the select time-out is cut short when a ping is due.
+ */
+static SocketSet_t xSocketSet = NULL;
+static struct mqtt_context* pxManagedConnections[mqttportMAX_MANAGED_CONNECTIONS];
+
+int  mqtt_manageConnection(struct mqtt_context* mqtt)
+{
+	int i;
+
+	if (xSocketSet == NULL)
+	{
+		xSocketSet = FreeRTOS_CreateSocketSet();
+		if (xSocketSet == NULL)
+		{
+			return MQTT_ERROR;
+		}
+	}
+
+	for (i = 0; i < mqttportMAX_MANAGED_CONNECTIONS; i++)
+	{
+		if (pxManagedConnections[i] == NULL)
+		{
+			pxManagedConnections[i] = mqtt;
+			FreeRTOS_FD_SET(*(Socket_t*)mqtt->network_tag, xSocketSet, eSELECT_READ | eSELECT_EXCEPT);
+			return MQTT_SUCCESS;
+		}
+	}
+	return MQTT_ERROR;
+}
+
+void mqtt_unmanageConnection(struct mqtt_context* mqtt)
+{
+	int i;
+
+	for (i = 0; i < mqttportMAX_MANAGED_CONNECTIONS; i++)
+	{
+		if (pxManagedConnections[i] == mqtt)
+		{
+			FreeRTOS_FD_CLR(*(Socket_t*)mqtt->network_tag, xSocketSet, eSELECT_ALL);
+			pxManagedConnections[i] = NULL;
+		}
+	}
+}
+
+int  mqtt_serviceConnections(TickType_t xBlockTime)
+{
+	struct mqtt_context* mqtt;
+	Socket_t xSocket;
+	EventBits_t xBits;
+	BaseType_t xCount;
+	uint8_t* pucData;
+	uint32_t ulNextCheck;
+	int i, iResult, lost = 0;
+
+	/* Ping the idle connections and sleep no longer than until the next one is due. */
+	for (i = 0; i < mqttportMAX_MANAGED_CONNECTIONS; i++)
+	{
+		mqtt = pxManagedConnections[i];
+		if (mqtt == NULL)
+		{
+			continue;
+		}
+
+		if (mqtt_keepalive(mqtt, &ulNextCheck) == MQTT_ERROR)
+		{
+			FreeRTOS_debug_printf(("Keepalive : no PINGRESP, closing the connection\r\n"));
+			FreeRTOS_shutdown(*(Socket_t*)mqtt->network_tag, FREERTOS_SHUT_RDWR);
+			mqtt_unmanageConnection(mqtt);
+			lost++;
+		}
+		else if ((ulNextCheck > 0) && (pdMS_TO_TICKS(ulNextCheck) + 1 < xBlockTime))
+		{
+			xBlockTime = pdMS_TO_TICKS(ulNextCheck) + 1;
+		}
+	}
+
+	if ((xSocketSet == NULL) || (FreeRTOS_select(xSocketSet, xBlockTime) == 0))
+	{
+		return lost;
+	}
+
+	for (i = 0; i < mqttportMAX_MANAGED_CONNECTIONS; i++)
+	{
+		mqtt = pxManagedConnections[i];
+		if (mqtt == NULL)
+		{
+			continue;
+		}
+
+		xSocket = *(Socket_t*)mqtt->network_tag;
+		xBits = FreeRTOS_FD_ISSET(xSocket, xSocketSet);
+		xCount = 0;
+		iResult = MQTT_SUCCESS;
+
+		/* Take whatever is there without waiting, straight from the rx stream. */
+		if (xBits & eSELECT_READ)
+		{
+			while ((iResult == MQTT_SUCCESS) &&
+				   ((xCount = FreeRTOS_recv(xSocket, &pucData, ipconfigTCP_MSS * 4, FREERTOS_ZERO_COPY | FREERTOS_MSG_DONTWAIT)) > 0))
+			{
+				iResult = mqtt_feed(mqtt, pucData, (int32_t)xCount);
+				FreeRTOS_recv(xSocket, NULL, xCount, 0);
+			}
+		}
+
+		/* A malformed stream or a packet that was not processed leaves the session out of step with
+		 *   the server, the connection is closed so the server resends whatever was not acknowledged. */
+		if (iResult == MQTT_ERROR)
+		{
+			FreeRTOS_debug_printf(("Service : packet not processed, closing the connection\r\n"));
+			FreeRTOS_shutdown(xSocket, FREERTOS_SHUT_RDWR);
+			mqtt_unmanageConnection(mqtt);
+			lost++;
+		}
+		else if ((xBits & eSELECT_EXCEPT) || (xCount < 0))
+		{
+			mqtt_unmanageConnection(mqtt);
+			lost++;
+		}
+	}
+
+	return lost;
+}
+#endif /* ipconfigSUPPORT_SELECT_FUNCTION */
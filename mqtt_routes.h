@@ -0,0 +1,15 @@
+/*
+* Generated by Tools/mqtt_phashgen.c, do not edit
+*
+*/
+#include "MQTT/mqtt_phash.h"
+
+void topic1Function( struct mqtt_message* msg );
+void topic2Function( struct mqtt_message* msg );
+
+static const struct mqtt_phashEntry mqtt_staticRoutes_slots[ 2 ] = {
+	{ "MyTopic", 7, topic1Function },
+	{ "OtherTopic", 10, topic2Function },
+};
+
+static const struct mqtt_phashTable mqtt_staticRoutes = { 0UL, 1UL, mqtt_staticRoutes_slots };
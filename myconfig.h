@@ -9,6 +9,8 @@
 #define mainDEVICE_NICK_NAME		"windows_demo"
 
 #define mainCREATE_TCP_ECHO_TASKS_SINGLE			1
+#define mainCREATE_MQTT_MULTI_CLIENT_TASK			0
+#define mainCREATE_MQTT_BROKER_TASK					0
 
 
 /* The default IP and MAC address used by the demo.  The address configuration